@@ -11,42 +11,7 @@
 #include "render.c"
 #include "volume_draw.c"
 #include "light.c"
-
-double region_get_sector_value (void *reg, int x, int y, int z)
-{
-  if (!reg)
-     return 0;
-
-  vec3_init (secpos, x, y, z);
-  double l = fabs (vec3_len (secpos));
-  if (l < 1)
-    return 1.85; // the core
-  else if (l < 200
-           && ((abs (x) < 1 && abs (y) < 1)
-               || (abs (z) < 1 && abs (y) < 1)
-               || (abs (x) < 1 && abs (z) < 1)))
-    return 1.65; // the axis, going from center to the outer construct connection
-  else if (l < 30 // here we check the void: void is in the inner shell surface
-           || (l > 130 // and beyond the outer shell surface, but only if inside the
-                       // huge construct cube which spans 200 in each direction
-               && (abs (x) < 200 && abs (y) < 200 && abs (z) < 200)))
-    return 1.55; // the void
-  else // we are in the sphere shell around that
-    {
-      double *region = reg;
-      int reg_size = region[0];
-      region++;
-
-      if (x < 0) x = -x;
-      if (y < 0) y = -y;
-      if (z < 0) z = -z;
-      x %= reg_size;
-      y %= reg_size;
-      z %= reg_size;
-
-      return region[x + y * reg_size + z * reg_size * reg_size];
-    }
-}
+#include "region.c"
 
 unsigned int vox_cone_sphere_intersect (double cam_x, double cam_y, double cam_z, double cam_v_x, double cam_v_y, double cam_v_z, double cam_fov, double sphere_x, double sphere_y, double sphere_z, double sphere_rad)
 {
@@ -78,6 +43,186 @@ unsigned int vox_cone_sphere_intersect (double cam_x, double cam_y, double cam_z
     return 0;
 }
 
+/* The world scans below collect their results in an integer buffer,
+ * which is either returned as array or as string of packed native
+ * 32 bit integers (see the *_packed variants in the XS part).
+ */
+AV *vox_int_buf_to_av (vox_int_buf *b)
+{
+  AV *av = newAV ();
+  sv_2mortal ((SV *) av);
+
+  unsigned int i;
+  if (b->len)
+    av_extend (av, b->len - 1);
+  for (i = 0; i < b->len; i++)
+    av_push (av, newSViv (b->data[i]));
+
+  vox_int_buf_free (b);
+  return av;
+}
+
+SV *vox_int_buf_to_packed (vox_int_buf *b)
+{
+  SV *sv = newSVpvn (b->data ? (char *) b->data : "", sizeof (int) * b->len);
+  vox_int_buf_free (b);
+  return sv;
+}
+
+// Collects type, x, y, z of every visible cell in the chunk.
+void vox_world_chunk_visible_faces_buf (int x, int y, int z, vox_int_buf *out)
+{
+  vox_chunk *chnk = vox_world_chunk (x, y, z, 0);
+  if (!chnk)
+    return;
+
+  for (z = 0; z < CHUNK_SIZE; z++)
+    for (y = 0; y < CHUNK_SIZE; y++)
+      for (x = 0; x < CHUNK_SIZE; x++)
+        {
+          if (chnk->cells[REL_POS2OFFS(x, y, z)].visible)
+            {
+              vox_int_buf_push (out, chnk->cells[REL_POS2OFFS(x, y, z)].type);
+              vox_int_buf_push (out, x);
+              vox_int_buf_push (out, y);
+              vox_int_buf_push (out, z);
+            }
+        }
+}
+
+// Collects positions at walls, where a light could be placed.
+void vox_world_query_possible_light_positions_buf (vox_world_query *q, vox_int_buf *out)
+{
+  int xw = q->x_w * CHUNK_SIZE,
+      yw = q->y_w * CHUNK_SIZE,
+      zw = q->z_w * CHUNK_SIZE;
+
+  static int offsets[6][3] = {
+      {  0,  0,  1 },
+      {  0,  0, -1 },
+      {  0,  1,  0 },
+      {  0, -1,  0 },
+      {  1,  0,  0 },
+      { -1,  0,  0 },
+  };
+
+  int x, y, z;
+  for (x = 2; x < (xw - 2); x += 6)
+    for (y = 2; y < (yw - 2); y += 6)
+      for (z = 2; z < (zw - 2); z += 6)
+         {
+           int ix, iy, iz;
+           int rad, found = 0;
+           int i;
+           int fnd = 0;
+           for (i = 0; !fnd && i < 6; i++)
+             {
+               int m;
+               for (m = 1; m <= 2; m++)
+                 {
+                   int px = x + offsets[i][0] * (m - 1),
+                       py = y + offsets[i][1] * (m - 1),
+                       pz = z + offsets[i][2] * (m - 1);
+
+                   vox_cell *cur = vox_world_query_cell_at (q, px, py, pz, 0);
+                   if (!cur || cur->type != 0)
+                     continue;
+
+                   cur = vox_world_query_cell_at (q,
+                     x + offsets[i][0] * m,
+                     y + offsets[i][1] * m,
+                     z + offsets[i][2] * m,
+                     0);
+                   if (cur && cur->type != 0)
+                     {
+                       vox_int_buf_push (out, px + q->chnk_x * CHUNK_SIZE);
+                       vox_int_buf_push (out, py + q->chnk_y * CHUNK_SIZE);
+                       vox_int_buf_push (out, pz + q->chnk_z * CHUNK_SIZE);
+                       fnd = 1;
+                       break;
+                     }
+                 }
+             }
+         }
+}
+
+/* Collects the types of the cells in the cube at x,y,z, or x, y, z
+ * and type of the cells of the type "type_match" if it is >= 0.
+ */
+void vox_world_get_types_in_cube_buf (int x, int y, int z, int size, int type_match, vox_int_buf *out)
+{
+  vec3_init (pos1, x, y, z);
+  vec3_s_div (pos1, CHUNK_SIZE);
+  vec3_floor (pos1);
+
+  vec3_init (pos2, x + size, y + size, z + size);
+  vec3_s_div (pos2, CHUNK_SIZE);
+  vec3_floor (pos2);
+
+  vox_world_query *q = vox_world_query_new ();
+  vox_world_query_setup (q,
+    (int) pos1[0], (int) pos1[1], (int) pos1[2],
+    (int) pos2[0], (int) pos2[1], (int) pos2[2]
+  );
+
+  vox_world_query_load_chunks (q, 0);
+
+  int cx = x, cy = y, cz = z;
+  vox_world_query_abs2rel (q, &cx, &cy, &cz);
+
+  int dx, dy, dz;
+  for (dx = 0; dx < size; dx++)
+    for (dy = 0; dy < size; dy++)
+      for (dz = 0; dz < size; dz++)
+        {
+          vox_cell *cur = vox_world_query_cell_at (q, cx + dx, cy + dy, cz + dz, 0);
+          if (!cur)
+            continue;
+
+          if (type_match >= 0)
+            {
+              if (cur->type == type_match)
+                {
+                  vox_int_buf_push (out, x + dx);
+                  vox_int_buf_push (out, y + dy);
+                  vox_int_buf_push (out, z + dz);
+                  vox_int_buf_push (out, cur->type);
+                }
+            }
+          else
+            vox_int_buf_push (out, cur->type);
+        }
+
+  vox_world_query_desetup (q, 1);
+  vox_world_query_free (q);
+}
+
+// Collects the positions of all cells of type t1, t2 or t3.
+void vox_world_query_search_types_buf (vox_world_query *q, int t1, int t2, int t3, vox_int_buf *out)
+{
+  int xw = q->x_w * CHUNK_SIZE,
+      yw = q->y_w * CHUNK_SIZE,
+      zw = q->z_w * CHUNK_SIZE;
+  vox_query_cursor c;
+  int x, y, z;
+  for (x = 0; x < xw; x++)
+    for (y = 0; y < yw; y++)
+      for (z = 0, vox_query_cursor_set (&c, q, x, y, 0);
+           z < zw;
+           z++, vox_query_cursor_step (&c, QUERY_CURSOR_Z, 1))
+         {
+           vox_cell *cur = vox_query_cursor_cell (&c, 0);
+           if (cur && (cur->type == t1 || cur->type == t2 || cur->type == t3))
+             {
+                int rx = x, ry = y, rz = z;
+                vox_world_query_rel2abs (q, &rx, &ry, &rz);
+                vox_int_buf_push (out, rx);
+                vox_int_buf_push (out, ry);
+                vox_int_buf_push (out, rz);
+             }
+         }
+}
+
 MODULE = Games::VoxEngine PACKAGE = Games::VoxEngine::Math PREFIX = vox_
 
 unsigned int vox_cone_sphere_intersect (double cam_x, double cam_y, double cam_z, double cam_v_x, double cam_v_y, double cam_v_z, double cam_fov, double sphere_x, double sphere_y, double sphere_z, double sphere_rad);
@@ -236,6 +381,16 @@ void vox_world_init (SV *change_cb, SV *cell_change_cb)
      SvREFCNT_inc (cell_change_cb);
      WORLD.active_cell_change_cb = cell_change_cb;
 
+void vox_world_set_batch_callbacks (SV *chunks_cb, SV *cells_cb)
+  CODE:
+     if (WORLD.chunk_change_batch_cb)
+       SvREFCNT_dec (WORLD.chunk_change_batch_cb);
+     if (WORLD.active_cell_change_batch_cb)
+       SvREFCNT_dec (WORLD.active_cell_change_batch_cb);
+
+     WORLD.chunk_change_batch_cb       = SvOK (chunks_cb) ? newSVsv (chunks_cb) : 0;
+     WORLD.active_cell_change_batch_cb = SvOK (cells_cb)  ? newSVsv (cells_cb)  : 0;
+
 
 int
 vox_world_has_chunk (int x, int y, int z)
@@ -263,6 +418,24 @@ vox_world_get_chunk_data (int x, int y, int z)
   OUTPUT:
     RETVAL
 
+SV *
+vox_world_get_chunk_gens_packed (int x, int y, int z, int n)
+  CODE:
+    // the modification counters of the n * n * n chunks from x, y, z as
+    // packed native 32 bit integers, x outer, z inner, 0 for missing chunks.
+    vox_int_buf out = { 0 };
+    int dx, dy, dz;
+    for (dx = 0; dx < n; dx++)
+      for (dy = 0; dy < n; dy++)
+        for (dz = 0; dz < n; dz++)
+          {
+            vox_chunk *chnk = vox_world_chunk (x + dx, y + dy, z + dz, 0);
+            vox_int_buf_push (&out, chnk ? (int) chnk->gen : 0);
+          }
+    RETVAL = vox_int_buf_to_packed (&out);
+  OUTPUT:
+    RETVAL
+
 
 int vox_world_set_chunk_data (int x, int y, int z, unsigned char *data, unsigned int len)
   CODE:
@@ -301,6 +474,104 @@ int vox_world_is_solid_at (double x, double y, double z)
   OUTPUT:
     RETVAL
 
+AV *
+vox_world_raycast (double x, double y, double z, double dx, double dy, double dz, double max_dist)
+  CODE:
+    // returns the first blocking cell, the normal of the hit face and
+    // the distance, or an empty array.
+    vec3_init (pos, x, y, z);
+    vec3_init (dir, dx, dy, dz);
+    int cell[3], face[3];
+    double dist;
+
+    RETVAL = newAV ();
+    sv_2mortal ((SV *)RETVAL);
+
+    if (vox_world_raycast (pos, dir, max_dist, cell, face, &dist))
+      {
+        int i;
+        for (i = 0; i < 3; i++)
+          av_push (RETVAL, newSViv (cell[i]));
+        for (i = 0; i < 3; i++)
+          av_push (RETVAL, newSViv (face[i]));
+        av_push (RETVAL, newSVnv (dist));
+      }
+  OUTPUT:
+    RETVAL
+
+SV *
+vox_world_raycast_packed (SV *rays, double max_dist)
+  CODE:
+    // rays are packed native doubles (x, y, z, dx, dy, dz), the result has
+    // packed doubles (cell x, y, z, face x, y, z, distance) for each ray.
+    // The distance is -1 if the ray didn't hit anything.
+    STRLEN len;
+    double *ray = (double *) SvPVbyte (rays, len);
+    unsigned int n = len / (sizeof (double) * 6), i;
+
+    RETVAL = newSV (sizeof (double) * 7 * n + 1);
+    SvPOK_only (RETVAL);
+    SvCUR_set (RETVAL, sizeof (double) * 7 * n);
+    double *out = (double *) SvPVX (RETVAL);
+
+    for (i = 0; i < n; i++)
+      {
+        int cell[3], face[3], k;
+        double dist;
+        double *r = ray + i * 6, *o = out + i * 7;
+
+        if (vox_world_raycast (r, r + 3, max_dist, cell, face, &dist))
+          {
+            for (k = 0; k < 3; k++)
+              {
+                o[k]     = cell[k];
+                o[k + 3] = face[k];
+              }
+            o[6] = dist;
+          }
+        else
+          {
+            for (k = 0; k < 6; k++)
+              o[k] = 0;
+            o[6] = -1;
+          }
+      }
+  OUTPUT:
+    RETVAL
+
+AV *
+vox_world_collide (double x, double y, double z, double rad, double plh, AV *from = 0)
+  CODE:
+    // returns the new position, the summed up collision normal and the
+    // result of vox_world_collide: [x, y, z, nx, ny, nz, collided]
+    vec3_init (pos, x, y, z);
+    double normal[3];
+    int collided, i;
+
+    if (from)
+      {
+        double f[3];
+        for (i = 0; i < 3; i++)
+          {
+            SV **e = av_fetch (from, i, 0);
+            f[i] = e ? SvNV (*e) : pos[i];
+          }
+        collided = vox_world_collide_swept (f, pos, rad, plh, normal);
+      }
+    else
+      collided = vox_world_collide (pos, rad, plh, normal);
+
+    RETVAL = newAV ();
+    sv_2mortal ((SV *)RETVAL);
+
+    for (i = 0; i < 3; i++)
+      av_push (RETVAL, newSVnv (pos[i]));
+    for (i = 0; i < 3; i++)
+      av_push (RETVAL, newSVnv (normal[i]));
+    av_push (RETVAL, newSViv (collided));
+  OUTPUT:
+    RETVAL
+
 void vox_world_set_object_type (unsigned int type, unsigned int transparent, unsigned int blocking, unsigned int has_txt, unsigned int active, double uv0, double uv1, double uv2, double uv3);
 
 void vox_world_set_object_model (unsigned int type, unsigned int dim, AV *blocks);
@@ -328,101 +599,151 @@ vox_world_at (double x, double y, double z)
 AV *
 vox_world_chunk_visible_faces (int x, int y, int z)
   CODE:
-    vox_chunk *chnk = vox_world_chunk (x, y, z, 0);
-
-    RETVAL = newAV ();
-    sv_2mortal ((SV *)RETVAL);
-
-    for (z = 0; z < CHUNK_SIZE; z++)
-      for (y = 0; y < CHUNK_SIZE; y++)
-        for (x = 0; x < CHUNK_SIZE; x++)
-          {
-            if (chnk->cells[REL_POS2OFFS(x, y, z)].visible)
-              {
-                av_push (RETVAL, newSViv (chnk->cells[REL_POS2OFFS(x, y, z)].type));
-                av_push (RETVAL, newSVnv (x));
-                av_push (RETVAL, newSVnv (y));
-                av_push (RETVAL, newSVnv (z));
-              }
-          }
+    vox_int_buf out = { 0 };
+    vox_world_chunk_visible_faces_buf (x, y, z, &out);
+    RETVAL = vox_int_buf_to_av (&out);
+  OUTPUT:
+    RETVAL
 
+SV *
+vox_world_chunk_visible_faces_packed (int x, int y, int z)
+  CODE:
+    vox_int_buf out = { 0 };
+    vox_world_chunk_visible_faces_buf (x, y, z, &out);
+    RETVAL = vox_int_buf_to_packed (&out);
   OUTPUT:
     RETVAL
 
-void vox_world_query_load_chunks (int alloc = 0);
+void *vox_world_query_new ();
+
+void vox_world_query_free (void *q);
 
-void vox_world_query_set_at (unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, AV *cell)
+void vox_world_query_load_chunks (void *q, int alloc = 0);
+
+void vox_world_query_set_at (void *q, unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, AV *cell)
   CODE:
-    vox_world_query_set_at_pl (rel_x, rel_y, rel_z, cell);
+    vox_world_query_set_at_pl (q, rel_x, rel_y, rel_z, cell);
 
-void vox_world_query_set_at_abs (unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, AV *cell)
+void vox_world_query_set_at_abs (void *q, unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, AV *cell)
   CODE:
-    vox_world_query_abs2rel (&rel_x, &rel_y, &rel_z);
-    vox_world_query_set_at_pl (rel_x, rel_y, rel_z, cell);
+    vox_world_query_abs2rel (q, &rel_x, &rel_y, &rel_z);
+    vox_world_query_set_at_pl (q, rel_x, rel_y, rel_z, cell);
 
-void vox_world_query_setup (int x, int y, int z, int ex, int ey, int ez);
+void vox_world_query_setup (void *q, int x, int y, int z, int ex, int ey, int ez);
 
-int vox_world_query_desetup (int no_update = 0);
+int vox_world_query_desetup (void *q, int no_update = 0);
 
-AV *vox_world_query_possible_light_positions ()
+int vox_world_query_set_cells_abs (void *q, SV *cells, int no_light = 0)
   CODE:
-    int xw = QUERY_CONTEXT.x_w * CHUNK_SIZE,
-        yw = QUERY_CONTEXT.y_w * CHUNK_SIZE,
-        zw = QUERY_CONTEXT.z_w * CHUNK_SIZE;
+    // cells are packed native 32 bit integers: x, y, z, type, light, meta, add.
+    // A negative type, light, meta or add keeps the value of the cell.
+    STRLEN len;
+    int *rec = (int *) SvPVbyte (cells, len);
+    unsigned int n = len / (sizeof (int) * 7), i;
+
+    RETVAL = 0;
+    for (i = 0; i < n; i++)
+      {
+        int *r = rec + i * 7;
+        int x = r[0], y = r[1], z = r[2];
+        vox_world_query_abs2rel (q, &x, &y, &z);
+
+        vox_cell *c = vox_world_query_cell_at (q, x, y, z, 1);
+        if (!c)
+          continue;
+
+        vox_cell old = *c;
+        int otype = c->type;
+        if (r[3] >= 0) c->type  = r[3];
+        if (r[4] >= 0) c->light = r[4];
+        if (r[5] >= 0) c->meta  = r[5];
+        if (r[6] >= 0) c->add   = r[6];
+        if (VOX_CELL_DATA_CHANGED (old, *c))
+          vox_world_query_cell_changed (q, x, y, z);
+        RETVAL++;
+
+        if (vox_world_is_active (otype) || vox_world_is_active (c->type))
+          vox_world_query_emit_active_cell_change (q, r[0], r[1], r[2], c, 0);
+      }
+
+    if (!no_light)
+      {
+        // seed the light changes of all cells first and flow them in one go.
+        // The brightest light around the cells limits the affected area:
+        unsigned char radius = 0;
+        vox_query_cursor c;
+        for (i = 0; i < n; i++)
+          {
+            int *r = rec + i * 7;
+            int x = r[0], y = r[1], z = r[2];
+            vox_world_query_abs2rel (q, &x, &y, &z);
+            vox_query_cursor_set (&c, q, x, y, z);
+            vox_cell *cur = vox_query_cursor_cell (&c, 0);
+            if (!cur)
+              continue;
 
-    static int offsets[6][3] = {
-        {  0,  0,  1 },
-        {  0,  0, -1 },
-        {  0,  1,  0 },
-        {  0, -1,  0 },
-        {  1,  0,  0 },
-        { -1,  0,  0 },
-    };
+            unsigned char l = vox_world_query_get_max_light_of_neighbours (&c);
+            if (cur->light > l) l = cur->light;
+            if (l > radius)     radius = l;
+          }
+
+        int seeded = 0;
+        vox_world_light_upd_start (q);
+        for (i = 0; i < n; i++)
+          {
+            int *r = rec + i * 7;
+            int x = r[0], y = r[1], z = r[2];
+            vox_world_query_abs2rel (q, &x, &y, &z);
+            seeded |= vox_world_query_seed_light (q, x, y, z, radius);
+          }
+
+        if (seeded)
+          vox_world_query_flow_light (q);
+      }
+  OUTPUT:
+    RETVAL
+
+AV *vox_world_cells_bounds (SV *cells)
+  CODE:
+    // returns the bounding box (min x, y, z, max x, y, z) of
+    // packed cells as used by query_set_cells_abs ().
+    STRLEN len;
+    int *rec = (int *) SvPVbyte (cells, len);
+    unsigned int n = len / (sizeof (int) * 7), i;
+    int b[6];
 
     RETVAL = newAV ();
     sv_2mortal ((SV *)RETVAL);
 
-    int x, y, z;
-    for (x = 2; x < (xw - 2); x += 6)
-      for (y = 2; y < (yw - 2); y += 6)
-        for (z = 2; z < (zw - 2); z += 6)
-           {
-             int ix, iy, iz;
-             int rad, found = 0;
-             int i;
-             int fnd = 0;
-             for (i = 0; !fnd && i < 6; i++)
-               {
-                 int m;
-                 for (m = 1; m <= 2; m++)
-                   {
-                     int px = x + offsets[i][0] * (m - 1),
-                         py = y + offsets[i][1] * (m - 1),
-                         pz = z + offsets[i][2] * (m - 1);
-
-                     vox_cell *cur = vox_world_query_cell_at (px, py, pz, 0);
-                     if (!cur || cur->type != 0)
-                       continue;
-
-                     cur = vox_world_query_cell_at (
-                       x + offsets[i][0] * m,
-                       y + offsets[i][1] * m,
-                       z + offsets[i][2] * m,
-                       0);
-                     if (cur && cur->type != 0)
-                       {
-                         av_push (RETVAL,
-                                  newSViv (px + QUERY_CONTEXT.chnk_x * CHUNK_SIZE));
-                         av_push (RETVAL,
-                                  newSViv (py + QUERY_CONTEXT.chnk_y * CHUNK_SIZE));
-                         av_push (RETVAL,
-                                  newSViv (pz + QUERY_CONTEXT.chnk_z * CHUNK_SIZE));
-                         fnd = 1;
-                         break;
-                       }
-                   }
-               }
-           }
+    for (i = 0; i < n; i++)
+      {
+        int *r = rec + i * 7, k;
+        for (k = 0; k < 3; k++)
+          {
+            if (i == 0 || r[k] < b[k])     b[k]     = r[k];
+            if (i == 0 || r[k] > b[k + 3]) b[k + 3] = r[k];
+          }
+      }
+
+    if (n > 0)
+      for (i = 0; i < 6; i++)
+        av_push (RETVAL, newSViv (b[i]));
+  OUTPUT:
+    RETVAL
+
+AV *vox_world_query_possible_light_positions (void *q)
+  CODE:
+    vox_int_buf out = { 0 };
+    vox_world_query_possible_light_positions_buf (q, &out);
+    RETVAL = vox_int_buf_to_av (&out);
+  OUTPUT:
+    RETVAL
+
+SV *vox_world_query_possible_light_positions_packed (void *q)
+  CODE:
+    vox_int_buf out = { 0 };
+    vox_world_query_possible_light_positions_buf (q, &out);
+    RETVAL = vox_int_buf_to_packed (&out);
   OUTPUT:
     RETVAL
 
@@ -435,109 +756,75 @@ AV *vox_world_find_free_spot (int x, int y, int z, int with_floor)
         chnk_y = pos[1],
         chnk_z = pos[2];
 
-    vox_world_query_setup (
+    vox_world_query *q = vox_world_query_new ();
+    vox_world_query_setup (q,
       chnk_x - 2, chnk_y - 2, chnk_z - 2,
       chnk_x + 2, chnk_y + 2, chnk_z + 2
     );
 
-    vox_world_query_load_chunks (0);
+    vox_world_query_load_chunks (q, 0);
 
     int cx = x, cy = y, cz = z;
-    vox_world_query_abs2rel (&cx, &cy, &cz);
+    vox_world_query_abs2rel (q, &cx, &cy, &cz);
 
     RETVAL = newAV ();
     sv_2mortal ((SV *)RETVAL);
 
+    vox_query_cursor c;
+    vox_shell_iter it;
     int rad;
-    int ix, iy, iz;
     int found = 0;
     for (rad = 0; !found && rad < ((CHUNK_SIZE * 2) - 3); rad++) // -3 safetymargin
-      for (ix = -rad; !found && ix <= rad; ix++)
-        for (iy = -rad; !found && iy <= rad; iy++)
-          for (iz = -rad; !found && iz <= rad; iz++)
-            {
-              int dx = ix + cx,
-                  dy = iy + cy,
-                  dz = iz + cz;
-
-              vox_cell *cur = vox_world_query_cell_at (dx, dy, dz, 0);
-              if (!cur)
-                continue;
-              vox_obj_attr *attr = vox_world_get_attr (cur->type);
-              if (attr->blocking)
-                continue;
-
-              cur = vox_world_query_cell_at (dx, dy + 1, dz, 0);
-              if (!cur)
-                continue;
-              attr = vox_world_get_attr (cur->type);
-              if (attr->blocking)
-                continue;
-
-              cur = vox_world_query_cell_at (dx, dy - 1, dz, 0);
-              if (!cur)
-                continue;
-              attr = vox_world_get_attr (cur->type);
-              if (with_floor && !attr->blocking)
-                continue;
-
-              av_push (RETVAL, newSViv (x + ix));
-              av_push (RETVAL, newSViv (y + iy));
-              av_push (RETVAL, newSViv (z + iz));
-              found = 1;
-            }
+      for (vox_shell_iter_init (&it, rad, 0);
+           !found && vox_shell_iter_next (&it); )
+        {
+          vox_query_cursor_set (&c, q, cx + it.dx, cy + it.dy, cz + it.dz);
+
+          vox_cell *cur = vox_query_cursor_cell (&c, 0);
+          if (!cur)
+            continue;
+          vox_obj_attr *attr = vox_world_get_attr (cur->type);
+          if (attr->blocking)
+            continue;
+
+          cur = vox_query_cursor_neighbour (&c, QUERY_CURSOR_Y, 1);
+          if (!cur)
+            continue;
+          attr = vox_world_get_attr (cur->type);
+          if (attr->blocking)
+            continue;
+
+          cur = vox_query_cursor_neighbour (&c, QUERY_CURSOR_Y, -1);
+          if (!cur)
+            continue;
+          attr = vox_world_get_attr (cur->type);
+          if (with_floor && !attr->blocking)
+            continue;
+
+          av_push (RETVAL, newSViv (x + it.dx));
+          av_push (RETVAL, newSViv (y + it.dy));
+          av_push (RETVAL, newSViv (z + it.dz));
+          found = 1;
+        }
+
+    vox_world_query_free (q);
 
   OUTPUT:
     RETVAL
 
 AV *vox_world_get_types_in_cube (int x, int y, int z, int size, int type_match = -1)
   CODE:
-    vec3_init (pos1, x, y, z);
-    vec3_s_div (pos1, CHUNK_SIZE);
-    vec3_floor (pos1);
-
-    vec3_init (pos2, x + size, y + size, z + size);
-    vec3_s_div (pos2, CHUNK_SIZE);
-    vec3_floor (pos2);
-
-    vox_world_query_setup (
-      (int) pos1[0], (int) pos1[1], (int) pos1[2],
-      (int) pos2[0], (int) pos2[1], (int) pos2[2]
-    );
-
-    vox_world_query_load_chunks (0);
-
-    int cx = x, cy = y, cz = z;
-    vox_world_query_abs2rel (&cx, &cy, &cz);
-
-    RETVAL = newAV ();
-    sv_2mortal ((SV *)RETVAL);
-
-    int dx, dy, dz;
-    for (dx = 0; dx < size; dx++)
-      for (dy = 0; dy < size; dy++)
-        for (dz = 0; dz < size; dz++)
-          {
-            vox_cell *cur = vox_world_query_cell_at (cx + dx, cy + dy, cz + dz, 0);
-            if (!cur)
-              continue;
-
-            if (type_match >= 0)
-              {
-                if (cur->type == type_match)
-                  {
-                    av_push (RETVAL, newSViv (x + dx));
-                    av_push (RETVAL, newSViv (y + dy));
-                    av_push (RETVAL, newSViv (z + dz));
-                    av_push (RETVAL, newSViv (cur->type));
-                  }
-              }
-            else
-              av_push (RETVAL, newSViv (cur->type));
-          }
-
-    vox_world_query_desetup (1);
+    vox_int_buf out = { 0 };
+    vox_world_get_types_in_cube_buf (x, y, z, size, type_match, &out);
+    RETVAL = vox_int_buf_to_av (&out);
+  OUTPUT:
+    RETVAL
 
+SV *vox_world_get_types_in_cube_packed (int x, int y, int z, int size, int type_match = -1)
+  CODE:
+    vox_int_buf out = { 0 };
+    vox_world_get_types_in_cube_buf (x, y, z, size, type_match, &out);
+    RETVAL = vox_int_buf_to_packed (&out);
   OUTPUT:
     RETVAL
 
@@ -550,37 +837,38 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
         chnk_y = pos[1],
         chnk_z = pos[2];
 
-    vox_world_query_setup (
+    vox_world_query *q = vox_world_query_new ();
+    vox_world_query_setup (q,
       chnk_x - 1, chnk_y - 1, chnk_z - 1,
       chnk_x + 1, chnk_y + 1, chnk_z + 1
     );
 
-    vox_world_query_load_chunks (0);
+    vox_world_query_load_chunks (q, 0);
 
     RETVAL = newAV ();
     sv_2mortal ((SV *)RETVAL);
 
     // calc relative size inside chunks:
     int cx = x, cy = y, cz = z;
-    vox_world_query_abs2rel (&cx, &cy, &cz);
+    vox_world_query_abs2rel (q, &cx, &cy, &cz);
 
     //d// printf ("QUERY AT %d %d %d\n", cx, cy, cz);
 
     // find lowest cx/cz coord with constr. floor
-    vox_cell *cur = vox_world_query_cell_at (cx, cy, cz, 0);
+    vox_cell *cur = vox_world_query_cell_at (q, cx, cy, cz, 0);
     while (cur && cur->type == 36)
       {
         cx--;
         printf ("CX %d\n", cx);
-        cur = vox_world_query_cell_at (cx, cy, cz, 0);
+        cur = vox_world_query_cell_at (q, cx, cy, cz, 0);
       }
 
     cx++;
-    cur = vox_world_query_cell_at (cx, cy, cz, 0);
+    cur = vox_world_query_cell_at (q, cx, cy, cz, 0);
     while (cur && cur->type == 36)
       {
         cz--;
-        cur = vox_world_query_cell_at (cx, cy, cz, 0);
+        cur = vox_world_query_cell_at (q, cx, cy, cz, 0);
       }
     cz++;
 
@@ -596,7 +884,7 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
         for (dx = 0; dx < dim; dx++)
           for (dz = 0; dz < dim; dz++)
             {
-              vox_cell *cur = vox_world_query_cell_at (cx + dx, cy, cz + dz, 0);
+              vox_cell *cur = vox_world_query_cell_at (q, cx + dx, cy, cz + dz, 0);
               //d// printf ("TXT[%d] %d %d %d: %d\n", dim, cx + dx, cy, cz + dz, cur->type);
               if (!cur || cur->type != 36)
                 no_floor = 1;
@@ -607,7 +895,8 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
 
     if (dim <= 0)
       {
-        vox_world_query_desetup (1);
+        vox_world_query_desetup (q, 1);
+        vox_world_query_free (q);
         XSRETURN_UNDEF;
       }
 
@@ -623,7 +912,7 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
             int ix = dx + cx,
                 iy = dy + cy,
                 iz = dz + cz;
-            cur = vox_world_query_cell_at (ix, iy, iz, 0);
+            cur = vox_world_query_cell_at (q, ix, iy, iz, 0);
             if (cur && cur->type != 0)
               {
                 if (min_x > ix) min_x = ix;
@@ -639,7 +928,7 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
             int ix = dx + cx,
                 iy = dy + cy,
                 iz = dz + cz;
-            cur = vox_world_query_cell_at (ix, iy, iz, 0);
+            cur = vox_world_query_cell_at (q, ix, iy, iz, 0);
             if (cur && cur->type != 0)
               {
                 if (max_x < ix) max_x = ix;
@@ -677,7 +966,7 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
                 continue;
               }
 
-            cur = vox_world_query_cell_at (ix, iy, iz, 0);
+            cur = vox_world_query_cell_at (q, ix, iy, iz, 0);
             if (cur && cur->type != 0)
               {
                 if (mutate == 1)
@@ -696,7 +985,8 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
             blk_nr++;
           }
 
-    vox_world_query_desetup (1);
+    vox_world_query_desetup (q, 1);
+    vox_world_query_free (q);
 
   OUTPUT:
     RETVAL
@@ -704,7 +994,7 @@ AV *vox_world_get_pattern (int x, int y, int z, int mutate)
 
 #define DEBUG_LIGHT 0
 
-void vox_world_flow_light_query_setup (int minx, int miny, int minz, int maxx, int maxy, int maxz)
+void vox_world_flow_light_query_setup (void *q, int minx, int miny, int minz, int maxx, int maxy, int maxz)
   CODE:
     vec3_init (min_pos, minx, miny, minz);
     vec3_s_div (min_pos, CHUNK_SIZE);
@@ -713,60 +1003,53 @@ void vox_world_flow_light_query_setup (int minx, int miny, int minz, int maxx, i
     vec3_s_div (max_pos, CHUNK_SIZE);
     vec3_floor (max_pos);
 
-    vox_world_query_setup (
+    vox_world_query_setup (q,
       min_pos[0] - 2, min_pos[1] - 2, min_pos[2] - 2,
       max_pos[0] + 2, max_pos[1] + 2, max_pos[2] + 2
     );
 
-    vox_world_query_load_chunks (0);
+    vox_world_query_load_chunks (q, 0);
 
 
-AV *vox_world_query_search_types (int t1, int t2, int t3)
+AV *vox_world_query_search_types (void *q, int t1, int t2, int t3)
   CODE:
-    RETVAL = newAV ();
-    sv_2mortal ((SV *)RETVAL);
-
-    int xw = QUERY_CONTEXT.x_w * CHUNK_SIZE,
-        yw = QUERY_CONTEXT.y_w * CHUNK_SIZE,
-        zw = QUERY_CONTEXT.z_w * CHUNK_SIZE;
-    int x, y, z;
-    for (x = 0; x < xw; x++)
-      for (y = 0; y < yw; y++)
-        for (z = 0; z < zw; z++)
-           {
-             vox_cell *cur = vox_world_query_cell_at (x, y, z, 0);
-             if (cur && (cur->type == t1 || cur->type == t2 || cur->type == t3))
-               {
-                  int rx = x, ry = y, rz = z;
-                  vox_world_query_rel2abs (&rx, &ry, &rz);
-                  av_push (RETVAL, newSViv (rx));
-                  av_push (RETVAL, newSViv (ry));
-                  av_push (RETVAL, newSViv (rz));
-               }
-           }
+    vox_int_buf out = { 0 };
+    vox_world_query_search_types_buf (q, t1, t2, t3, &out);
+    RETVAL = vox_int_buf_to_av (&out);
+  OUTPUT:
+    RETVAL
 
+SV *vox_world_query_search_types_packed (void *q, int t1, int t2, int t3)
+  CODE:
+    vox_int_buf out = { 0 };
+    vox_world_query_search_types_buf (q, t1, t2, t3, &out);
+    RETVAL = vox_int_buf_to_packed (&out);
   OUTPUT:
     RETVAL
 
-void vox_world_query_reflow_every_light ()
+void vox_world_query_reflow_every_light (void *q)
   CODE:
-    int xw = QUERY_CONTEXT.x_w * CHUNK_SIZE,
-        yw = QUERY_CONTEXT.y_w * CHUNK_SIZE,
-        zw = QUERY_CONTEXT.z_w * CHUNK_SIZE;
+    vox_world_query *qc = q;
+    int xw = qc->x_w * CHUNK_SIZE,
+        yw = qc->y_w * CHUNK_SIZE,
+        zw = qc->z_w * CHUNK_SIZE;
+    vox_query_cursor c;
     int x, y, z;
     for (x = 0; x < xw; x++)
       for (y = 0; y < yw; y++)
-        for (z = 0; z < zw; z++)
+        for (z = 0, vox_query_cursor_set (&c, q, x, y, 0);
+             z < zw;
+             z++, vox_query_cursor_step (&c, QUERY_CURSOR_Z, 1))
            {
-             vox_cell *cur = vox_world_query_cell_at (x, y, z, 0);
+             vox_cell *cur = vox_query_cursor_cell (&c, 0);
              if (cur && (cur->type == 35 || cur->type == 40 || cur->type == 41))
-               vox_world_query_reflow_light (x, y, z);
+               vox_world_query_reflow_light (q, x, y, z);
            }
 
-void vox_world_flow_light_at (int x, int y, int z)
+void vox_world_flow_light_at (void *q, int x, int y, int z)
   CODE:
-    vox_world_query_abs2rel (&x, &y, &z);
-    vox_world_query_reflow_light (x, y, z);
+    vox_world_query_abs2rel (q, &x, &y, &z);
+    vox_world_query_reflow_light (q, x, y, z);
 
 
 MODULE = Games::VoxEngine PACKAGE = Games::VoxEngine::VolDraw PREFIX = vol_draw_
@@ -775,6 +1058,10 @@ void vol_draw_init ();
 
 void vol_draw_alloc (unsigned int size);
 
+void vol_draw_set_threads (unsigned int n);
+
+unsigned int vol_draw_get_threads ();
+
 void vol_draw_set_op (unsigned int op);
 
 void vol_draw_set_dst (unsigned int i);
@@ -843,49 +1130,35 @@ AV *vol_draw_to_perl ()
   OUTPUT:
     RETVAL
 
-void vol_draw_dst_to_world (int sector_x, int sector_y, int sector_z, AV *range_map)
+void vol_draw_run_program (SV *prog, unsigned int size, unsigned int seed, double param)
   CODE:
-    int cx = sector_x * CHUNKS_P_SECTOR,
-        cy = sector_y * CHUNKS_P_SECTOR,
-        cz = sector_z * CHUNKS_P_SECTOR;
+    STRLEN len;
+    double *code = (double *) SvPVbyte (prog, len);
+    vol_draw_run_program (code, len / sizeof (double), size, seed, param);
 
-    vox_world_query_setup (
-      cx, cy, cz,
-      cx + (CHUNKS_P_SECTOR - 1),
-      cy + (CHUNKS_P_SECTOR - 1),
-      cz + (CHUNKS_P_SECTOR - 1)
-    );
-
-    vox_world_query_load_chunks (1);
-    int x, y, z;
-    for (x = 0; x < DRAW_CTX.size; x++)
-      for (y = 0; y < DRAW_CTX.size; y++)
-        for (z = 0; z < DRAW_CTX.size; z++)
-          {
-            vox_cell *cur = vox_world_query_cell_at (x, y, z, 1);
-            assert (cur);
-            double v = DRAW_DST(x, y, z);
+void vol_draw_dst_to_world (void *q, int sector_x, int sector_y, int sector_z, AV *range_map)
+  CODE:
+    // convert the range map once, the cells are set without touching perl:
+    int al = av_len (range_map);
+    double *ranges = safemalloc (sizeof (double) * (al + 3));
+    unsigned int nranges = 0;
+    int i;
+    for (i = 0; i + 2 <= al; i += 3)
+      {
+        SV **a = av_fetch (range_map, i, 0);
+        SV **b = av_fetch (range_map, i + 1, 0);
+        SV **t = av_fetch (range_map, i + 2, 0);
+        if (!a || !b || !t)
+          continue;
+
+        ranges[nranges * 3]     = SvNV (*a);
+        ranges[nranges * 3 + 1] = SvNV (*b);
+        ranges[nranges * 3 + 2] = (unsigned short) SvIV (*t);
+        nranges++;
+      }
 
-            int al = av_len (range_map);
-            int i;
-            for (i = 0; i <= al; i += 3)
-              {
-                SV **a = av_fetch (range_map, i, 0);
-                SV **b = av_fetch (range_map, i + 1, 0);
-                SV **t = av_fetch (range_map, i + 2, 0);
-                if (!a || !b || !v)
-                  continue;
-
-                double av = SvNV (*a),
-                       bv = SvNV (*b);
-                if (v >= av && v < bv)
-                  {
-                    cur->type = SvIV (*t);
-                    if (vox_world_is_active (cur->type))
-                      vox_world_emit_active_cell_change (x, y, z, cur, 0);
-                  }
-              }
-          }
+    vol_draw_dst_to_world (q, sector_x, sector_y, sector_z, ranges, nranges);
+    safefree (ranges);
 
 MODULE = Games::VoxEngine PACKAGE = Games::VoxEngine::Random PREFIX = random_
 
@@ -902,54 +1175,57 @@ MODULE = Games::VoxEngine PACKAGE = Games::VoxEngine::Region PREFIX = region_
 
 void *region_new_from_vol_draw_dst ()
   CODE:
-    double *region =
-       malloc ((sizeof (double) * DRAW_CTX.size * DRAW_CTX.size * DRAW_CTX.size) + 1);
-    RETVAL = region;
+    RETVAL = vox_region_new_from_vol_draw_dst ();
+  OUTPUT:
+    RETVAL
 
-    region[0] = DRAW_CTX.size;
-    region++;
-    vol_draw_copy (region);
+int region_save (void *reg, char *file)
+  CODE:
+    RETVAL = vox_region_save (reg, file);
+  OUTPUT:
+    RETVAL
 
+void *region_load (char *file)
+  CODE:
+    RETVAL = vox_region_load (file);
   OUTPUT:
     RETVAL
 
+void region_free (void *reg)
+  CODE:
+    vox_region_free (reg);
+
 unsigned int region_get_sector_seed (int x, int y, int z)
   CODE:
     RETVAL = map_coord2int (x, y, z);
   OUTPUT:
     RETVAL
 
-AV *region_get_nearest_sector_in_range (void *reg, int x, int y, int z, double a, double b)
+AV *region_get_nearest_sector_in_range (void *reg, int x, int y, int z, double a, double b, int first_only = 0)
   CODE:
-     double *region = reg;
-     int reg_size = region[0];
-     region++;
-
      RETVAL = newAV ();
      sv_2mortal ((SV *)RETVAL);
 
+     // returns all sectors in range of the nearest shell around x, y, z
+     // which has any, or just the first of them if "first_only" is set.
      int rad;
      for (rad = 1; rad < 200; rad++)
        {
          int fnd = 0;
-         int dx, dy, dz;
-         for (dx = -rad; dx <= rad; dx++)
-           for (dy = -rad; dy <= rad; dy++)
-             for (dz = -rad; dz <= rad; dz++)
-               {
-                 int ox = x + dx,
-                     oy = y + dy,
-                     oz = z + dz;
-
-                 double v = region_get_sector_value (reg, ox, oy, oz);
-                 if (v < a || v >= b)
-                   continue;
-
-                 av_push (RETVAL, newSViv (x + dx));
-                 av_push (RETVAL, newSViv (y + dy));
-                 av_push (RETVAL, newSViv (z + dz));
-                 fnd = 1;
-               }
+         vox_shell_iter it;
+         // the first shell includes the center:
+         for (vox_shell_iter_init (&it, rad, rad == 1);
+              !(fnd && first_only) && vox_shell_iter_next (&it); )
+           {
+             double v = region_get_sector_value (reg, x + it.dx, y + it.dy, z + it.dz);
+             if (v < a || v >= b)
+               continue;
+
+             av_push (RETVAL, newSViv (x + it.dx));
+             av_push (RETVAL, newSViv (y + it.dy));
+             av_push (RETVAL, newSViv (z + it.dz));
+             fnd = 1;
+           }
 
          if (fnd)
            break;
@@ -281,6 +281,97 @@ sub draw_commands {
    }
 }
 
+# opcodes of the draw programs, see vol_draw_run_program () in volume_draw.c
+my %PROG_CMDS = (
+   mode               => [ 1, 1],
+   src_dst            => [ 2, 2],
+   dst_range          => [ 3, 2],
+   src_range          => [ 4, 2],
+   src_blend          => [ 5, 1],
+   fill               => [ 6, 1],
+   fill_self          => [ 7, 0],
+   fill_noise         => [ 8, 4],
+   subdiv             => [ 9, 3],
+   self_cubes         => [10, 3],
+   menger_sponge      => [11, 1],
+   cantor_dust        => [12, 1],
+   sierpinski_pyramid => [13, 1],
+   map_range          => [14, 4],
+   hist_equalize      => [15, 3],
+   coords             => [16, 6],
+   mandelbox          => [17, 5],
+);
+
+my %SUBDIV_TYPES = (cubes => 0, spheres => 1, triangles => 2);
+
+# Compiles a draw command script into a program for run_program, which
+# draws the same as draw_commands. Scripts using the debugging commands
+# that need perl (show_*) can't be compiled, for those a reference to the
+# script is returned, which draw_program hands to draw_commands.
+sub compile_commands {
+   my ($str) = @_;
+
+   my (@lines) = map { $_ =~ s/#.*$//; $_ } split /\r?\n/, $str;
+   my (@stmts) = map { split /\s*;\s*/, $_ } @lines;
+
+   my $prog = '';
+   for (@stmts) {
+      s/^\s+(.*?)\s*$/$1/;
+      next if $_ eq '';
+
+      my ($cmd, @arg) = split /\s+/, $_;
+
+      # arguments are [kind, a, b], see vol_draw_prog_arg ():
+      my @parg = map {
+         $_ =~ /P([+-]?\d+(?:\.\d+)?)\s*,\s*([+-]?\d+(?:\.\d+)?)/
+            ? [1, $1, $2]
+            : ($_ eq 'P' ? [2, 0, 0] : [0, $_, 0])
+      } @arg;
+
+      if ($cmd eq 'end') {
+         last;
+
+      } elsif ($cmd eq 'mode') {
+         @parg = ([0, $OPS{$arg[0]} || 0, 0]);
+
+      } elsif ($cmd eq 'dst_range' || $cmd eq 'src_range') {
+         $parg[$_] = [0, 0, 0] for grep { !($arg[$_] ne '') } 0, 1;
+
+      } elsif ($cmd eq 'src_blend') {
+         $parg[0] = [0, 1, 0] unless $arg[0] ne '';
+
+      } elsif ($cmd eq 'fill') {
+         $cmd = 'fill_self' unless $arg[0] ne '';
+
+      } elsif (exists $SUBDIV_TYPES{$cmd}) {
+         @parg = ([0, $SUBDIV_TYPES{$cmd}, 0], $parg[1], $parg[0]);
+         $cmd = 'subdiv';
+
+      } elsif ($cmd =~ /^show_/) {
+         return \$str;
+
+      } elsif (!$PROG_CMDS{$cmd}) {
+         warn "unknown draw command: $_\n";
+         next;
+      }
+
+      my ($op, $argc) = @{$PROG_CMDS{$cmd}};
+      $prog .= pack "d*", $op, $argc,
+         map { @{$parg[$_] || [0, 0, 0]} } 0..($argc - 1);
+   }
+
+   $prog
+}
+
+# Draws a program from compile_commands, $env is the same as for
+# draw_commands.
+sub draw_program {
+   my ($prog, $env) = @_;
+
+   return draw_commands ($$prog, $env) if ref $prog;
+   run_program ($prog, $env->{size}, $env->{seed}, $env->{param});
+}
+
 package Games::VoxEngine::Debug;
 use Games::VoxEngine::Logging;
 use AnyEvent::Debug;
@@ -853,53 +853,37 @@ sub get_selected_box_pos {
       return ($pos, $pos);
    }
 
-   my ($select_pos);
-
-   my $min_dist = 9999;
-   for my $dx (-3..3) {
-      for my $dy (-3..3) { # floor and above head?!
-         for my $dz (-3..3) {
-            # now skip the player boxes
-            my $cur_box = vaddd ($head_box, $dx, $dy, $dz);
-            #d# next unless $dx == 0 && $dz == 0 && $cur_box->[1] == $foot_box->[1] - 1;
-            next if $dx == 0 && $dz == 0
-                    && grep { $cur_box->[1] == $_ }
-                          $foot_box->[1]..$head_box->[1];
-
-            if (Games::VoxEngine::World::is_solid_at (@$cur_box)) {
-               my ($dist, $q) =
-                  world_intersect_ray_box (
-                     $player_head, $rayd, $cur_box);
-               #d#warn "BOX AT " . vstr ($cur_box) . " ".vstr ($rayd)." from "
-               #d#               . vstr ($player_head) . "DIST $dist at " . vstr ($q) . "\n";
-               if ($dist > 0 && $min_dist > $dist) {
-                  $min_dist   = $dist;
-                  $select_pos = $cur_box;
-               }
-            }
-         }
+   # walk the cells along the ray from the head, until the ray leaves
+   # the selectable cube of 3 boxes around the head box. The boxes of the
+   # player are skipped, the ray goes on from the one it hit:
+   my ($select_pos, $norm);
+   my $ray_d = vnorm ($rayd);
+   my ($from, $dist) = ($player_head, 0);
+   while (1) {
+      my $hit = Games::VoxEngine::World::raycast (@$from, @$ray_d, 7 - $dist);
+      last unless @$hit;
+
+      my $cur_box = [@$hit[0..2]];
+      my $dlt     = vsub ($cur_box, $head_box);
+      last if grep { abs ($_) > 3 } @$dlt;
+
+      if ($dlt->[0] == 0 && $dlt->[2] == 0
+          && grep { $cur_box->[1] == $_ } $foot_box->[1]..$head_box->[1]) {
+         # start the next raycast inside the skipped box, the cell
+         # a ray starts in isn't tested:
+         $dist += $hit->[6] + 0.0001;
+         $from  = vadd ($player_head, vsmul ($ray_d, $dist));
+         next;
       }
+
+      $select_pos = $cur_box;
+      $norm       = [@$hit[3..5]];
+      last;
    }
 
    my $build_box;
    if ($select_pos) {
-      my $box_center    = vaddd ($select_pos, 0.5, 0.5, 0.5);
-      my $intersect_pos = vadd ($player_head, vsmul ($rayd, $min_dist));
-      my $norm_dir = vsub ($intersect_pos, $box_center);
-
-      my $max_coord;
-      my $cv = 0;
-      for (0..2) {
-         if (abs ($cv) < abs ($norm_dir->[$_])) {
-            $cv = $norm_dir->[$_];
-            $max_coord = $_;
-         }
-      }
-      my $norm = [0, 0, 0];
-      $norm->[$max_coord] = $cv < 0 ? -1 : 1;
-      #d# warn "Normal direction: " . vstr ($nn) . ", ". vstr ($norm) . "\n";
-
-      $build_box = vfloor (vadd ($box_center, $norm));
+      $build_box = vadd ($select_pos, $norm);
       if (grep {
                $foot_box->[0] == $build_box->[0]
             && $_ == $build_box->[1]
@@ -966,6 +950,8 @@ sub physics_tick : event_cb {
       viadd ($player->{vel}, vsmul ($gforce, $dt));
    }
 
+   my $from = [@{$player->{pos}}];
+
    if ((vlength ($player->{vel}) * $dt) > $PL_RAD) {
       $player->{vel} = vsmul (vnorm ($player->{vel}), ($PL_RAD - 0.02) / $dt);
    }
@@ -988,7 +974,8 @@ sub physics_tick : event_cb {
          $player->{pos},
          $PL_RAD,
          $PL_HEIGHT,
-         \$collide_normal);
+         \$collide_normal,
+         $from);
 
    #d# warn "new pos : ".vstr ($pos)." norm " . vstr ($collide_normal || []). "\n";
    unless ($self->{ghost_mode}) {
@@ -89,7 +89,7 @@ sub BUILD {
    $RES->init_directories;
    $RES->load_content_file;
 
-   world_init ($self, $RES->{region_cmds});
+   world_init ($self, $RES->{region_prog});
 
    $RES->load_objects;
 
@@ -215,6 +215,7 @@ sub shutdown {
    for (values %{$self->{players}}) {
       $_->save;
    }
+   world_stop_workers ();
    $self->_cv->send;
 }
 
@@ -229,6 +230,8 @@ sub handle_protocol {
 sub send_client {
    my ($self, $cid, $hdr, $body) = @_;
    #print (%$hdr, "\n") and confess unless $body;
+   # a forked world worker has the connections, but they aren't its own:
+   return unless $$ == $Games::VoxEngine::Server::World::MAIN_PID;
    $body //= '';
 
    $self->{clients}->{$cid}{out}->push_write (packstring => "N", packet2data ($hdr, $body));
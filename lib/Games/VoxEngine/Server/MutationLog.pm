@@ -0,0 +1,420 @@
+# Games::VoxEngine - A 3D Game written in Perl with an infinite and modifiable world.
+# Copyright (C) 2011  Robin Redeker
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+package Games::VoxEngine::Server::MutationLog;
+use common::sense;
+use Fcntl;
+use IO::Handle;
+use Time::HiRes qw/time/;
+use Compress::LZF qw/decompress compress/;
+use Digest::MD5 qw/md5/;
+use JSON;
+
+=head1 NAME
+
+Games::VoxEngine::Server::MutationLog - Append only log of world changes
+
+=head1 SYNOPSIS
+
+   my $log = Games::VoxEngine::Server::MutationLog->new (
+      file => "$mapdir/mutations.log", sync => 'interval');
+
+   $log->append ({ $sector_id => { chunks => [[$x, $y, $z, $data]],
+                                   ents   => { $eid => $ent } } });
+
+   for my $rec ($log->records ($sector_id, $after_seq)) { ... }
+
+=head1 DESCRIPTION
+
+The log keeps the changes of the sectors between their saves. Every
+record has a sequence number and holds the new data of the changed
+chunks and the changed entities (undef for removed ones) of some
+sectors. A sector that is saved stores the sequence number of the last
+record it contains, so that only the newer ones are replayed when it is
+loaded again, and tells the log with C<forget>.
+
+The file starts with "VOXMLOG1" and the sequence number of the last
+record that was dropped by C<compact>, then come the records (all
+numbers in network byte order):
+
+   header       "VLOG", sequence number (N), length (N), MD5 of the data
+   data         LZF compressed: JSON length (N), JSON of the sectors with
+                the chunk positions and lengths and the entities, then
+                the chunk data
+
+A record that is cut off or damaged at the end of the file is dropped
+when the log is opened.
+
+=over 4
+
+=cut
+
+my $FILE_MAGIC = "VOXMLOG1";
+my $FILE_HDR   = 12;
+my $MAGIC      = "VLOG";
+my $HDR_FMT    = "a4 N N a16";
+my $HDR_LEN    = 28;
+
+=item new (file => $file, sync => $policy, sync_interval => $secs)
+
+Opens or creates the log C<$file> and indexes the records in it. Dies
+with a message on error. C<$policy> says when the appended records are
+synced to the disk: C<always> after every record, C<interval> at most
+every C<$secs> seconds (default 1, see C<sync_if_due>) or C<never>.
+
+=cut
+
+sub new {
+   my $this  = shift;
+   my $class = ref ($this) || $this;
+   my $self  = { sync => 'interval', sync_interval => 1, @_ };
+   bless $self, $class;
+
+   $self->_open;
+
+   return $self
+}
+
+sub _pread {
+   my ($fh, $offs, $len) = @_;
+   my $buf = "";
+   sysseek $fh, $offs, 0
+      or die "couldn't seek: $!\n";
+   while (length ($buf) < $len) {
+      my $r = sysread $fh, $buf, $len - length $buf, length $buf;
+      die "couldn't read: $!\n" unless defined $r;
+      die "log truncated\n" unless $r;
+   }
+   $buf
+}
+
+sub _pwrite {
+   my ($fh, $offs, $data) = @_;
+   sysseek $fh, $offs, 0
+      or die "couldn't seek: $!\n";
+   my $done = 0;
+   while ($done < length $data) {
+      my $w = syswrite $fh, $data, length ($data) - $done, $done;
+      die "couldn't write: $!\n" unless defined $w;
+      $done += $w;
+   }
+}
+
+sub _sync_dir {
+   my ($file) = @_;
+   (my $dir = $file) =~ s{/[^/]*$}{};
+   # not possible everywhere, the rename is still atomic then:
+   my $dh;
+   sysopen $dh, $dir, O_RDONLY
+      and $dh->sync;
+}
+
+sub _open {
+   my ($self) = @_;
+   my $file = $self->{file};
+
+   sysopen my $fh, $file, O_RDWR | O_CREAT
+      or die "couldn't open mutation log '$file': $!\n";
+   binmode $fh;
+
+   $self->{fh}     = $fh;
+   $self->{index}  = {}; # sector id => [[seq, offset, length], ...]
+   $self->{synced} = time;
+
+   my $size = -s $fh;
+   if ($size < $FILE_HDR) {
+      _pwrite ($fh, 0, pack "a8 N", $FILE_MAGIC, 0);
+      $fh->sync;
+      _sync_dir ($file);
+      $size = $FILE_HDR;
+   }
+
+   my ($magic, $seq) = unpack "a8 N", _pread ($fh, 0, $FILE_HDR);
+   $magic eq $FILE_MAGIC
+      or die "'$file' is no mutation log\n";
+   $self->{seq} = $seq;
+
+   my $offs = $FILE_HDR;
+   while ($offs < $size) {
+      my ($seq, $len, $secs) = eval { $self->_read_record ($offs, $size) };
+      unless (defined $seq) {
+         # the rest was written incompletely, drop it:
+         $self->{dropped} = $size - $offs;
+         truncate $fh, $offs
+            or die "couldn't truncate mutation log '$file': $!\n";
+         last;
+      }
+
+      push @{$self->{index}->{$_}}, [$seq, $offs, $len]
+         for keys %$secs;
+      $self->{seq} = $seq if $seq > $self->{seq};
+      $offs += $len;
+   }
+
+   $self->{size} = $offs;
+}
+
+sub _encode {
+   my ($secs) = @_;
+
+   my (%hdr, $data);
+   for my $id (sort keys %$secs) {
+      my $s = $secs->{$id};
+      $hdr{$id} = {
+         chunks => [map { [@$_[0..2], length $_->[3]] } @{$s->{chunks} || []}],
+         ents   => $s->{ents} || {},
+      };
+      $data .= $_->[3] for @{$s->{chunks} || []};
+   }
+
+   my $json = JSON->new->utf8->canonical->encode (\%hdr);
+   pack ("N", length $json) . $json . $data
+}
+
+sub _decode {
+   my ($data) = @_;
+
+   my ($len) = unpack "N", $data;
+   my $hdr  = JSON->new->utf8->decode (substr $data, 4, $len);
+   my $offs = 4 + $len;
+
+   for my $id (sort keys %$hdr) {
+      for (@{$hdr->{$id}->{chunks}}) {
+         my $l = pop @$_;
+         push @$_, substr $data, $offs, $l;
+         $offs += $l;
+      }
+   }
+   $offs == length $data
+      or die "chunk data doesn't match\n";
+
+   $hdr
+}
+
+# Returns the sequence number, the length and the sectors of the record
+# at $offs, dies if it is incomplete or damaged.
+sub _read_record {
+   my ($self, $offs, $size) = @_;
+
+   $offs + $HDR_LEN <= $size
+      or die "record header truncated\n";
+   my ($magic, $seq, $len, $md5) =
+      unpack $HDR_FMT, _pread ($self->{fh}, $offs, $HDR_LEN);
+   $magic eq $MAGIC
+      or die "no record\n";
+   $offs + $HDR_LEN + $len <= $size
+      or die "record truncated\n";
+
+   my $data = _pread ($self->{fh}, $offs + $HDR_LEN, $len);
+   md5 ($data) eq $md5
+      or die "record damaged\n";
+
+   ($seq, $HDR_LEN + $len, _decode (decompress ($data)))
+}
+
+=item $log->append ($secs)
+
+Appends a record with the changes C<$secs> (sector id => { chunks =>
+[[x, y, z, data], ...], ents => { entity id => entity or undef } }) and
+returns its sequence number. Dies with a message on error, the log is
+unchanged then.
+
+=cut
+
+sub append {
+   my ($self, $secs) = @_;
+
+   my $seq  = $self->{seq} + 1;
+   my $data = compress (_encode ($secs));
+   my $rec  = pack ($HDR_FMT, $MAGIC, $seq, length $data, md5 ($data)) . $data;
+
+   unless (eval { _pwrite ($self->{fh}, $self->{size}, $rec); 1 }) {
+      my $err = $@;
+      truncate $self->{fh}, $self->{size};
+      die "couldn't append to mutation log '$self->{file}': $err";
+   }
+
+   push @{$self->{index}->{$_}}, [$seq, $self->{size}, length $rec]
+      for keys %$secs;
+   $self->{seq}   = $seq;
+   $self->{size} += length $rec;
+   $self->{unsynced} = 1;
+
+   $self->sync if $self->{sync} eq 'always';
+   $self->sync_if_due;
+
+   $seq
+}
+
+=item $log->sync
+
+Syncs the appended records to the disk.
+
+=cut
+
+sub sync {
+   my ($self) = @_;
+   $self->{fh}->sync
+      or die "couldn't sync mutation log '$self->{file}': $!\n";
+   $self->{unsynced} = 0;
+   $self->{synced}   = time;
+}
+
+=item $log->sync_if_due
+
+Syncs the appended records if the policy is C<interval> and the last sync
+is long enough ago. Should be called regularly.
+
+=cut
+
+sub sync_if_due {
+   my ($self) = @_;
+   $self->sync
+      if $self->{unsynced}
+         && $self->{sync} eq 'interval'
+         && time - $self->{synced} >= $self->{sync_interval};
+}
+
+=item $log->seq
+
+The sequence number of the last record.
+
+=item $log->size
+
+The size of the log file in bytes.
+
+=item $log->sector_ids
+
+The ids of the sectors with records in the log.
+
+=item $log->dropped
+
+The number of bytes of incomplete records dropped when the log was opened.
+
+=cut
+
+sub seq        { $_[0]->{seq} }
+sub size       { $_[0]->{size} }
+sub sector_ids { keys %{$_[0]->{index}} }
+sub dropped    { $_[0]->{dropped} }
+
+=item $log->records ($id, $after)
+
+Returns the changes of the sector C<$id> in the records after the
+sequence number C<$after>, oldest first, as hashes with the keys C<seq>,
+C<chunks> and C<ents> (see C<append>). Dies with a message on error.
+
+=cut
+
+sub records {
+   my ($self, $id, $after) = @_;
+
+   my @recs;
+   for (@{$self->{index}->{$id} || []}) {
+      my ($seq, $offs) = @$_;
+      next if $seq <= $after;
+      my (undef, undef, $secs) = $self->_read_record ($offs, $self->{size});
+      push @recs, { seq => $seq, %{$secs->{$id}} };
+   }
+   @recs
+}
+
+=item $log->forget ($id, $upto)
+
+Tells the log that the records of the sector C<$id> up to the sequence
+number C<$upto> are saved with the sector. C<compact> drops the records
+that aren't needed by any sector anymore.
+
+=cut
+
+sub forget {
+   my ($self, $id, $upto) = @_;
+   my $recs = $self->{index}->{$id}
+      or return;
+   @$recs = grep { $_->[0] > $upto } @$recs;
+   delete $self->{index}->{$id} unless @$recs;
+}
+
+=item $log->compact
+
+Rewrites the log with only the records that are still needed. Returns the
+number of bytes freed, dies with a message on error.
+
+=cut
+
+sub compact {
+   my ($self) = @_;
+   my $file = $self->{file};
+
+   my %keep;
+   for (values %{$self->{index}}) {
+      $keep{$_->[1]} = $_->[2] for @$_;
+   }
+   my $used = $FILE_HDR;
+   $used += $_ for values %keep;
+   return 0 if $used == $self->{size};
+
+   sysopen my $fh, "$file~", O_RDWR | O_CREAT | O_TRUNC
+      or die "couldn't open '$file~': $!\n";
+   binmode $fh;
+
+   my %offs;
+   eval {
+      _pwrite ($fh, 0, pack "a8 N", $FILE_MAGIC, $self->{seq});
+      my $offs = $FILE_HDR;
+      for my $o (sort { $a <=> $b } keys %keep) {
+         _pwrite ($fh, $offs, _pread ($self->{fh}, $o, $keep{$o}));
+         $offs{$o} = $offs;
+         $offs += $keep{$o};
+      }
+      $fh->sync
+         or die "couldn't sync: $!\n";
+      rename "$file~", $file
+         or die "couldn't rename: $!\n";
+      _sync_dir ($file);
+      1
+   } or do {
+      my $err = $@;
+      unlink "$file~";
+      die "couldn't compact mutation log '$file': $err";
+   };
+
+   for (values %{$self->{index}}) {
+      $_->[1] = $offs{$_->[1]} for @$_;
+   }
+
+   my $freed = $self->{size} - $used;
+   $self->{fh}   = $fh;
+   $self->{size} = $used;
+   $freed
+}
+
+=back
+
+=head1 AUTHOR
+
+Robin Redeker, C<< <elmex@ta-sa.org> >>
+
+=head1 COPYRIGHT & LICENSE
+
+Copyright 2011 Robin Redeker, all rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License.
+
+=cut
+
+1;
@@ -228,11 +228,7 @@ sub ia_construction_pad {
 
             my $tmr;
             $tmr = AE::timer $time, 0, sub {
-               world_mutate_at (\@poses, sub {
-                  my ($data) = @_;
-                  $data->[0] = 0;
-                  1
-               });
+               world_set_cells (join "", map { world_pack_cell ($_, 0) } @poses);
 
                my $gen_cnt = $obj->{model_cnt} || 1; # || 1 shouldn't happen... but u never know
 
@@ -419,16 +415,14 @@ sub tmr_drone {
 
    drone_check_player_hit ($pos, $entity, $pl);
 
-   my $empty =
-      Games::VoxEngine::World::get_types_in_cube (
+   my @cells = unpack "l*",
+      Games::VoxEngine::World::get_types_in_cube_packed (
          @{vsubd ($new_pos, 1, 1, 1)}, 3, 0);
 
    my @empty;
-   while (@$empty) {
-      my ($pos, $type) = (
-         [shift @$empty, shift @$empty, shift @$empty], shift @$empty
-      );
-      push @empty, $pos;
+   while (@cells) {
+      my ($x, $y, $z, $type) = splice @cells, 0, 4;
+      push @empty, [$x, $y, $z];
    }
 
    if (!@empty) {
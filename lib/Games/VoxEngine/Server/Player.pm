@@ -812,15 +812,14 @@ sub _map_value_to_material {
 sub check_message_beacons {
    my ($self) = @_;
 
-   my $msgboxes =
-      Games::VoxEngine::World::get_types_in_cube (
+   my @msgboxes = unpack "l*",
+      Games::VoxEngine::World::get_types_in_cube_packed (
          @{vsubd ($self->get_pos_normalized, 15, 15, 15)}, 30, 34);
 
    my $cur_beacons = {};
-   while (@$msgboxes) {
-      my ($pos, $type) = (
-         [shift @$msgboxes, shift @$msgboxes, shift @$msgboxes], shift @$msgboxes
-      );
+   while (@msgboxes) {
+      my ($x, $y, $z, $type) = splice @msgboxes, 0, 4;
+      my $pos = [$x, $y, $z];
       my $e = world_entity_at ($pos);
       my $id = world_pos2id ($pos);
       $cur_beacons->{$id} = $self->{data}->{beacons}->{$id} = [
@@ -962,15 +961,16 @@ sub check_assignment_positions {
    my $t      = time;
    my $assign = $self->{data}->{assignment};
    my $lpos   = { %{$assign->{pos_types}} };
-   my $typ    =
-      Games::VoxEngine::World::get_types_in_cube (@{$assign->{pos}}, $assign->{size});
+   my @typ    = unpack "l*",
+      Games::VoxEngine::World::get_types_in_cube_packed (
+         @{$assign->{pos}}, $assign->{size});
 
    #d#printf "CHECK TIME 1 %f\n", time - $t;
 
    for (my $x = 0; $x < $assign->{size}; $x++) {
       for (my $y = 0; $y < $assign->{size}; $y++) {
          for (my $z = 0; $z < $assign->{size}; $z++) {
-            my $t = shift @$typ;
+            my $t = shift @typ;
             my $pid = join (",", @{vaddd ($assign->{pos}, $x, $y, $z)});
 
             if ($assign->{pos_types}->{$pid}) {
@@ -1125,11 +1125,11 @@ sub create_encounter {
 sub check_signal_jamming {
    my ($self) = @_;
    my $jammers =
-      Games::VoxEngine::World::get_types_in_cube (
+      Games::VoxEngine::World::get_types_in_cube_packed (
          @{vsubd ($self->get_pos_normalized, 15, 15, 15)}, 30, 33);
 
    my $pre = $self->{data}->{signal_jammed};
-   $self->{data}->{signal_jammed} = @$jammers ? 1 : 0;
+   $self->{data}->{signal_jammed} = length ($jammers) ? 1 : 0;
 }
 
 sub add_trophies {
@@ -92,6 +92,8 @@ sub load_content_file {
    for (keys %$stypes) {
       $stypes->{$_}->{type} = $_;
       $stypes->{$_}->{cmds} = _get_shared_file ("$stypes->{$_}->{file}");
+      $stypes->{$_}->{prog} =
+         Games::VoxEngine::VolDraw::compile_commands ($stypes->{$_}->{cmds});
    }
 
    my $atypes = $self->{content}->{assign_types};
@@ -108,6 +110,8 @@ sub load_content_file {
 
    $self->{region_cmds} =
       _get_shared_file ("$self->{content}->{region}->{file}");
+   $self->{region_prog} =
+      Games::VoxEngine::VolDraw::compile_commands ($self->{region_cmds});
 
    $self->load_text_db;
 }
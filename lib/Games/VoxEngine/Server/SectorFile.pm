@@ -0,0 +1,358 @@
+# Games::VoxEngine - A 3D Game written in Perl with an infinite and modifiable world.
+# Copyright (C) 2011  Robin Redeker
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+package Games::VoxEngine::Server::SectorFile;
+use common::sense;
+use Compress::LZF qw/decompress compress/;
+use JSON;
+
+require Exporter;
+our @ISA = qw/Exporter/;
+our @EXPORT = qw/
+   sector_file_encode
+   sector_file_patch
+   sector_file_decode
+   sector_file_read
+   sector_file_read_chunks
+   sector_file_write
+   sector_file_is_legacy
+/;
+
+=head1 NAME
+
+Games::VoxEngine::Server::SectorFile - Reading and writing of sector files
+
+=head1 DESCRIPTION
+
+A sector file stores the meta data and the chunks of one sector.
+All numbers are in network byte order:
+
+   header       "VOXSEC", version (n), chunk count (n), flags (n),
+                offset (N) and length (N) of the meta data block
+   chunk table  offset (N), stored length (N) and length (N) per chunk
+   meta data    LZF compressed JSON
+   chunks       every chunk LZF compressed on its own
+
+The offsets are from the start of the file, so a chunk can be read
+without touching the others and the chunk blocks don't need to be in
+order. The chunks are in the order of the sector (x outer, z inner).
+
+Sector files of the old format (one LZF compressed blob of the JSON
+meta data, a C<MAPDATA> line and the chunks) are still read.
+
+=over 4
+
+=cut
+
+our $MAGIC   = "VOXSEC";
+our $VERSION = 1;
+
+my $HDR_FMT  = "a6 n n n N N";
+my $HDR_LEN  = 20;
+my $TBL_LEN  = 12; # per chunk
+
+=item sector_file_is_legacy ($data)
+
+Returns true if C<$data>, the start of a sector file, is not in the
+indexed format.
+
+=cut
+
+sub sector_file_is_legacy {
+   substr ($_[0], 0, length $MAGIC) ne $MAGIC
+}
+
+=item sector_file_encode ($meta, $chunks)
+
+Returns the contents of a sector file with the meta data C<$meta> and the
+chunk data in the array C<$chunks>.
+
+=cut
+
+sub sector_file_encode {
+   my ($meta, $chunks) = @_;
+   _encode_blocks ($meta, [map { [compress ($_), length $_] } @$chunks])
+}
+
+# $blocks are the compressed chunks with their uncompressed lengths.
+sub _encode_blocks {
+   my ($meta, $blocks) = @_;
+
+   my $meta_data = compress (JSON->new->utf8->canonical->encode ($meta || {}));
+
+   my $offs = $HDR_LEN + $TBL_LEN * @$blocks;
+   my $meta_offs = $offs;
+   $offs += length $meta_data;
+
+   my ($tbl, $data);
+   for (@$blocks) {
+      $tbl  .= pack "N N N", $offs, length $_->[0], $_->[1];
+      $data .= $_->[0];
+      $offs += length $_->[0];
+   }
+
+   pack ($HDR_FMT, $MAGIC, $VERSION, scalar @$blocks, 0,
+         $meta_offs, length $meta_data)
+   . $tbl . $meta_data . $data
+}
+
+=item sector_file_patch ($data, $meta, $chunks)
+
+Returns the contents of the sector file C<$data> with the meta data
+replaced by C<$meta> and the chunks replaced by the defined elements of
+C<$chunks>. The other chunks are copied without decompressing them (files
+in the old format are converted). Dies with a message if C<$data> is
+corrupted.
+
+=cut
+
+sub sector_file_patch {
+   my ($data, $meta, $chunks) = @_;
+
+   if (sector_file_is_legacy ($data)) {
+      my (undef, $old) = sector_file_decode ($data);
+      return sector_file_encode ($meta, [map { $chunks->[$_] // $old->[$_] } 0..$#$old]);
+   }
+
+   length ($data) >= $HDR_LEN
+      or die "sector file truncated, no header\n";
+   my ($cnt) = _decode_header ($data, length $data);
+   @$chunks == $cnt
+      or die "sector file has $cnt chunks, can't replace " . @$chunks . "\n";
+   length ($data) >= $HDR_LEN + $TBL_LEN * $cnt
+      or die "sector file truncated, no chunk table\n";
+
+   my @blocks;
+   for my $i (0..($cnt - 1)) {
+      if (defined $chunks->[$i]) {
+         push @blocks, [compress ($chunks->[$i]), length $chunks->[$i]];
+         next;
+      }
+
+      my ($offs, $clen, $len) =
+         unpack "N N N", substr $data, $HDR_LEN + $TBL_LEN * $i, $TBL_LEN;
+      $offs + $clen <= length $data
+         or die "sector file truncated, chunk $i beyond the end\n";
+      push @blocks, [substr ($data, $offs, $clen), $len];
+   }
+
+   _encode_blocks ($meta, \@blocks)
+}
+
+sub _decode_header {
+   my ($hdr, $size) = @_;
+
+   my ($magic, $version, $cnt, $flags, $meta_offs, $meta_len) =
+      unpack $HDR_FMT, $hdr;
+
+   $version == $VERSION
+      or die "unknown sector file version $version\n";
+   $meta_offs + $meta_len <= $size
+      or die "sector file truncated, meta data beyond the end\n";
+
+   ($cnt, $meta_offs, $meta_len)
+}
+
+sub _decode_meta {
+   my $meta = eval { JSON->new->relaxed->utf8->decode (decompress ($_[0])) };
+   die "meta data corrupted: $@" if $@;
+   $meta
+}
+
+sub _decode_chunk {
+   my ($i, $data, $len) = @_;
+   my $chunk = $len ? eval { decompress ($data) } : "";
+   die "chunk $i corrupted: $@" if $@;
+   length ($chunk) == $len
+      or die "chunk $i corrupted, expected $len bytes, got " . length ($chunk) . "\n";
+   $chunk
+}
+
+sub _decode_legacy {
+   my ($data) = @_;
+
+   my $cont = eval { decompress ($data) };
+   die "data corrupted: $@" if $@;
+
+   my ($metadata, $mapdata, $cdata) = split /\n\n\n*/, $cont, 3;
+   $mapdata =~ /MAPDATA/
+      or die "can't find 'MAPDATA'\n";
+
+   my ($md, $datalen, @lens) = split /\s+/, $mapdata;
+   length ($cdata) == $datalen
+      or die "sector data truncated, expected $datalen bytes, but only got "
+             . length ($cdata) . "\n";
+
+   my $meta = eval { JSON->new->relaxed->utf8->decode ($metadata) };
+   die "meta data corrupted: $@" if $@;
+
+   my $offs = 0;
+   my @chunks;
+   for (@lens) {
+      push @chunks, substr $cdata, $offs, $_;
+      $offs += $_;
+   }
+
+   ($meta, \@chunks)
+}
+
+=item sector_file_decode ($data)
+
+Decodes the contents of a sector file in the old or the indexed format.
+Returns the meta data and an array of the chunk data, dies with a
+message if the data is corrupted.
+
+=cut
+
+sub sector_file_decode {
+   my ($data) = @_;
+
+   return _decode_legacy ($data)
+      if sector_file_is_legacy ($data);
+
+   length ($data) >= $HDR_LEN
+      or die "sector file truncated, no header\n";
+
+   my ($cnt, $meta_offs, $meta_len) = _decode_header ($data, length $data);
+   length ($data) >= $HDR_LEN + $TBL_LEN * $cnt
+      or die "sector file truncated, no chunk table\n";
+
+   my $meta = _decode_meta (substr $data, $meta_offs, $meta_len);
+
+   my @chunks;
+   for my $i (0..($cnt - 1)) {
+      my ($offs, $clen, $len) =
+         unpack "N N N", substr $data, $HDR_LEN + $TBL_LEN * $i, $TBL_LEN;
+      $offs + $clen <= length $data
+         or die "sector file truncated, chunk $i beyond the end\n";
+      push @chunks, _decode_chunk ($i, substr ($data, $offs, $clen), $len);
+   }
+
+   ($meta, \@chunks)
+}
+
+=item sector_file_read ($file)
+
+Reads and decodes the sector file C<$file>, see C<sector_file_decode>.
+
+=cut
+
+sub sector_file_read {
+   my ($file) = @_;
+
+   open my $fh, "<:raw", $file
+      or die "couldn't open sector file '$file': $!\n";
+   my $data = do { local $/; <$fh> };
+   sector_file_decode ($data)
+}
+
+sub _pread {
+   my ($fh, $offs, $len) = @_;
+   my $buf = "";
+   sysseek $fh, $offs, 0
+      or die "couldn't seek: $!\n";
+   while (length ($buf) < $len) {
+      my $r = sysread $fh, $buf, $len - length $buf, length $buf;
+      die "couldn't read: $!\n" unless defined $r;
+      die "sector file truncated\n" unless $r;
+   }
+   $buf
+}
+
+=item sector_file_read_chunks ($file, @idx)
+
+Reads only the chunks with the indices C<@idx> from the sector file
+C<$file> (which is decoded completely if it is in the old format).
+Returns the meta data and a hash of the chunk data by index.
+
+=cut
+
+sub sector_file_read_chunks {
+   my ($file, @idx) = @_;
+
+   open my $fh, "<:raw", $file
+      or die "couldn't open sector file '$file': $!\n";
+   my $size = -s $fh;
+
+   my $hdr = $size >= $HDR_LEN ? _pread ($fh, 0, $HDR_LEN) : "";
+   if (sector_file_is_legacy ($hdr)) {
+      my ($meta, $chunks) = sector_file_decode (_pread ($fh, 0, $size));
+      return ($meta, { map { $_ => $chunks->[$_] } @idx });
+   }
+
+   my ($cnt, $meta_offs, $meta_len) = _decode_header ($hdr, $size);
+   my $tbl = _pread ($fh, $HDR_LEN, $TBL_LEN * $cnt);
+
+   my $meta = _decode_meta (_pread ($fh, $meta_offs, $meta_len));
+
+   my %chunks;
+   for my $i (@idx) {
+      $i >= 0 && $i < $cnt
+         or die "no chunk $i in sector file\n";
+      my ($offs, $clen, $len) = unpack "N N N", substr $tbl, $TBL_LEN * $i, $TBL_LEN;
+      $offs + $clen <= $size
+         or die "sector file truncated, chunk $i beyond the end\n";
+      $chunks{$i} = _decode_chunk ($i, _pread ($fh, $offs, $clen), $len);
+   }
+
+   ($meta, \%chunks)
+}
+
+=item sector_file_write ($file, $meta, $chunks)
+
+Writes the sector file C<$file> via C<"$file~">, so that an existing
+file is only replaced with a completely written one. Returns the number
+of bytes written, dies with a message on error.
+
+=cut
+
+sub sector_file_write {
+   my ($file, $meta, $chunks) = @_;
+
+   my $data = sector_file_encode ($meta, $chunks);
+
+   open my $fh, ">:raw", "$file~"
+      or die "couldn't open '$file~': $!\n";
+   unless ((print $fh $data) && close $fh) {
+      my $err = $!;
+      unlink "$file~";
+      die "couldn't write '$file~': $err\n";
+   }
+   unless (rename "$file~", $file) {
+      my $err = $!;
+      unlink "$file~";
+      die "couldn't rename '$file~' to '$file': $err\n";
+   }
+
+   length $data
+}
+
+=back
+
+=head1 AUTHOR
+
+Robin Redeker, C<< <elmex@ta-sa.org> >>
+
+=head1 COPYRIGHT & LICENSE
+
+Copyright 2011 Robin Redeker, all rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License.
+
+=cut
+
+1;
@@ -0,0 +1,387 @@
+# Games::VoxEngine - A 3D Game written in Perl with an infinite and modifiable world.
+# Copyright (C) 2011  Robin Redeker
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+package Games::VoxEngine::Server::SectorPack;
+use common::sense;
+use Fcntl qw/:DEFAULT :flock/;
+use IO::Handle;
+use POSIX ();
+use Digest::MD5 qw/md5/;
+
+require Exporter;
+our @ISA = qw/Exporter/;
+our @EXPORT = qw/
+   sector_pack_file
+   sector_pack_has
+   sector_pack_get
+   sector_pack_put
+   sector_pack_compact
+/;
+
+=head1 NAME
+
+Games::VoxEngine::Server::SectorPack - Storage of many sectors in one file
+
+=head1 DESCRIPTION
+
+The sectors of the map directory are stored in pack files of
+C<$DIM> x C<$DIM> x C<$DIM> sectors, named
+C<< sectors_<x>x<y>x<z>.pack >> after the pack position. This keeps the
+number of files of big worlds small. A pack file consists of (all
+numbers in network byte order):
+
+   header       "VOXPAK", version (n), $DIM (n), 0 (n), 0 (N)
+   2 index slots
+                MD5 of the rest of the slot, generation (N) and
+                offset (N) and length (N) of every sector, x fastest
+   data         the sector files (see SectorFile), in any order
+
+The index slot with a valid MD5 and the highest generation is the
+current one. A sector is updated by writing it into space that is not
+used by either slot, syncing, and then writing the new index into the
+other slot and syncing again. If the update is interrupted, the old
+index and all the data it refers to are still there. A new pack file
+is only used once its header is synced, a file that is shorter than
+the header (or still zero) was cut off while it was being created and is
+created again. The space of
+replaced sectors is reused by later updates, C<sector_pack_compact>
+removes the holes that are left.
+
+All access is done under C<flock>, so the server and its generator
+processes can use the same files.
+
+=over 4
+
+=cut
+
+our $DIM = 8;
+
+my $MAGIC      = "VOXPAK";
+my $VERSION    = 1;
+my $HDR_FMT    = "a6 n n n N";
+my $HDR_LEN    = 16;
+my $CNT        = $DIM ** 3;
+my $SLOT_LEN   = 20 + 8 * $CNT;
+my $DATA_START = $HDR_LEN + 2 * $SLOT_LEN;
+
+sub _pack_pos {
+   my ($sec) = @_;
+   my @p = map { POSIX::floor ($_ / $DIM) } @$sec;
+   my @r = map { $sec->[$_] - $p[$_] * $DIM } 0..2;
+   (\@p, $r[0] + $r[1] * $DIM + $r[2] * $DIM * $DIM)
+}
+
+=item sector_pack_file ($mapdir, $sec)
+
+Returns the name of the pack file which stores the sector at C<$sec>.
+
+=cut
+
+sub sector_pack_file {
+   my ($mapdir, $sec) = @_;
+   my ($p) = _pack_pos ($sec);
+   "$mapdir/sectors_" . join ("x", @$p) . ".pack"
+}
+
+sub _pread {
+   my ($fh, $offs, $len) = @_;
+   my $buf = "";
+   sysseek $fh, $offs, 0
+      or die "couldn't seek: $!\n";
+   while (length ($buf) < $len) {
+      my $r = sysread $fh, $buf, $len - length $buf, length $buf;
+      die "couldn't read: $!\n" unless defined $r;
+      die "pack file truncated\n" unless $r;
+   }
+   $buf
+}
+
+sub _pwrite {
+   my ($fh, $offs, $data) = @_;
+   sysseek $fh, $offs, 0
+      or die "couldn't seek: $!\n";
+   my $done = 0;
+   while ($done < length $data) {
+      my $w = syswrite $fh, $data, length ($data) - $done, $done;
+      die "couldn't write: $!\n" unless defined $w;
+      $done += $w;
+   }
+}
+
+sub _sync {
+   my ($fh, $file) = @_;
+   $fh->sync
+      or die "couldn't sync '$file': $!\n";
+}
+
+sub _sync_dir {
+   my ($file) = @_;
+   (my $dir = $file) =~ s{/[^/]*$}{};
+   # not possible everywhere, the rename is still atomic then:
+   my $dh;
+   sysopen $dh, $dir, O_RDONLY
+      and $dh->sync;
+}
+
+sub _slot {
+   my ($gen, $ents) = @_;
+   my $d = pack "N N*", $gen, @$ents;
+   md5 ($d) . $d
+}
+
+# Opens and locks the pack file, returns nothing if it doesn't exist
+# and shouldn't be created.
+sub _open_locked {
+   my ($file, $lock, $create) = @_;
+
+   while (1) {
+      my $fh;
+      my $mode = $lock == LOCK_EX ? O_RDWR : O_RDONLY;
+      $mode |= O_CREAT if $create;
+      unless (sysopen $fh, $file, $mode) {
+         return if $!{ENOENT};
+         die "couldn't open pack file '$file': $!\n";
+      }
+      binmode $fh;
+      flock $fh, $lock
+         or die "couldn't lock pack file '$file': $!\n";
+
+      # the file might have been replaced by a compaction meanwhile:
+      my @a = stat $fh;
+      my @b = stat $file;
+      return $fh if @b && $a[0] == $b[0] && $a[1] == $b[1];
+   }
+}
+
+# Returns the current index and the other one, if it is still valid.
+# An index is a hash with the slot, the generation and the entries, the
+# index of a pack file that still has to be created is marked "fresh".
+sub _read_index {
+   my ($fh, $file) = @_;
+
+   # the header is written and synced before any sector is stored, so a
+   # file without data was interrupted while being created (or is being
+   # created just now) and doesn't store anything:
+   my $fresh = { slot => 1, gen => 0, ents => [(0) x (2 * $CNT)], fresh => 1 };
+   my $size = -s $fh;
+   return $fresh
+      if $size < $DATA_START;
+
+   my $buf = _pread ($fh, 0, $DATA_START);
+
+   my ($magic, $version, $dim) = unpack $HDR_FMT, $buf;
+   unless ($magic eq $MAGIC && $version == $VERSION && $dim == $DIM) {
+      return $fresh if $size == $DATA_START && $buf !~ /[^\0]/;
+      die "'$file' is no sector pack file of version $VERSION with $DIM sectors per axis\n";
+   }
+
+   my @idx;
+   for my $s (0, 1) {
+      my $slot = substr $buf, $HDR_LEN + $s * $SLOT_LEN, $SLOT_LEN;
+      next unless md5 (substr $slot, 16) eq substr $slot, 0, 16;
+      my ($gen, @ents) = unpack "N N*", substr $slot, 16;
+      push @idx, { slot => $s, gen => $gen, ents => \@ents };
+   }
+   unless (@idx) {
+      return $fresh if $size == $DATA_START;
+      die "pack file '$file' has no valid index\n";
+   }
+
+   sort { $b->{gen} <=> $a->{gen} } @idx
+}
+
+# First gap of at least $len bytes which isn't used by any of the indices.
+sub _find_free {
+   my ($len, @idx) = @_;
+
+   my @used;
+   for my $e (map { $_->{ents} } @idx) {
+      for (0..($CNT - 1)) {
+         push @used, [$e->[2 * $_], $e->[2 * $_] + $e->[2 * $_ + 1]]
+            if $e->[2 * $_ + 1];
+      }
+   }
+
+   my $pos = $DATA_START;
+   for (sort { $a->[0] <=> $b->[0] } @used) {
+      return $pos if $_->[0] >= $pos + $len;
+      $pos = $_->[1] if $_->[1] > $pos;
+   }
+   $pos
+}
+
+sub _lookup {
+   my ($mapdir, $sec) = @_;
+
+   my $file = sector_pack_file ($mapdir, $sec);
+   my (undef, $i) = _pack_pos ($sec);
+   my $fh = _open_locked ($file, LOCK_SH)
+      or return;
+   my ($idx) = _read_index ($fh, $file);
+   my ($offs, $len) = @{$idx->{ents}}[2 * $i, 2 * $i + 1];
+   return unless $len;
+
+   ($fh, $file, $offs, $len)
+}
+
+=item sector_pack_has ($mapdir, $sec)
+
+Returns true if the sector at C<$sec> is stored in its pack file.
+
+=cut
+
+sub sector_pack_has {
+   my ($fh) = _lookup (@_);
+   defined $fh
+}
+
+=item sector_pack_get ($mapdir, $sec)
+
+Returns the sector file data of the sector at C<$sec>, or undef if it
+isn't stored. Dies with a message if the pack file is broken.
+
+=cut
+
+sub sector_pack_get {
+   my ($fh, $file, $offs, $len) = _lookup (@_)
+      or return;
+   $offs + $len <= -s $fh
+      or die "pack file '$file' truncated\n";
+   _pread ($fh, $offs, $len)
+}
+
+=item sector_pack_put ($mapdir, $sec, $data, $new_only)
+
+Stores the sector file data C<$data> of the sector at C<$sec>, creating
+the pack file if needed. Nothing is done if C<$new_only> is true and
+the sector is stored already. Returns the number of bytes written, dies
+with a message on error.
+
+=cut
+
+sub sector_pack_put {
+   my ($mapdir, $sec, $data, $new_only) = @_;
+
+   my $file = sector_pack_file ($mapdir, $sec);
+   my (undef, $i) = _pack_pos ($sec);
+   my $fh = _open_locked ($file, LOCK_EX, 1);
+
+   my @idx = _read_index ($fh, $file);
+   if ($idx[0]->{fresh}) {
+      _pwrite ($fh, 0,
+         pack ($HDR_FMT, $MAGIC, $VERSION, $DIM, 0, 0)
+         . _slot (0, [(0) x (2 * $CNT)])
+         . ("\0" x $SLOT_LEN));
+      _sync ($fh, $file);
+      _sync_dir ($file);
+      @idx = _read_index ($fh, $file);
+   }
+   my $cur = $idx[0];
+   return 0 if $new_only && $cur->{ents}->[2 * $i + 1];
+
+   my $offs = _find_free (length $data, @idx);
+   _pwrite ($fh, $offs, $data);
+   _sync ($fh, $file);
+
+   my @ents = @{$cur->{ents}};
+   @ents[2 * $i, 2 * $i + 1] = ($offs, length $data);
+   _pwrite ($fh, $HDR_LEN + (1 - $cur->{slot}) * $SLOT_LEN,
+            _slot ($cur->{gen} + 1, \@ents));
+   _sync ($fh, $file);
+
+   length $data
+}
+
+=item sector_pack_compact ($file)
+
+Rewrites the pack file C<$file> without the unused space, or removes it
+if it doesn't store any sector. Returns the old and the new size and the
+number of sectors, dies with a message on error.
+
+=cut
+
+sub sector_pack_compact {
+   my ($file) = @_;
+
+   my $fh = _open_locked ($file, LOCK_EX)
+      or die "couldn't open pack file '$file': $!\n";
+   my $old_size = -s $fh;
+   my ($idx) = _read_index ($fh, $file);
+
+   my (@ents, @secs);
+   my $offs = $DATA_START;
+   for my $i (0..($CNT - 1)) {
+      my ($o, $l) = @{$idx->{ents}}[2 * $i, 2 * $i + 1];
+      push @ents, $l ? ($offs, $l) : (0, 0);
+      next unless $l;
+      $o + $l <= $old_size
+         or die "pack file '$file' truncated\n";
+      push @secs, [$o, $l];
+      $offs += $l;
+   }
+
+   unless (@secs) {
+      unlink $file
+         or die "couldn't remove empty pack file '$file': $!\n";
+      return ($old_size, 0, 0);
+   }
+
+   sysopen my $nfh, "$file~", O_RDWR | O_CREAT | O_TRUNC
+      or die "couldn't open '$file~': $!\n";
+   binmode $nfh;
+
+   eval {
+      _pwrite ($nfh, 0,
+         pack ($HDR_FMT, $MAGIC, $VERSION, $DIM, 0, 0)
+         . _slot ($idx->{gen} + 1, \@ents)
+         . ("\0" x $SLOT_LEN));
+      $offs = $DATA_START;
+      for (@secs) {
+         _pwrite ($nfh, $offs, _pread ($fh, @$_));
+         $offs += $_->[1];
+      }
+      _sync ($nfh, "$file~");
+      close $nfh;
+
+      rename "$file~", $file
+         or die "couldn't rename '$file~' to '$file': $!\n";
+      _sync_dir ($file);
+      1
+   } or do {
+      my $err = $@;
+      unlink "$file~";
+      die $err;
+   };
+
+   ($old_size, $offs, scalar @secs)
+}
+
+=back
+
+=head1 AUTHOR
+
+Robin Redeker, C<< <elmex@ta-sa.org> >>
+
+=head1 COPYRIGHT & LICENSE
+
+Copyright 2011 Robin Redeker, all rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License.
+
+=cut
+
+1;
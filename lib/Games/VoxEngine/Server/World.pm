@@ -20,10 +20,15 @@ use Games::VoxEngine::Vector;
 use Games::VoxEngine;
 use Time::HiRes qw/time/;
 use Carp qw/confess/;
-use Compress::LZF qw/decompress compress/;
-use JSON;
-use Storable qw/dclone/;
+use Storable qw/dclone nfreeze thaw/;
+use Digest::MD5 qw/md5_hex/;
+use POSIX ();
+use IO::Handle;
 use Games::VoxEngine::Logging;
+use Games::VoxEngine::Server::SectorFile;
+use Games::VoxEngine::Server::SectorPack;
+use Games::VoxEngine::Server::MutationLog;
+use JSON;
 
 require Exporter;
 our @ISA = qw/Exporter/;
@@ -37,6 +42,8 @@ our @EXPORT = qw/
    world_pos2relchnkpos
    world_mutate_at
    world_mutate_entity_at
+   world_set_cells
+   world_pack_cell
    world_load_at
    world_find_free_spot
    world_at
@@ -46,7 +53,10 @@ our @EXPORT = qw/
    world_load_at_player
    world_load_around_at
    world_save_all
+   world_stop_workers
    world_find_random_teleport_destination_at_dist
+   world_generate_sector
+   world_sector_exists
 /;
 
 
@@ -67,6 +77,10 @@ our $REGION;
 
 our %SECTORS;
 
+# Sector id => the generations of the chunks (see get_chunk_gens_packed) in
+# the stored sector, only the chunks changed since then are saved again.
+our %CHUNK_GENS;
+
 our $STORE_SCHED_TMR;
 our $FREE_TMR;
 our $TICK_TMR;
@@ -76,79 +90,166 @@ our @LIGHTQUEUE;
 our %LIGHTQUEUE;
 
 our $SRV;
+our $MAIN_PID; # of the server, the forked workers inherit its players
+
+# New sectors are generated by a forked worker process, see
+# _gen_worker_start. The jobs wait in %GEN_JOBS (sector id => { sec, cbs,
+# pinned }), $GEN_RUNNING is the id of the one the worker is busy with.
+our ($GEN_PID, $GEN_RD, $GEN_WR, $GEN_W, $GEN_BUF, $GEN_STARTED);
+our %GEN_JOBS;
+our $GEN_RUNNING;
+
+# Modified sectors are saved by a forked worker process, see
+# _save_worker_start. %SAVE_PENDING holds the snapshots it hasn't
+# acknowledged yet (sequence number => [id, sec, frozen snapshot, log
+# sequence number, chunk generations]).
+our ($SAVE_PID, $SAVE_RD, $SAVE_WR, $SAVE_W, $SAVE_WW, $SAVE_BUF, $SAVE_OUT,
+     $SAVE_STARTED, $SAVE_SEQ);
+our %SAVE_PENDING;
+our %SAVE_NEWEST; # sector id => sequence number of its newest snapshot
+our $SAVE_MAX_PENDING = 8;
+
+# The changes of the loaded sectors are appended to the mutation log every
+# tick and the modified sectors are only saved at checkpoints, see
+# _log_flush and _log_checkpoint_start. %LOG_CHUNKS and %LOG_ENTS collect
+# the chunks and entities changed in the current tick by sector id.
+# Changes made while $LOG_SKIP is true (loading and the light flowing
+# after loads, which is calculated again on every load) aren't logged.
+our ($LOG, $LOG_OPENED, $LOG_CHECKPOINT, $LOG_CHECKPOINT_TIME, $LOG_SKIP);
+our (%LOG_CHUNKS, %LOG_ENTS);
+our $LOG_SYNC                = 'interval'; # or 'always' or 'never'
+our $LOG_SYNC_INTERVAL       = 1;
+our $LOG_CHECKPOINT_INTERVAL = 300;
+our $LOG_CHECKPOINT_SIZE     = 64 * 1024 * 1024;
+
+# Unused query contexts. Every loading, mutation or light calculation takes
+# its own context, so we can start other mutates from inside loading or
+# mutate callbacks without clobbering the query of the outer one:
+our @QUERY_POOL;
+
+sub _query_get { pop @QUERY_POOL || Games::VoxEngine::World::query_new () }
+sub _query_put { push @QUERY_POOL, $_[0] }
+
+sub _world_chunks_changed {
+   my (@chnks) = @_;
+
+   my (%dirty, @upd);
+   for my $chnk (@chnks) {
+      my $sec = world_chnkpos2secpos ($chnk);
+      my $id  = world_pos2id ($sec);
+      unless (exists $SECTORS{$id}) {
+         # this might happen either due to bugs or when sectors are loaded
+         # and light is calculated.
+#         warn "updated sector which is not loaded "
+#              . "(chunk @$chnk [@$sec]) $id. "
+#              . "but this should be okay :-)\n";
+         next; # don't set dirty
+      }
+      $dirty{$id} ||= $sec;
+      $LOG_CHUNKS{$id}->{"@$chnk"} = $chnk if $LOG && !$LOG_SKIP;
+      push @upd, $chnk;
+   }
+
+   world_sector_dirty ($_) for values %dirty;
+
+   # a worker never talks to the clients of the server:
+   return unless $$ == $MAIN_PID;
+
+   for my $pl (values %{$SRV->{players}}) {
+      $pl->chunk_updated ($_) for @upd;
+   }
+}
+
+sub _world_active_cell_changed {
+   my ($x, $y, $z, $type, $ent) = @_;
+   vox_log (debug => "change active cell: %d (%d,%d,%d) (%s)",
+            $type, $x, $y, $z, $ent);
+   my $sec = world_chnkpos2secpos (world_pos2chnkpos ([$x, $y, $z]));
+   my $id  = world_pos2id ($sec);
+   return unless exists $SECTORS{$id};
+   my $eid = world_pos2id ([$x, $y, $z]);
+   $LOG_ENTS{$id}->{$eid} = 1 if $LOG;
+
+   my $e = delete $SECTORS{$id}->{entities}->{$eid};
+   if ($e) {
+      vox_log (debug => "entity %s destroy at sector %s entid %s",
+               $e, $id, $eid);
+      Games::VoxEngine::Server::Objects::destroy ($e);
+   }
+
+   unless ($ent) {
+      $ent = Games::VoxEngine::Server::Objects::instance ($type);
+      vox_log (debug => "instance entity %s at sector %s type %s: %s",
+               $eid, $id, $type, $ent);
+   } else {
+      vox_log (debug => "put entity %s at sector %s type %s: %s",
+               $eid, $id, $type, $ent);
+   }
 
-# neccessary so we can start other mutates
-# from inside loading or mutate callbacks:
-our $in_mutate;
-our @mutate_cont;
+   $SECTORS{$id}->{entities}->{$eid} = $ent if $ent;
+}
 
 sub world_init {
-   my ($server, $region_cmds) = @_;
+   my ($server, $region_prog) = @_;
 
-   $SRV = $server;
+   $SRV      = $server;
+   $MAIN_PID = $$;
 
    Games::VoxEngine::World::init (
-      sub {
-         my ($x, $y, $z) = @_;
-         my $chnk = [$x, $y, $z];
-
-         my $sec = world_chnkpos2secpos ($chnk);
-         my $id  = world_pos2id ($sec);
-         unless (exists $SECTORS{$id}) {
-            # this might happen either due to bugs or when sectors are loaded
-            # and light is calculated.
-#            warn "updated sector which is not loaded "
-#                 . "(chunk $x,$y,$z [@$sec]) $id. "
-#                 . "but this should be okay :-)\n";
-            return; # don't set dirty
-         }
-         world_sector_dirty ($sec);
+      sub { _world_chunks_changed ([@_]) },
+      \&_world_active_cell_changed);
 
-         for (values %{$server->{players}}) {
-            $_->chunk_updated ($chnk);
-         }
+   # the query contexts collect their changes and hand them over in one go:
+   Games::VoxEngine::World::set_batch_callbacks (
+      sub {
+         my @c = unpack "l*", $_[0];
+         my @chnks;
+         push @chnks, [splice @c, 0, 3] while @c;
+         _world_chunks_changed (@chnks);
       },
       sub {
-         my ($x, $y, $z, $type, $ent) = @_;
-         vox_log (debug => "change active cell: %d (%d,%d,%d) (%s)",
-                  $type, $x, $y, $z, $ent);
-         my $sec = world_chnkpos2secpos (world_pos2chnkpos ([$x, $y, $z]));
-         my $id  = world_pos2id ($sec);
-         return unless exists $SECTORS{$id};
-         my $eid = world_pos2id ([$x, $y, $z]);
-
-         my $e = delete $SECTORS{$id}->{entities}->{$eid};
-         if ($e) {
-            vox_log (debug => "entity %s destroy at sector %s entid %s",
-                     $e, $id, $eid);
-            Games::VoxEngine::Server::Objects::destroy ($e);
-         }
+         my ($cells, $ents) = @_;
+         my @c = unpack "l*", $cells;
+         my $i = 0;
+         _world_active_cell_changed (splice (@c, 0, 4), $ents->[$i++])
+            while @c;
+      });
 
-         unless ($ent) {
-            $ent = Games::VoxEngine::Server::Objects::instance ($type);
-            vox_log (debug => "instance entity %s at sector %s type %s: %s",
-                     $eid, $id, $type, $ent);
-         } else {
-            vox_log (debug => "put entity %s at sector %s type %s: %s",
-                     $eid, $id, $type, $ent);
-         }
+   Games::VoxEngine::VolDraw::init ();
+   # the drawn sectors don't depend on the number of drawing threads:
+   Games::VoxEngine::VolDraw::set_threads ($ENV{PERL_GAMES_CONSTRUDER_DRAW_THREADS})
+      if $ENV{PERL_GAMES_CONSTRUDER_DRAW_THREADS};
 
-         $SECTORS{$id}->{entities}->{$eid} = $ent if $ent;
+   $STORE_SCHED_TMR = AE::timer 0, 1, sub {
+      # the changes are in the mutation log, so the sectors are only
+      # saved at checkpoints:
+      my $queue = \@SAVE_SECTORS_QUEUE;
+      if ($LOG) {
+         _log_checkpoint_start ()
+            if !$LOG_CHECKPOINT
+               && (time - $LOG_CHECKPOINT_TIME >= $LOG_CHECKPOINT_INTERVAL
+                   || $LOG->size >= $LOG_CHECKPOINT_SIZE);
+         $queue = $LOG_CHECKPOINT
+            or return;
       }
-   );
 
-   Games::VoxEngine::VolDraw::init ();
+      while (@$queue) {
+         # leave the rest for later if the save worker is busy:
+         return if $SAVE_WR && keys %SAVE_PENDING >= $SAVE_MAX_PENDING;
 
-   $STORE_SCHED_TMR = AE::timer 0, 1, sub {
-      NEXT:
-      my $s = shift @SAVE_SECTORS_QUEUE
-         or return;
-      return unless exists $SECTORS{$s->[0]};
-      if ($SECTORS{$s->[0]}->{dirty}) {
-         _world_save_sector ($s->[1]);
-      } else {
-         goto NEXT;
+         my $s = shift @$queue;
+         if ($LOG && !$SECTORS{$s->[0]}) {
+            _log_checkpoint_load ($s);
+            next unless $SECTORS{$s->[0]};
+         }
+         next unless exists $SECTORS{$s->[0]}
+                     && $SECTORS{$s->[0]}->{dirty};
+
+         _world_save_sector_bg ($s->[1]);
+         return unless $SAVE_WR; # synchronous saves are spread out
       }
+
+      _log_checkpoint_done () if $LOG && !%SAVE_PENDING;
    };
 
    $FREE_TMR = AE::timer 10, 5, sub {
@@ -186,19 +287,51 @@ sub world_init {
       $SRV->schedule_chunk_upd;
 
       _calc_some_lights ();
+      _log_flush ();
    };
 
-   region_init ($region_cmds);
+   region_init ($region_prog);
 }
 
 sub world_save_all {
    my ($self) = @_;
-   for my $s (@SAVE_SECTORS_QUEUE) {
-      return unless exists $SECTORS{$s->[0]};
-      if ($SECTORS{$s->[0]}->{dirty}) {
-         _world_save_sector ($s->[1]);
+   _log_flush ();
+
+   for my $id (keys %SECTORS) {
+      if ($SECTORS{$id}->{dirty}) {
+         _world_save_sector_bg (world_id2pos ($id));
       }
    }
+
+   # wait until everything is on the disk:
+   _save_wait (sub { %SAVE_PENDING });
+
+   _log_checkpoint_done () if $LOG;
+}
+
+# Stops the generator and the save worker after their current jobs, the
+# remaining jobs are done synchronously from then on. Called at shutdown,
+# after world_save_all.
+sub world_stop_workers {
+   if ($SAVE_WR) {
+      _save_wait (sub { %SAVE_PENDING });
+      # the worker exits when its job pipe is closed:
+      undef $SAVE_W;
+      undef $SAVE_WW;
+      undef $SAVE_RD;
+      undef $SAVE_WR;
+      waitpid $SAVE_PID, 0;
+      vox_log (info => "stopped save worker %d", $SAVE_PID);
+   }
+
+   if ($GEN_WR) {
+      undef $GEN_W;
+      undef $GEN_RD;
+      undef $GEN_WR;
+      undef $GEN_RUNNING;
+      waitpid $GEN_PID, 0;
+      vox_log (info => "stopped sector generator %d", $GEN_PID);
+   }
 }
 
 sub world_sector_dirty {
@@ -225,11 +358,18 @@ sub world_free_sector {
    my $sec = world_id2pos ($id);
    my $s = $SECTORS{$id}
       or return;
+   _log_flush (); # while the chunks are still there
    if ($s->{dirty}) {
-      _world_save_sector ($sec);
+      _world_save_sector_bg ($sec);
    }
    return if $s->{dirty};
    delete $SECTORS{$id};
+   delete $CHUNK_GENS{$id};
+   _world_purge_sector_chunks ($sec);
+}
+
+sub _world_purge_sector_chunks {
+   my ($sec) = @_;
    my $fchunk = world_secpos2chnkpos ($sec);
    for my $x (0..4) {
       for my $y (0..4) {
@@ -263,9 +403,14 @@ sub _calc_some_lights {
             next;
          }
 
-         Games::VoxEngine::World::flow_light_query_setup (@$pos, @$pos);
-         Games::VoxEngine::World::flow_light_at (@$pos);
-         my $dirty = Games::VoxEngine::World::query_desetup ();
+         # only loaded and generated sectors queue lights, the sector is
+         # saved with them at the next checkpoint:
+         local $LOG_SKIP = 1;
+         my $q = _query_get ();
+         Games::VoxEngine::World::flow_light_query_setup ($q, @$pos, @$pos);
+         Games::VoxEngine::World::flow_light_at ($q, @$pos);
+         my $dirty = Games::VoxEngine::World::query_desetup ($q);
+         _query_put ($q);
          vox_log (debug => "%d chunks dirty after light calculation at @$pos", $dirty);
          $calced++;
       }
@@ -277,9 +422,11 @@ sub _calc_some_lights {
 }
 
 sub _query_push_lightqueue {
-   my $lightposes = Games::VoxEngine::World::query_search_types (35, 41, 40);
-   while (@$lightposes) {
-      my $pos = [shift @$lightposes, shift @$lightposes, shift @$lightposes];
+   my ($q) = @_;
+   my @lightposes = unpack "l*",
+      Games::VoxEngine::World::query_search_types_packed ($q, 35, 41, 40);
+   while (@lightposes) {
+      my $pos = [splice @lightposes, 0, 3];
       my $id = world_pos2id ($pos);
       unless ($LIGHTQUEUE{$id}) {
          $LIGHTQUEUE{$id} = 1;
@@ -289,7 +436,7 @@ sub _query_push_lightqueue {
 }
 
 sub _world_make_sector {
-   my ($sec) = @_;
+   my ($sec, $new_only) = @_;
 
    my $tcreate = time;
 
@@ -306,16 +453,18 @@ sub _world_make_sector {
    my $cube = $CHNKS_P_SEC * $CHNK_SIZE;
    Games::VoxEngine::VolDraw::alloc ($cube);
 
-   Games::VoxEngine::VolDraw::draw_commands (
-     $stype->{cmds},
+   Games::VoxEngine::VolDraw::draw_program (
+     $stype->{prog},
      { size => $cube, seed => $seed, param => $param }
    );
 
-   Games::VoxEngine::VolDraw::dst_to_world (@$sec, $stype->{ranges} || []);
+   my $q = _query_get ();
+   Games::VoxEngine::VolDraw::dst_to_world ($q, @$sec, $stype->{ranges} || []);
 
-   my $pospos = Games::VoxEngine::World::query_possible_light_positions ();
+   my @pospos = unpack "l*",
+      Games::VoxEngine::World::query_possible_light_positions_packed ($q);
 
-   Games::VoxEngine::World::query_desetup (1);
+   Games::VoxEngine::World::query_desetup ($q, 1);
 
    my $lower_left  = vsmul ($sec, $CHNK_SIZE * $CHNKS_P_SEC);
    my $upper_right =
@@ -324,17 +473,14 @@ sub _world_make_sector {
              $CHNKS_P_SEC * $CHNK_SIZE,
              $CHNKS_P_SEC * $CHNK_SIZE);
 
-   Games::VoxEngine::World::flow_light_query_setup (@$lower_left, @$upper_right);
+   Games::VoxEngine::World::flow_light_query_setup ($q, @$lower_left, @$upper_right);
 
    my $t1 = time;
 
    my $plcnt = 0;
    my $tsum;
    my @poses;
-   while (@$pospos) {
-      push @poses,
-         [shift @$pospos, shift @$pospos, shift @$pospos];
-   }
+   push @poses, [splice @pospos, 0, 3] while @pospos;
    my $cnt = scalar @poses;
    my @types = qw/40 41 41 35 35 35 35/;
    my %type_cnt = (
@@ -359,11 +505,11 @@ sub _world_make_sector {
       last unless $p;
 
       Games::VoxEngine::World::query_set_at_abs (
-         @$p, [$type, 0, 0, 0, 0]);
+         $q, @$p, [$type, 0, 0, 0, 0]);
       $plcnt++;
    }
 
-   _query_push_lightqueue ();
+   _query_push_lightqueue ($q);
    $tsum += time - $t1;
 
    my $smeta = $SECTORS{world_pos2id ($sec)} = {
@@ -378,11 +524,12 @@ sub _world_make_sector {
       type       => $stype->{type},
       entities   => { },
    };
-   _world_save_sector ($sec);
+   _world_save_sector ($sec, $new_only);
    vox_log (profile => "created sector @$sec in $smeta->{creation_time} seconds");
 
    {
-      Games::VoxEngine::World::query_desetup (2);
+      Games::VoxEngine::World::query_desetup ($q, 2);
+      _query_put ($q);
    }
 
    vox_log (debug => "placed $cnt / $plcnt lights $type ($flot) in $tsum!\n");
@@ -395,180 +542,562 @@ sub _world_load_sector {
 
    my $id   = world_pos2id ($sec);
    my $mpd  = $Games::VoxEngine::Server::Resources::MAPDIR;
-   my $file = "$mpd/$id.sec";
+   my $file = sector_pack_file ($mpd, $sec);
 
    return 1 if ($SECTORS{$id}
                 && !$SECTORS{$id}->{broken});
 
-   unless (-e $file) {
-      return 0;
-   }
-
-   if (open my $mf, "<", "$file") {
-      binmode $mf, ":raw";
-      my $cont = eval { decompress (do { local $/; <$mf> }) };
-      if ($@) {
-         vox_log (error => "map sector data corrupted '$file': $@\n");
-         return -1;
-      }
+   _log_open () unless $LOG_OPENED++;
 
-      warn "read " . length ($cont) . "bytes\n";
+   # a freed sector might still be on its way to the disk:
+   _save_wait (sub { grep { $_->[0] eq $id } values %SAVE_PENDING })
+      if %SAVE_PENDING;
 
-      my ($metadata, $mapdata, $data) = split /\n\n\n*/, $cont, 3;
-      unless ($mapdata =~ /MAPDATA/) {
-         vox_log (error =>
-              "map sector file '$file' corrupted! Can't find 'MAPDATA'. "
-              . "Please delete or move it away!");
-         return -1;
+   my ($meta, $chunks) = eval {
+      my $data = sector_pack_get ($mpd, $sec);
+      unless (defined $data) {
+         # sectors saved before the pack files were introduced:
+         $file = "$mpd/$id.sec";
+         return unless -e $file;
+         return sector_file_read ($file);
       }
+      sector_file_decode ($data)
+   };
+   if ($@) {
+      vox_log (error => "couldn't load map sector %s from '%s': %s", $id, $file, $@);
+      return -1;
+   }
+   return 0 unless $meta;
+   unless (@$chunks == $CHNKS_P_SEC ** 3) {
+      vox_log (error => "map sector %s in '%s' corrupted, got %d chunks",
+               $id, $file, scalar @$chunks);
+      return -1;
+   }
 
-      my ($md, $datalen, @lens) = split /\s+/, $mapdata;
-      #d#warn "F $md, $datalen, @lens\n";
-      unless (length ($data) == $datalen) {
-         vox_log (error =>
-              "map sector file '$file' corrupted, sector data truncated, "
-              . "expected $datalen bytes, but only got ".length ($data)."!");
-         return -1;
-      }
+   $SECTORS{$id} = $meta;
+   $meta->{load_time} = time;
 
-      my $meta = eval { JSON->new->relaxed->utf8->decode ($metadata) };
-      if ($@) {
-         vox_log (error => "map sector meta data corrupted '$file': $@");
-         return -1;
+   my ($replayed, $changed);
+   {
+      # the stored and replayed chunks are in the pack and the log already,
+      # and the light is calculated again on every load:
+      local $LOG_SKIP = 1;
+
+      my $first_chnk = world_secpos2chnkpos ($sec);
+      for my $dx (0..($CHNKS_P_SEC - 1)) {
+         for my $dy (0..($CHNKS_P_SEC - 1)) {
+            for my $dz (0..($CHNKS_P_SEC - 1)) {
+               my $chnk = vaddd ($first_chnk, $dx, $dy, $dz);
+
+               my $chunk = shift @$chunks;
+               Games::VoxEngine::World::set_chunk_data (
+                  @$chnk, $chunk, length ($chunk));
+            }
+         }
       }
 
-      $SECTORS{$id} = $meta;
-      $meta->{load_time} = time;
-
-      {
-         my $offs;
-         my $first_chnk = world_secpos2chnkpos ($sec);
-         my @chunks;
-         for my $dx (0..($CHNKS_P_SEC - 1)) {
-            for my $dy (0..($CHNKS_P_SEC - 1)) {
-               for my $dz (0..($CHNKS_P_SEC - 1)) {
-                  my $chnk = vaddd ($first_chnk, $dx, $dy, $dz);
-
-                  my $len = shift @lens;
-                  my $chunk = substr $data, $offs, $len;
-                  Games::VoxEngine::World::set_chunk_data (
-                     @$chnk, $chunk, length ($chunk));
-                  $offs += $len;
-               }
+      # the changes since it was saved:
+      my @recs = $LOG ? eval { $LOG->records ($id, $meta->{log_seq} || 0) } : ();
+      vox_log (error => "couldn't read the changes of sector %s from the mutation log: %s",
+               $id, $@) if $@;
+      # the older ones are in the sector already, the log indexes all
+      # records again when it is opened:
+      $LOG->forget ($id, $meta->{log_seq} || 0) if $LOG;
+
+      # only what differs from the stored sector needs to be saved again:
+      my (%chg_chnks, $chg_ents);
+      my $json = JSON->new->canonical;
+      for my $rec (@recs) {
+         for (@{$rec->{chunks}}) {
+            next if $_->[3] eq Games::VoxEngine::World::get_chunk_data (@$_[0..2]);
+            Games::VoxEngine::World::set_chunk_data (@$_[0..2], $_->[3], length $_->[3]);
+            $chg_chnks{"@$_[0..2]"} = [@$_[0..2]];
+         }
+         for my $eid (keys %{$rec->{ents}}) {
+            my ($old, $new) = ($meta->{entities}->{$eid}, $rec->{ents}->{$eid});
+            next if $json->encode ([$old]) eq $json->encode ([$new]);
+            if (defined $new) {
+               $meta->{entities}->{$eid} = $new;
+            } else {
+               delete $meta->{entities}->{$eid};
             }
+            $chg_ents++;
          }
-
-         my $lower_left  = vsmul ($sec, $CHNK_SIZE * $CHNKS_P_SEC);
-         my $upper_right =
-            vaddd ($lower_left,
-                   $CHNKS_P_SEC * $CHNK_SIZE,
-                   $CHNKS_P_SEC * $CHNK_SIZE,
-                   $CHNKS_P_SEC * $CHNK_SIZE);
-
-         Games::VoxEngine::World::flow_light_query_setup (@$lower_left, @$upper_right);
-         _query_push_lightqueue ();
-         Games::VoxEngine::World::query_desetup (2);
       }
+      $replayed = @recs;
+      $changed  = %chg_chnks || $chg_ents;
+
+      # records that are in the stored sector already, because it was
+      # saved before they were appended to the log:
+      $LOG->forget ($id, $recs[-1]->{seq})
+         if @recs && !$changed;
+
+      my $lower_left  = vsmul ($sec, $CHNK_SIZE * $CHNKS_P_SEC);
+      my $upper_right =
+         vaddd ($lower_left,
+                $CHNKS_P_SEC * $CHNK_SIZE,
+                $CHNKS_P_SEC * $CHNK_SIZE,
+                $CHNKS_P_SEC * $CHNK_SIZE);
+
+      my $q = _query_get ();
+      Games::VoxEngine::World::flow_light_query_setup ($q, @$lower_left, @$upper_right);
+      _query_push_lightqueue ($q);
+      Games::VoxEngine::World::query_desetup ($q, 2);
+      _query_put ($q);
+
+      # the light calculated on load doesn't need to be saved, but the
+      # replayed chunks do:
+      my @gens = unpack "l*",
+         Games::VoxEngine::World::get_chunk_gens_packed (@$first_chnk, $CHNKS_P_SEC);
+      for (values %chg_chnks) {
+         my $rel = vsub ($_, $first_chnk);
+         $gens[($rel->[0] * $CHNKS_P_SEC + $rel->[1]) * $CHNKS_P_SEC + $rel->[2]] = -1;
+      }
+      $CHUNK_GENS{$id} = \@gens;
+   }
 
+   my ($ecnt) = scalar (keys %{$SECTORS{$id}->{entities}});
 
-      my ($ecnt) = scalar (keys %{$SECTORS{$id}->{entities}});
-
-      delete $SECTORS{$id}->{dirty}; # saved with the sector
-      vox_log (info => "loaded sector %s from '%s', got %d entities, loading took %0.3f seconds",
-               $id, $file, $ecnt, time - $t1);
-      return 1;
-
-   } else {
-      vox_log (error => "couldn't open sector file '$file': $!");
-      return -1;
-   }
+   delete $SECTORS{$id}->{dirty}; # saved with the sector
+   world_sector_dirty ($sec) if $changed;
+   vox_log (info => "loaded sector %s from '%s', got %d entities and %d logged changes, loading took %0.3f seconds",
+            $id, $file, $ecnt, $replayed, time - $t1);
+   return 1;
 }
 
-sub _world_save_sector {
+# Takes what is needed to save the sector: the chunk data and the meta data.
+# The meta data isn't copied, see _world_save_sector and
+# _world_save_sector_bg.
+sub _world_sector_snapshot {
    my ($sec) = @_;
 
-   my $t1 = time;
-
    my $id   = world_pos2id ($sec);
    my $meta = $SECTORS{$id};
-
-   if ($meta->{broken}) {
-      vox_log (error => "map sector '$id' marked as broken, won't save!");
-      return;
-   }
-
+   # its changes that aren't logged yet would be logged after log_seq,
+   # and replayed on every load although they are in the sector:
+   _log_flush () if $LOG_CHUNKS{$id} || $LOG_ENTS{$id};
    $meta->{save_time} = time;
+   $meta->{log_seq}   = $LOG->seq if $LOG; # the logged changes it contains
 
+   # only the chunks changed since the last save, the others are undef:
    my $first_chnk = world_secpos2chnkpos ($sec);
+   my @gens = unpack "l*",
+      Games::VoxEngine::World::get_chunk_gens_packed (@$first_chnk, $CHNKS_P_SEC);
+   my $saved = $CHUNK_GENS{$id};
    my @chunks;
+   my $i = 0;
    for my $dx (0..($CHNKS_P_SEC - 1)) {
       for my $dy (0..($CHNKS_P_SEC - 1)) {
          for my $dz (0..($CHNKS_P_SEC - 1)) {
             my $chnk = vaddd ($first_chnk, $dx, $dy, $dz);
             push @chunks,
-               Games::VoxEngine::World::get_chunk_data (@$chnk);
+               $saved && $saved->[$i] == $gens[$i]
+                  ? undef
+                  : Games::VoxEngine::World::get_chunk_data (@$chnk);
+            $i++;
          }
       }
    }
 
-   my ($ecnt) = scalar (keys %{$SECTORS{$id}->{entities}});
+   { id => $id, sec => [@$sec], meta => $meta, chunks => \@chunks,
+     gens => \@gens }
+}
 
-   $meta = dclone ($meta);
+# Writes a snapshot with its own copy of the meta data. Returns the number
+# of bytes written (0 if $new_only and the sector is stored already), dies
+# on error.
+sub _world_write_snapshot {
+   my ($snap, $new_only) = @_;
+
+   my $t1  = time;
+   my $id  = $snap->{id};
+   my $sec = $snap->{sec};
+
+   my $meta = $snap->{meta};
    for (values %{$meta->{entities}}) {
       $_->{tmp} = {}; # don't store entity temporary data (might contain objects)
    }
-   my $meta_data = JSON->new->utf8->pretty->encode ($meta || {});
 
-   my $data = join "", @chunks;
-   my $filedata = compress (
-      $meta_data . "\n\nMAPDATA "
-      . join (' ', map { length $_ } ($data, @chunks))
-      . "\n\n" . $data
-   );
+   my $mpd  = $Games::VoxEngine::Server::Resources::MAPDIR;
+   my $file = sector_pack_file ($mpd, $sec);
+
+   my $chunks = $snap->{chunks};
+   my $chg    = grep { defined } @$chunks;
+
+   my $len = eval {
+      my $data;
+      if ($chg < @$chunks) {
+         # the unchanged chunks are copied from the stored sector without
+         # compressing them again, the pack still writes the whole sector:
+         my $old = sector_pack_get ($mpd, $sec);
+         unless (defined $old) {
+            open my $fh, "<:raw", "$mpd/$id.sec"
+               or die "no stored sector to update: $!\n";
+            $old = do { local $/; <$fh> };
+         }
+         $data = sector_file_patch ($old, $meta, $chunks);
+      } else {
+         $data = sector_file_encode ($meta, $chunks);
+      }
 
-   my $mpd = $Games::VoxEngine::Server::Resources::MAPDIR;
-   my $file = "$mpd/$id.sec";
-
-   if (open my $mf, ">", "$file~") {
-      binmode $mf, ":raw";
-      print $mf $filedata;
-      close $mf;
-      unless (-s "$file~" == length ($filedata)) {
-         vox_log (error => "couldn't save sector completely to '$file~': $!");
+      sector_pack_put ($mpd, $sec, $data, $new_only)
+   };
+   die "couldn't save sector $id to '$file': $@" if $@;
+   unlink "$mpd/$id.sec"; # the old copy from before the pack files
+
+   if ($len) {
+      vox_log (info =>
+           "saved sector $id to '$file', saved %d entities and %d changed chunks, took %.3f seconds, wrote %d bytes",
+           scalar (keys %{$meta->{entities}}), $chg, time - $t1, $len);
+   } else {
+      vox_log (info => "sector $id is stored already, kept it");
+   }
+
+   $len
+}
+
+# Saves the sector synchronously.
+sub _world_save_sector {
+   my ($sec, $new_only) = @_;
+
+   my $id = world_pos2id ($sec);
+   if ($SECTORS{$id}->{broken}) {
+      vox_log (error => "map sector '$id' marked as broken, won't save!");
+      return;
+   }
+
+   my $snap = _world_sector_snapshot ($sec);
+   $snap->{meta} = dclone ($snap->{meta});
+
+   my $len = eval { _world_write_snapshot ($snap, $new_only) };
+   if ($@) {
+      vox_log (error => "%s", $@);
+      return;
+   }
+
+   delete $SECTORS{$id}->{dirty};
+   _world_sector_saved ($id, $snap->{meta}->{log_seq}, $len && $snap->{gens});
+}
+
+# Called once the snapshot of a sector is stored.
+sub _world_sector_saved {
+   my ($id, $log_seq, $gens) = @_;
+   $LOG->forget ($id, $log_seq) if $LOG;
+   $CHUNK_GENS{$id} = $gens if $gens && $SECTORS{$id};
+}
+
+# Hands a snapshot of the sector to the save worker and returns, the sector
+# counts as saved from now on. Without the worker it is saved synchronously.
+sub _world_save_sector_bg {
+   my ($sec) = @_;
+
+   _save_worker_start () unless $SAVE_STARTED++;
+   return _world_save_sector ($sec) unless $SAVE_WR;
+
+   my $id = world_pos2id ($sec);
+   if ($SECTORS{$id}->{broken}) {
+      vox_log (error => "map sector '$id' marked as broken, won't save!");
+      return;
+   }
+
+   # back-pressure, if the worker can't keep up:
+   _save_wait (sub { keys %SAVE_PENDING >= $SAVE_MAX_PENDING });
+   return _world_save_sector ($sec) unless $SAVE_WR;
+
+   # the frozen copy replaces the dclone of the synchronous save:
+   my $s    = _world_sector_snapshot ($sec);
+   my $snap = nfreeze ($s);
+   my $seq  = ++$SAVE_SEQ;
+   $SAVE_PENDING{$seq} = [$id, [@$sec], $snap, $s->{meta}->{log_seq}, $s->{gens}];
+   $SAVE_NEWEST{$id}   = $seq;
+   delete $SECTORS{$id}->{dirty};
+
+   $SAVE_OUT .= pack ("N N", $seq, length $snap) . $snap;
+   _save_write ();
+}
+
+# Forks the save worker on the first save of a modified sector. It reads
+# the snapshots from a pipe, encodes and writes them and reports back, the
+# server keeps every snapshot in %SAVE_PENDING until then. A failed save
+# marks the sector dirty again, or is done synchronously if the sector was
+# freed meanwhile.
+sub _save_worker_start {
+   return if $^O eq 'MSWin32'; # fork is emulated with threads there
+
+   my ($job_rd, $job_wr, $res_rd, $res_wr);
+   unless (pipe ($job_rd, $job_wr) && pipe ($res_rd, $res_wr)) {
+      vox_log (warn => "couldn't create pipes for the save worker: $!");
+      return;
+   }
+
+   my $pid = fork;
+   unless (defined $pid) {
+      vox_log (warn => "couldn't fork the save worker: $!");
+      return;
+   }
+
+   unless ($pid) {
+      close $job_wr;
+      close $res_rd;
+      close $_ for grep { $_ } $GEN_RD, $GEN_WR; # the generator's
+      undef $LOG; # only the server appends
+      _worker_close_fds ($job_rd, $res_wr);
+      _save_worker_loop ($job_rd, $res_wr);
+      POSIX::_exit (0);
+   }
+
+   close $job_rd;
+   close $res_wr;
+   $job_wr->blocking (0);
+
+   ($SAVE_PID, $SAVE_RD, $SAVE_WR, $SAVE_BUF, $SAVE_OUT) = ($pid, $res_rd, $job_wr, '', '');
+   $SAVE_W = AE::io $SAVE_RD, 0, sub { _save_read () };
+   vox_log (info => "started save worker with pid %d", $pid);
+}
+
+sub _save_worker_loop {
+   my ($rd, $wr) = @_;
+   binmode $rd;
+   $wr->autoflush (1);
+
+   while (read ($rd, my $hdr, 8) == 8) {
+      my ($seq, $len) = unpack "N N", $hdr;
+      read ($rd, my $snap, $len) == $len
+         or last;
+      my $ok = eval { _world_write_snapshot (thaw ($snap)); 1 };
+      vox_log (error => "%s", $@) unless $ok;
+      print $wr ($ok ? "done" : "fail"), " $seq\n";
+   }
+}
+
+sub _save_write {
+   local $SIG{PIPE} = 'IGNORE'; # a dead worker is handled below
+   while (length $SAVE_OUT) {
+      my $w = syswrite $SAVE_WR, $SAVE_OUT;
+      unless (defined $w) {
+         last if $!{EAGAIN};
+         _save_worker_lost ();
          return;
       }
+      substr $SAVE_OUT, 0, $w, '';
+   }
+
+   if (length $SAVE_OUT) {
+      $SAVE_WW ||= AE::io $SAVE_WR, 1, sub { _save_write () };
+   } else {
+      undef $SAVE_WW;
+   }
+}
+
+sub _save_read {
+   my $r = sysread $SAVE_RD, $SAVE_BUF, 4096, length $SAVE_BUF;
+   unless ($r) {
+      return if !defined $r && $!{EAGAIN};
+      _save_worker_lost ();
+      return;
+   }
+
+   _save_result ($1) while $SAVE_BUF =~ s/^([^\n]*)\n//;
+}
+
+# Blocks while $cond returns true and the worker is running.
+sub _save_wait {
+   my ($cond) = @_;
+
+   while ($SAVE_WR && $cond->()) {
+      my ($rfd, $wfd) = (fileno $SAVE_RD, fileno $SAVE_WR);
+      my ($rin, $win) = ('', '');
+      vec ($rin, $rfd, 1) = 1;
+      vec ($win, $wfd, 1) = 1 if length $SAVE_OUT;
+      next if select ($rin, $win, undef, undef) <= 0;
+
+      _save_write () if vec ($win, $wfd, 1);
+      _save_read () if $SAVE_RD && vec ($rin, $rfd, 1);
+   }
+}
+
+sub _save_result {
+   my ($status, $seq) = split /\s+/, $_[0];
+   my $p = delete $SAVE_PENDING{$seq}
+      or return;
 
-      if (rename "$file~", $file) {
-         delete $SECTORS{$id}->{dirty};
-         vox_log (info =>
-              "saved sector $id to '$file', saved $ecnt entities, took %.3f seconds, wrote %d bytes",
-              time - $t1, length($filedata));
+   my ($id, $sec, $snap, $log_seq, $gens) = @$p;
+   my $newest = $SAVE_NEWEST{$id} == $seq;
+   delete $SAVE_NEWEST{$id} if $newest;
 
+   if ($status eq 'done') {
+      _world_sector_saved ($id, $log_seq, $gens);
+
+   } elsif (!$newest) {
+      # a later snapshot has all changes of this one and is either saved
+      # already or still on its way, writing this one would overwrite it:
+      vox_log (error => "save worker couldn't save sector %s, a later save replaces it", $id);
+
+   } elsif ($SECTORS{$id}) {
+      vox_log (error => "save worker couldn't save sector %s, trying again later", $id);
+      world_sector_dirty ($sec);
+
+   } else {
+      vox_log (error => "save worker couldn't save freed sector %s, trying it here", $id);
+      if (eval { _world_write_snapshot (thaw ($snap)); 1 }) {
+         _world_sector_saved ($id, $log_seq, $gens);
       } else {
-         vox_log (error => "couldn't rename sector file '$file~' to '$file': $!");
+         vox_log (error => "%s, the changes of sector %s are lost!", $@, $id)
+            unless $LOG; # are replayed from there otherwise
       }
+   }
+}
 
-   } else {
-      vox_log (error => "couldn't save sector $id to '$file~': $!");
+sub _save_worker_lost {
+   vox_log (error => "save worker %d died, saving synchronously from now on", $SAVE_PID);
+   undef $SAVE_W;
+   undef $SAVE_WW;
+   undef $SAVE_RD;
+   undef $SAVE_WR;
+   kill TERM => $SAVE_PID; # in case only the pipe broke
+   waitpid $SAVE_PID, 0;
+
+   # oldest first, so that the newest snapshot of a sector wins:
+   %SAVE_NEWEST = ();
+   for my $seq (sort { $a <=> $b } keys %SAVE_PENDING) {
+      my ($id, $sec, $snap, $log_seq, $gens) = @{delete $SAVE_PENDING{$seq}};
+      if (eval { _world_write_snapshot (thaw ($snap)); 1 }) {
+         _world_sector_saved ($id, $log_seq, $gens);
+         next;
+      }
+      vox_log (error => "%s", $@);
+      world_sector_dirty ($sec);
+   }
+}
+
+sub _log_open {
+   my $file = "$Games::VoxEngine::Server::Resources::MAPDIR/mutations.log";
+
+   $LOG = eval {
+      Games::VoxEngine::Server::MutationLog->new (
+         file => $file, sync => $LOG_SYNC, sync_interval => $LOG_SYNC_INTERVAL)
+   };
+   unless ($LOG) {
+      vox_log (error => "couldn't open the mutation log, modified sectors are saved directly: %s", $@);
+      return;
+   }
+
+   vox_log (warn => "dropped %d bytes of incomplete changes at the end of '%s'",
+            $LOG->dropped, $file) if $LOG->dropped;
+   vox_log (info => "opened mutation log '%s', %d sectors have changes in it",
+            $file, scalar ($LOG->sector_ids));
+   $LOG_CHECKPOINT_TIME = time;
+}
+
+# Appends the chunks and entities changed since the last call to the log.
+sub _log_flush {
+   return unless $LOG;
+
+   my %secs;
+   for my $id (keys %LOG_CHUNKS) {
+      next unless $SECTORS{$id};
+      $secs{$id}->{chunks} = [
+         map { [@$_, Games::VoxEngine::World::get_chunk_data (@$_)] }
+            values %{$LOG_CHUNKS{$id}}
+      ];
+   }
+   for my $id (keys %LOG_ENTS) {
+      my $s = $SECTORS{$id}
+         or next;
+      for my $eid (keys %{$LOG_ENTS{$id}}) {
+         my $e = $s->{entities}->{$eid};
+         # without the temporary data, like in the sector files:
+         $secs{$id}->{ents}->{$eid} = $e ? { %$e, tmp => {} } : undef;
+      }
+   }
+   (%LOG_CHUNKS, %LOG_ENTS) = ();
+
+   unless (eval { $LOG->append (\%secs) if %secs; 1 }) {
+      # the sectors are still dirty, save them as soon as possible:
+      vox_log (error => "%s", $@);
+      _log_checkpoint_start () unless $LOG_CHECKPOINT;
+   }
+   eval { $LOG->sync_if_due; 1 }
+      or vox_log (error => "%s", $@);
+}
+
+# Queues all modified sectors and the ones with changes in the log for
+# saving, so that the log can be compacted afterwards.
+sub _log_checkpoint_start {
+   _log_flush ();
+
+   my %secs;
+   for (splice @SAVE_SECTORS_QUEUE) {
+      $secs{$_->[0]} = $_->[1];
+   }
+   $secs{$_} ||= world_id2pos ($_) for $LOG->sector_ids;
+
+   $LOG_CHECKPOINT = [map { [$_, $secs{$_}] } keys %secs];
+   vox_log (info => "mutation log checkpoint of %d sectors started, the log has %d bytes",
+            scalar (@$LOG_CHECKPOINT), $LOG->size);
+}
+
+# Loads a sector that isn't loaded anymore, but has changes in the log,
+# so that it is saved with them.
+sub _log_checkpoint_load {
+   my ($s) = @_;
+
+   unless (world_sector_exists ($s->[1])) {
+      vox_log (error => "sector %s has changes in the mutation log, but isn't stored, dropping them",
+               $s->[0]);
+      $LOG->forget ($s->[0], $LOG->seq);
+      return;
+   }
+
+   world_load_sector ($s->[1]);
+}
+
+sub _log_checkpoint_done {
+   undef $LOG_CHECKPOINT;
+   $LOG_CHECKPOINT_TIME = time;
+
+   my $freed = eval { $LOG->compact };
+   unless (defined $freed) {
+      vox_log (error => "%s", $@);
+      return;
    }
+   vox_log (info => "mutation log checkpoint done, freed %d bytes, %d bytes left",
+            $freed, $LOG->size);
 }
 
 sub region_init {
-   my ($cmds) = @_;
+   my ($prog) = @_;
 
    my $t1 = time;
 
+   # the region map only depends on the seed, the size and the script, so
+   # it is drawn once and kept in the map directory:
+   my $key  = md5_hex (join "\0", $REGION_SEED, $REGION_SIZE, ref $prog ? $$prog : $prog);
+   my $file = "$Games::VoxEngine::Server::Resources::MAPDIR/region_$key.map";
+
+   if ($REGION = Games::VoxEngine::Region::load ($file)) {
+      vox_log (info => "loaded region map with seed %d from '%s' in %.3f",
+               $REGION_SEED, $file, time - $t1);
+      return;
+   }
+
    vox_log (info => "calculating region map with seed %d", $REGION_SEED);
    Games::VoxEngine::VolDraw::alloc ($REGION_SIZE);
 
-   Games::VoxEngine::VolDraw::draw_commands (
-     $cmds,
+   Games::VoxEngine::VolDraw::draw_program (
+     $prog,
      { size => $REGION_SIZE, seed => $REGION_SEED, param => 1 }
    );
 
    $REGION = Games::VoxEngine::Region::new_from_vol_draw_dst ();
    vox_log (info => "calculating region map with seed %d took %.3f",
             $REGION_SEED, time - $t1);
+
+   unless (Games::VoxEngine::Region::save ($REGION, "$file~")
+           && rename "$file~", $file) {
+      vox_log (error => "couldn't save region map to '$file': $!");
+      unlink "$file~";
+   }
 }
 
 sub world_sector_info_at {
@@ -623,7 +1152,7 @@ sub world_load_at_player {
          world_load_sector (world_id2pos ($_), sub {
             $cnt--;
             $cb->() if $cnt <= 0;
-         });
+         }, async => 1);
       } else {
          $cnt--;
          $cb->() if $cnt <= 0;
@@ -641,11 +1170,11 @@ sub world_load_around_at {
       for my $y (-2, 0, 2) {
          for my $z (-2, 0, 2) {
             my $ch = vaddd ($chnk, $x, $y, $z);
-            world_load_at_chunk ($ch, sub {
+            world_load_sector (world_chnkpos2secpos ($ch), sub {
                if (--$cnt <= 0) {
                   $cb->();
                }
-            });
+            }, async => 1, pinned => 1);
          }
       }
    }
@@ -662,17 +1191,33 @@ sub world_load_at_chunk {
    world_load_sector ($sec, $cb);
 }
 
+# Loads the sector, generating it if it doesn't exist yet. With "async"
+# new sectors are generated in the background and $cb is called once they
+# are loaded. Jobs for sectors no player sees anymore are dropped unless
+# they are "pinned".
 sub world_load_sector {
-   my ($sec, $cb) = @_;
+   my ($sec, $cb, %arg) = @_;
 
-   if ($in_mutate) {
-      push @mutate_cont, sub { world_load_sector ($sec, $cb); };
-      return;
-   }
+   my $secid = world_pos2id ($sec);
+   my @cbs;
+   unless ($SECTORS{$secid}) {
+      my $mpd = $Games::VoxEngine::Server::Resources::MAPDIR;
+      _gen_worker_start () if $arg{async} && !$GEN_STARTED++;
+      if ($arg{async} && $GEN_WR && !world_sector_exists ($sec)) {
+         my $job = $GEN_JOBS{$secid} ||= { sec => [@$sec], cbs => [] };
+         push @{$job->{cbs}}, $cb if $cb;
+         $job->{pinned} ||= $arg{pinned};
+         _gen_dispatch ();
+         return;
+      }
 
-   local $in_mutate = 1;
+      if (defined $GEN_RUNNING && $GEN_RUNNING eq $secid) {
+         _gen_wait (); # loads it
+      } elsif (my $job = delete $GEN_JOBS{$secid}) {
+         @cbs = @{$job->{cbs}};
+      }
+   }
 
-   my $secid = world_pos2id ($sec);
    unless ($SECTORS{$secid}) {
       vox_log (info => "getting unloaded sector %s", $secid);
 
@@ -681,15 +1226,197 @@ sub world_load_sector {
          _world_make_sector ($sec);
       }
    }
+   $_->() for @cbs;
    $cb->() if $cb;
 
    vox_log (debug => "%d sectors loaded: %s", scalar (keys %SECTORS), join (", ", keys %SECTORS));
+}
+
+# Forks the sector generation worker on the first asynchronous load, when
+# the server is done loading the object types. It shares the region map and
+# the resources with the server, reads the sectors to generate from a pipe and
+# stores them in the pack files of the map directory. The server loads them
+# when the worker reports back. Without the worker everything is generated
+# synchronously like before.
+sub _gen_worker_start {
+   return if $^O eq 'MSWin32'; # fork is emulated with threads there
+
+   my ($job_rd, $job_wr, $res_rd, $res_wr);
+   unless (pipe ($job_rd, $job_wr) && pipe ($res_rd, $res_wr)) {
+      vox_log (warn => "couldn't create pipes for the sector generator: $!");
+      return;
+   }
+
+   my $pid = fork;
+   unless (defined $pid) {
+      vox_log (warn => "couldn't fork the sector generator: $!");
+      return;
+   }
+
+   unless ($pid) {
+      close $job_wr;
+      close $res_rd;
+      close $_ for grep { $_ } $SAVE_RD, $SAVE_WR; # the save worker's
+      undef $LOG; # only the server appends
+      _worker_close_fds ($job_rd, $res_wr);
+      # the draw threads of the server aren't forked with it:
+      Games::VoxEngine::VolDraw::set_threads ($ENV{PERL_GAMES_CONSTRUDER_DRAW_THREADS})
+         if $ENV{PERL_GAMES_CONSTRUDER_DRAW_THREADS};
+      _gen_worker_loop ($job_rd, $res_wr);
+      POSIX::_exit (0);
+   }
+
+   close $job_rd;
+   close $res_wr;
+   $job_wr->autoflush (1);
+
+   ($GEN_PID, $GEN_RD, $GEN_WR, $GEN_BUF) = ($pid, $res_rd, $job_wr, '');
+   $GEN_W = AE::io $GEN_RD, 0, sub { _gen_read () };
+   vox_log (info => "started sector generator with pid %d", $pid);
+}
+
+# Points all inherited file descriptors except stdio, the log file and
+# @keep to /dev/null in a forked worker. The listening socket and the
+# client connections of the server are really closed by the server then,
+# and the descriptor numbers can't be reused by the worker's own files
+# while perl still has handles for them.
+sub _worker_close_fds {
+   my (@keep) = @_;
+
+   my %keep = map { $_ => 1 } 0, 1, 2,
+      map { fileno $_ } grep { $_ } $Games::VoxEngine::Logging::LOGFILE_FH, @keep;
+
+   my $dh;
+   opendir $dh, "/proc/self/fd"
+      or opendir $dh, "/dev/fd"
+      or return;
+   $keep{fileno $dh} = 1;
+   my @fds = grep { /^\d+$/ && !$keep{$_} } readdir $dh;
+   closedir $dh;
+
+   my $null = POSIX::open ("/dev/null", POSIX::O_RDWR)
+      // return;
+   POSIX::dup2 ($null, $_) for grep { $_ != $null } @fds;
+   POSIX::close ($null);
+}
 
-   local $in_mutate = 0;
+sub _gen_worker_loop {
+   my ($rd, $wr) = @_;
+   $wr->autoflush (1);
 
-   while (@mutate_cont) {
-      my $m = shift @mutate_cont;
-      $m->();
+   while (defined (my $line = <$rd>)) {
+      my $sec = [split /\s+/, $line];
+      my $ok  = world_generate_sector ($sec);
+      print $wr ($ok ? "done" : "fail"), " @$sec\n";
+   }
+}
+
+# Generates the sector and stores it in the map directory without keeping
+# it loaded, a sector that is stored already is kept. Used by the generator
+# worker and bin/construder_pregen. Returns true if the sector is stored.
+sub world_generate_sector {
+   my ($sec) = @_;
+   my $id = world_pos2id ($sec);
+
+   my $ok = eval { _world_make_sector ($sec, 1); 1 };
+   vox_log (error => "couldn't generate sector $id: $@") unless $ok;
+
+   delete $SECTORS{$id};
+   delete $CHUNK_GENS{$id};
+   _world_purge_sector_chunks ($sec);
+   (@LIGHTQUEUE, %LIGHTQUEUE, @SAVE_SECTORS_QUEUE, %LOG_CHUNKS, %LOG_ENTS) = ();
+
+   $ok && world_sector_exists ($sec)
+}
+
+sub world_sector_exists {
+   my ($sec) = @_;
+   my $mpd = $Games::VoxEngine::Server::Resources::MAPDIR;
+   my $has = eval { sector_pack_has ($mpd, $sec) };
+   $has || -e "$mpd/" . world_pos2id ($sec) . ".sec"
+}
+
+# Distance from the job's sector to the nearest player that sees it,
+# undef if nobody needs it anymore.
+sub _gen_job_distance {
+   my ($id, $job) = @_;
+   return -1 if $job->{pinned};
+
+   my $dist;
+   for my $pl (values %{$SRV->{players}}) {
+      next unless $pl->{visible_sectors}->{$id};
+      my $d = vlength (vsub ($pl->get_pos_sector, $job->{sec}));
+      $dist = $d if !defined $dist || $dist > $d;
+   }
+   $dist
+}
+
+sub _gen_dispatch {
+   return if defined $GEN_RUNNING || !$GEN_WR;
+
+   my ($next, $next_dist);
+   for my $id (keys %GEN_JOBS) {
+      my $d = _gen_job_distance ($id, $GEN_JOBS{$id});
+      unless (defined $d) {
+         vox_log (debug => "dropped generation of sector %s, nobody needs it", $id);
+         delete $GEN_JOBS{$id};
+         next;
+      }
+      ($next, $next_dist) = ($id, $d)
+         if !defined $next_dist || $next_dist > $d;
+   }
+   return unless defined $next;
+
+   $GEN_RUNNING = $next;
+   syswrite $GEN_WR, "@{$GEN_JOBS{$next}->{sec}}\n";
+}
+
+sub _gen_read {
+   my $r = sysread $GEN_RD, $GEN_BUF, 4096, length $GEN_BUF;
+   unless ($r) {
+      return if !defined $r && $!{EAGAIN};
+      _gen_worker_lost ();
+      return;
+   }
+
+   _gen_result ($1) while $GEN_BUF =~ s/^([^\n]*)\n//;
+}
+
+# Blocks until the worker finished the running job.
+sub _gen_wait {
+   my $id = $GEN_RUNNING;
+   _gen_read () while $GEN_RD && defined $GEN_RUNNING && $GEN_RUNNING eq $id;
+}
+
+sub _gen_result {
+   my ($line) = @_;
+   my ($status, @sec) = split /\s+/, $line;
+   my $id  = world_pos2id (\@sec);
+
+   undef $GEN_RUNNING;
+   my $job = delete $GEN_JOBS{$id};
+
+   # a failed job is generated synchronously by world_load_sector:
+   if ($job && defined _gen_job_distance ($id, $job)) {
+      world_load_sector ($job->{sec});
+      $_->() for @{$job->{cbs}};
+   }
+
+   _gen_dispatch ();
+}
+
+sub _gen_worker_lost {
+   vox_log (error => "sector generator %d died, generating synchronously from now on", $GEN_PID);
+   undef $GEN_W;
+   undef $GEN_RD;
+   undef $GEN_WR;
+   undef $GEN_RUNNING;
+   kill TERM => $GEN_PID; # in case only the pipe broke
+   waitpid $GEN_PID, 0;
+
+   for my $job (values %GEN_JOBS) {
+      delete $GEN_JOBS{world_pos2id ($job->{sec})};
+      world_load_sector ($job->{sec}, $_) for @{$job->{cbs}};
    }
 }
 
@@ -720,6 +1447,7 @@ sub world_mutate_entity_at {
       my $si = world_sector_info_at ($pos);
       push @$cell, world_entity_at ($pos);
       if ($cb->($pos, $cell)) {
+         $LOG_ENTS{world_pos2id ($si->{pos})}->{world_pos2id ($pos)} = 1 if $LOG;
          world_sector_dirty ($si->{pos});
       }
       return 0;
@@ -729,12 +1457,7 @@ sub world_mutate_entity_at {
 sub world_mutate_at {
    my ($poses, $cb, %arg) = @_;
 
-   if ($in_mutate) {
-      push @mutate_cont, sub { world_mutate_at ($poses, $cb, %arg); };
-      return,
-   }
-
-   local $in_mutate = 1;
+   my $q = _query_get ();
 
    if (ref $poses->[0]) {
       my $min = [];
@@ -761,12 +1484,12 @@ sub world_mutate_at {
          }
       }
      #d# warn "MUTL @$min | @$max\n";
-      Games::VoxEngine::World::flow_light_query_setup (@$min, @$max);
+      Games::VoxEngine::World::flow_light_query_setup ($q, @$min, @$max);
 
    } else {
       world_load_at ($poses); # blocks for now :-/
 
-      Games::VoxEngine::World::flow_light_query_setup (@$poses, @$poses);
+      Games::VoxEngine::World::flow_light_query_setup ($q, @$poses, @$poses);
       $poses = [$poses];
    }
 
@@ -778,26 +1501,60 @@ sub world_mutate_at {
       #d# print "MULT MUTATING (@$b) (AT @$pos)\n";
       if ($cb->($b, $pos)) {
          #d# print "MULT MUTATING TO => (@$b) (AT @$pos)\n";
-         Games::VoxEngine::World::query_set_at_abs (@$pos, $b);
+         Games::VoxEngine::World::query_set_at_abs ($q, @$pos, $b);
          unless ($arg{no_light}) {
             my $t1 = time;
-            Games::VoxEngine::World::flow_light_at (@{vfloor ($pos)});
+            Games::VoxEngine::World::flow_light_at ($q, @{vfloor ($pos)});
             vox_log (profile => "mult light calc at pos @$pos took: %f secs\n", time - $t1);
          }
       }
    }
 
    {
-     my $dirty = Games::VoxEngine::World::query_desetup ();
+     my $dirty = Games::VoxEngine::World::query_desetup ($q);
      vox_log (debug => "%d chunks dirty after mutation and possible light flow", $dirty);
    }
 
-   local $in_mutate = 0;
+   _query_put ($q);
+}
 
-   while (@mutate_cont) {
-      my $m = shift @mutate_cont;
-      $m->();
+# Sets many cells at once. $cells is a string of packed native 32 bit
+# integers (x, y, z, type, light, meta, add) per cell, see
+# world_pack_cell. Negative values keep the respective field of the cell.
+sub world_set_cells {
+   my ($cells, %arg) = @_;
+
+   my $b = Games::VoxEngine::World::cells_bounds ($cells);
+   return unless @$b;
+
+   my $min_sec = world_chnkpos2secpos (world_pos2chnkpos ([@$b[0..2]]));
+   my $max_sec = world_chnkpos2secpos (world_pos2chnkpos ([@$b[3..5]]));
+   for my $x ($min_sec->[0]..$max_sec->[0]) {
+      for my $y ($min_sec->[1]..$max_sec->[1]) {
+         for my $z ($min_sec->[2]..$max_sec->[2]) {
+            world_load_sector ([$x, $y, $z]);
+         }
+      }
    }
+
+   my $q = _query_get ();
+   Games::VoxEngine::World::flow_light_query_setup ($q, @$b);
+
+   my $t1 = time;
+   my $cnt =
+      Games::VoxEngine::World::query_set_cells_abs ($q, $cells, $arg{no_light});
+   vox_log (profile => "setting %d cells took: %f secs\n", $cnt, time - $t1);
+
+   my $dirty = Games::VoxEngine::World::query_desetup ($q);
+   vox_log (debug => "%d chunks dirty after setting %d cells", $dirty, $cnt);
+
+   _query_put ($q);
+}
+
+sub world_pack_cell {
+   my ($pos, $type, $light, $meta, $add) = @_;
+   pack "l7", @{vfloor ($pos)},
+      map { defined $_ ? $_ : -1 } $type, $light, $meta, $add
 }
 
 sub world_find_free_spot {
@@ -817,7 +1574,8 @@ sub world_find_random_teleport_destination_at_dist {
       Games::VoxEngine::Region::get_nearest_sector_in_range (
          $Games::VoxEngine::Server::World::REGION,
          @$sec,
-         $Games::VoxEngine::Server::RES->get_teleport_destination_region_range
+         $Games::VoxEngine::Server::RES->get_teleport_destination_region_range,
+         1 # we only need the first one
       );
 
    my @coords;
@@ -27,15 +27,98 @@
  * the fix point iteration of computing the light of the cells within that area.
  */
 
+typedef struct _vox_light_item {
+    int x, y, z;
+    unsigned char lv;
+} vox_light_item;
+
+/* We use a set of two queues per query context,
+ * so we can quickly switch back and forth.
+ */
+
+// Clears light queues for light computation.
+void vox_world_light_upd_start (vox_world_query *q)
+{
+  if (!q->light_upd_queue_1)
+    {
+      q->light_upd_queue_1 =
+         vox_queue_new (sizeof (vox_light_item),
+                        CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE * 9 * 2);
+      q->light_upd_queue_2 =
+         vox_queue_new (sizeof (vox_light_item),
+                        CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE * 9 * 2);
+    }
+
+  q->light_upd_queue = q->light_upd_queue_1;
+  vox_queue_clear (q->light_upd_queue_1);
+  vox_queue_clear (q->light_upd_queue_2);
+}
+
+// Select light queue used.
+void vox_world_light_select_queue (vox_world_query *q, int i)
+{
+  q->light_upd_queue = i > 0 ? q->light_upd_queue_2 : q->light_upd_queue_1;
+}
+
+// Store item in the queue.
+void vox_world_light_enqueue (vox_world_query *q, int x, int y, int z, unsigned char light)
+{
+  vox_light_item it;
+  it.x = x;
+  it.y = y;
+  it.z = z;
+  it.lv = light;
+  vox_queue_enqueue (q->light_upd_queue, &it);
+  //d// printf ("light upd enqueue %d,%d,%d: %d\n", x, y, z, light);
+}
+
+// Freeze current queue state.
+void vox_world_light_freeze_queue (vox_world_query *q)
+{
+  vox_queue_freeze (q->light_upd_queue);
+}
+
+// Thaw current queue state.
+void vox_world_light_thaw_queue (vox_world_query *q)
+{
+  vox_queue_thaw (q->light_upd_queue);
+}
+
+// Enqueue neighbor cells.
+void vox_world_light_enqueue_neighbours (vox_world_query *q, int x, int y, int z, unsigned char light)
+{
+  vox_world_light_enqueue (q, x + 1, y, z, light);
+  vox_world_light_enqueue (q, x - 1, y, z, light);
+  vox_world_light_enqueue (q, x, y + 1, z, light);
+  vox_world_light_enqueue (q, x, y - 1, z, light);
+  vox_world_light_enqueue (q, x, y, z + 1, light);
+  vox_world_light_enqueue (q, x, y, z - 1, light);
+}
+
+int vox_world_light_dequeue (vox_world_query *q, int *x, int *y, int *z, unsigned char *light)
+{
+  vox_light_item *it = vox_queue_dequeue (q->light_upd_queue);
+  if (it)
+    {
+      *x = it->x;
+      *y = it->y;
+      *z = it->z;
+      *light = it->lv;
+      //d// printf ("light upd dequeue %d,%d,%d: %d\n", *x, *y, *z, *light);
+    }
+
+  return it != 0;
+}
+
 // Utility function to get the maximum light level from the neighbors.
-unsigned char vox_world_query_get_max_light_of_neighbours (x, y, z)
+unsigned char vox_world_query_get_max_light_of_neighbours (vox_query_cursor *c)
 {
-  vox_cell *above = vox_world_query_cell_at (x, y + 1, z, 0);
-  vox_cell *below = vox_world_query_cell_at (x, y - 1, z, 0);
-  vox_cell *left  = vox_world_query_cell_at (x - 1, y, z, 0);
-  vox_cell *right = vox_world_query_cell_at (x + 1, y, z, 0);
-  vox_cell *front = vox_world_query_cell_at (x, y, z - 1, 0);
-  vox_cell *back  = vox_world_query_cell_at (x, y, z + 1, 0);
+  vox_cell *above = vox_query_cursor_neighbour (c, QUERY_CURSOR_Y,  1);
+  vox_cell *below = vox_query_cursor_neighbour (c, QUERY_CURSOR_Y, -1);
+  vox_cell *left  = vox_query_cursor_neighbour (c, QUERY_CURSOR_X, -1);
+  vox_cell *right = vox_query_cursor_neighbour (c, QUERY_CURSOR_X,  1);
+  vox_cell *front = vox_query_cursor_neighbour (c, QUERY_CURSOR_Z, -1);
+  vox_cell *back  = vox_query_cursor_neighbour (c, QUERY_CURSOR_Z,  1);
   unsigned char l = 0;
   if (above && above->light > l) l = above->light;
   if (below && below->light > l) l = below->light;
@@ -46,22 +129,24 @@ unsigned char vox_world_query_get_max_light_of_neighbours (x, y, z)
   return l;
 }
 
-// (Re)flows the light within a query context at the position x,y,z.
-void vox_world_query_reflow_light (int x, int y, int z)
+/* Finds out what kind of light change the changed cell at x,y,z causes
+ * and puts it into the light queue. Returns 0 if the light around the
+ * cell doesn't need to be recomputed.
+ *
+ * When many cells changed, the light of the neighbours is not final yet
+ * while seeding. "radius" is then the brightest light around the
+ * changed cells and is used as the minimum update radius.
+ */
+int vox_world_query_seed_light (vox_world_query *q, int x, int y, int z, unsigned char radius)
 {
-  int query_w = QUERY_CONTEXT.x_w * CHUNK_SIZE;
-
-  vox_world_light_upd_start ();
+  vox_query_cursor c;
+  vox_query_cursor_set (&c, q, x, y, z);
 
-  vox_cell *cur = vox_world_query_cell_at (x, y, z, 0);
+  vox_cell *cur = vox_query_cursor_cell (&c, 0);
   if (!cur)
-    return;
+    return 0;
 
-  /* First part of this function tries to find out what kind of
-   * light change should be recomputed.
-   */
-
-  unsigned char l = vox_world_query_get_max_light_of_neighbours (x, y, z);
+  unsigned char l = vox_world_query_get_max_light_of_neighbours (&c);
 
   if (vox_world_cell_transparent (cur)) // a transparent cell has changed
     {
@@ -71,26 +156,31 @@ void vox_world_query_reflow_light (int x, int y, int z)
 #endif
       if (cur->light < l)
         {
-          vox_world_light_enqueue (x, y, z, l);
+          vox_world_light_enqueue (q, x, y, z, l < radius ? radius : l);
         }
       else if (cur->light > l) // we are brighter then the neighbors
         {
-          vox_world_light_enqueue (x, y, z, cur->light);
+          vox_world_light_enqueue (q, x, y, z,
+                                   cur->light < radius ? radius : cur->light);
+        }
+      else if (l < radius) // our neighbours might still change
+        {
+          vox_world_light_enqueue (q, x, y, z, radius);
         }
       else // cur->light == l
         {
           // we are transparent and have the light we should have
           // so we don't need to change anything.
           // XXX: BUT: still force update :)
-          vox_world_query_cell_at (x, y, z, 1);
-          return; // => no change, so no change for anyone else
+          vox_query_cursor_cell (&c, 1);
+          return 0; // => no change, so no change for anyone else
         }
     }
   else // oh, a (light) blocking cell has been set!
     {
-      vox_cell *cur = vox_world_query_cell_at (x, y, z, 1);
+      vox_cell *cur = vox_query_cursor_cell (&c, 1);
       if (!cur)
-        return;
+        return 0;
 
       if (cur->type == 41) // was a light: light it!
         cur->light = 8;
@@ -105,14 +195,30 @@ void vox_world_query_reflow_light (int x, int y, int z)
       // light value are update radius
       if (cur->light > l)
         l = cur->light;
-      vox_world_light_enqueue_neighbours (x, y, z, l);
+      if (radius > l)
+        l = radius;
+      vox_world_light_enqueue_neighbours (q, x, y, z, l);
     }
 
+  return 1;
+}
+
+/* Recomputes the light in the area around the changes seeded by
+ * vox_world_query_seed_light (). Changes of many cells can be seeded
+ * first and then flowed together.
+ */
+void vox_world_query_flow_light (vox_world_query *q)
+{
+  int query_w = q->x_w * CHUNK_SIZE;
+  int x, y, z;
+  vox_query_cursor c;
+  vox_cell *cur;
+
   /* The following loop tries to find the affected area by flood filling it.
    * While doing that it will compute the queue used in the next loops.
    */
   unsigned char upd_radius = 0;
-  while (vox_world_light_dequeue (&x, &y, &z, &upd_radius))
+  while (vox_world_light_dequeue (q, &x, &y, &z, &upd_radius))
     {
       // leave a margin, so we can reflow light from the outside...
       if (x <= 0 || y <= 0 || z <= 0
@@ -121,30 +227,31 @@ void vox_world_query_reflow_light (int x, int y, int z)
           || z >= (query_w - 1))
         continue;
 
-      cur = vox_world_query_cell_at (x, y, z, 0);
+      vox_query_cursor_set (&c, q, x, y, z);
+      cur = vox_query_cursor_cell (&c, 0);
       if (!cur || !vox_world_cell_transparent (cur) || cur->light == 255)
         continue; // ignore blocks that can't be lit or were already visited
 
-      cur = vox_world_query_cell_at (x, y, z, 1);
-      assert (cur);
+      cur = vox_query_cursor_cell (&c, 1);
 
       cur->light = 255; // insert "visited" marker
-      vox_world_light_select_queue (1);
-      vox_world_light_enqueue (x, y, z, 1);
-      vox_world_light_select_queue (0);
+      vox_world_light_select_queue (q, 1);
+      vox_world_light_enqueue (q, x, y, z, 1);
+      vox_world_light_select_queue (q, 0);
       if (upd_radius > 0)
-        vox_world_light_enqueue_neighbours (x, y, z, upd_radius - 1);
+        vox_world_light_enqueue_neighbours (q, x, y, z, upd_radius - 1);
     }
 
   /* Next loop clears all 255-values that were used to mark the
    * already visited cells.
    */
-  vox_world_light_select_queue (1);
-  vox_world_light_freeze_queue ();
+  vox_world_light_select_queue (q, 1);
+  vox_world_light_freeze_queue (q);
 
-  while (vox_world_light_dequeue (&x, &y, &z, &upd_radius))
+  while (vox_world_light_dequeue (q, &x, &y, &z, &upd_radius))
     {
-      cur = vox_world_query_cell_at (x, y, z, 1);
+      vox_query_cursor_set (&c, q, x, y, z);
+      cur = vox_query_cursor_cell (&c, 1);
       if (!cur)
         continue;
       cur->light = 0;
@@ -162,15 +269,16 @@ void vox_world_query_reflow_light (int x, int y, int z)
 #if DEBUG_LIGHT
       printf ("START RELIGHT PASS %d\n", pass);
 #endif
-      vox_world_light_thaw_queue ();
+      vox_world_light_thaw_queue (q);
       // recompute light for every cell in the queue
-      while (vox_world_light_dequeue (&x, &y, &z, &upd_radius))
+      while (vox_world_light_dequeue (q, &x, &y, &z, &upd_radius))
         {
-          cur = vox_world_query_cell_at (x, y, z, 0);
+          vox_query_cursor_set (&c, q, x, y, z);
+          cur = vox_query_cursor_cell (&c, 0);
           if (!cur)
             continue;
 
-          unsigned char l = vox_world_query_get_max_light_of_neighbours (x, y, z);
+          unsigned char l = vox_world_query_get_max_light_of_neighbours (&c);
           if (l > 0) l--;
 #if DEBUG_LIGHT
           printf ("[%d] relight at %d,%d,%d, me: %d, cur neigh: %d\n", pass, x, y, z, cur->light, l);
@@ -178,12 +286,19 @@ void vox_world_query_reflow_light (int x, int y, int z)
           // if the current cell is too dark, relight it
           if (cur->light < l)
             {
-              cur = vox_world_query_cell_at (x, y, z, 1);
-              assert (cur);
-
+              cur = vox_query_cursor_cell (&c, 1);
               cur->light = l;
               change = 1;
             }
         }
     }
 }
+
+// (Re)flows the light within a query context at the position x,y,z.
+void vox_world_query_reflow_light (vox_world_query *q, int x, int y, int z)
+{
+  vox_world_light_upd_start (q);
+
+  if (vox_world_query_seed_light (q, x, y, z, 0))
+    vox_world_query_flow_light (q);
+}
@@ -62,6 +62,28 @@ void vox_queue_free (vox_queue *q)
   safefree (q);
 }
 
+/* Doubles the size of a full queue. The items are moved to the
+ * beginning of the new buffer, which invalidates a frozen state.
+ */
+void vox_queue_grow (vox_queue *q)
+{
+  unsigned int size = q->item_size * q->alloc_items;
+  unsigned int tail = q->data_end - q->start;
+
+  unsigned char *nd = safemalloc (size * 2);
+  memcpy (nd, q->start, tail);
+  memcpy (nd + tail, q->data, size - tail);
+  safefree (q->data);
+
+  q->data         = nd;
+  q->data_end     = nd + size * 2;
+  q->alloc_items *= 2;
+  q->start        = nd;
+  q->end          = nd + size;
+  q->freeze_start = 0;
+  q->freeze_end   = 0;
+}
+
 void vox_queue_enqueue (vox_queue *q, void *item)
 {
   memcpy (q->end, item, q->item_size);
@@ -69,10 +91,10 @@ void vox_queue_enqueue (vox_queue *q, void *item)
   q->end += q->item_size;
 
   if (q->end == q->data_end) // wrap pointer
-    {
-      q->end = q->data;
-      assert (q->start != q->end);
-    }
+    q->end = q->data;
+
+  if (q->end == q->start) // full
+    vox_queue_grow (q);
 }
 
 /* This function stores the state of the queue, so
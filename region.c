@@ -0,0 +1,204 @@
+/*
+ * Games::VoxEngine - A 3D Game written in Perl with an infinite and modifiable world.
+ * Copyright (C) 2011  Robin Redeker
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* This file holds the region map, which decides the sector type of every
+ * sector. It is drawn once with the volume drawing functions and then
+ * quantized to 16 bit values: "min + q * scale" gives the value back with
+ * an error of at most half a step.
+ *
+ * The map can be saved to a file with the same layout as in memory, so
+ * that the server can map it instead of drawing it again at startup.
+ */
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#define VOX_REGION_MAGIC "VOXREG01"
+
+typedef struct _vox_region_header {
+  char           magic[8];
+  unsigned int   size;
+  unsigned int   byte_order; // 0x01020304 as written by this machine
+  double         min, scale;
+} vox_region_header;
+
+typedef struct _vox_region {
+  vox_region_header *hdr;
+  unsigned short    *vals; // hdr->size ^ 3 values, follow the header
+  size_t             len;  // of the header and values
+  int                mapped;
+} vox_region;
+
+// Quantizes the destination buffer of the volume drawing into a new region.
+vox_region *vox_region_new_from_vol_draw_dst ()
+{
+  unsigned int size = DRAW_CTX.size,
+               cnt  = size * size * size,
+               i;
+
+  vox_region *r = safemalloc (sizeof (vox_region));
+  r->len    = sizeof (vox_region_header) + sizeof (unsigned short) * cnt;
+  r->hdr    = safemalloc (r->len);
+  r->vals   = (unsigned short *) (r->hdr + 1);
+  r->mapped = 0;
+
+  double min = 0, max = 0;
+  for (i = 0; i < cnt; i++)
+    {
+      double v = DRAW_CTX.dst[i];
+      if (i == 0 || v < min) min = v;
+      if (i == 0 || v > max) max = v;
+    }
+
+  memset (r->hdr, 0, sizeof (vox_region_header));
+  memcpy (r->hdr->magic, VOX_REGION_MAGIC, 8);
+  r->hdr->size       = size;
+  r->hdr->byte_order = 0x01020304;
+  r->hdr->min        = min;
+  r->hdr->scale      = max > min ? (max - min) / 65535. : 0;
+
+  for (i = 0; i < cnt; i++)
+    {
+      double q = r->hdr->scale > 0 ? (DRAW_CTX.dst[i] - min) / r->hdr->scale : 0;
+      r->vals[i] = q > 0 ? (q < 65535 ? (unsigned short) (q + 0.5) : 65535) : 0;
+    }
+
+  return r;
+}
+
+// Writes the region to "file", returns 0 on error (see errno).
+int vox_region_save (vox_region *r, const char *file)
+{
+  FILE *f = fopen (file, "wb");
+  if (!f)
+    return 0;
+
+  int ok = fwrite (r->hdr, 1, r->len, f) == r->len;
+  if (fclose (f) != 0)
+    ok = 0;
+  return ok;
+}
+
+/* Maps the region saved in "file" (reads it on windows). Returns 0 if it
+ * can't be opened or isn't a region written on this kind of machine.
+ */
+vox_region *vox_region_load (const char *file)
+{
+  vox_region_header hdr;
+  FILE *f = fopen (file, "rb");
+  if (!f)
+    return 0;
+
+  if (fread (&hdr, sizeof (hdr), 1, f) != 1
+      || memcmp (hdr.magic, VOX_REGION_MAGIC, 8) != 0
+      || hdr.byte_order != 0x01020304
+      || hdr.size == 0 || hdr.size > 1024)
+    {
+      fclose (f);
+      return 0;
+    }
+
+  size_t len =
+    sizeof (hdr) + sizeof (unsigned short) * hdr.size * hdr.size * hdr.size;
+
+  fseek (f, 0, SEEK_END);
+  if (ftell (f) != (long) len)
+    {
+      fclose (f);
+      return 0;
+    }
+
+  vox_region *r = safemalloc (sizeof (vox_region));
+  r->len = len;
+
+#ifndef _WIN32
+  void *map = mmap (0, len, PROT_READ, MAP_PRIVATE, fileno (f), 0);
+  fclose (f);
+  if (map == MAP_FAILED)
+    {
+      safefree (r);
+      return 0;
+    }
+  r->hdr    = map;
+  r->mapped = 1;
+#else
+  r->hdr    = safemalloc (len);
+  r->mapped = 0;
+  fseek (f, 0, SEEK_SET);
+  int ok = fread (r->hdr, 1, len, f) == len;
+  fclose (f);
+  if (!ok)
+    {
+      safefree (r->hdr);
+      safefree (r);
+      return 0;
+    }
+#endif
+
+  r->vals = (unsigned short *) (r->hdr + 1);
+  return r;
+}
+
+void vox_region_free (vox_region *r)
+{
+#ifndef _WIN32
+  if (r->mapped)
+    munmap (r->hdr, r->len);
+  else
+#endif
+    safefree (r->hdr);
+  safefree (r);
+}
+
+double region_get_sector_value (void *reg, int x, int y, int z)
+{
+  if (!reg)
+     return 0;
+
+  vec3_init (secpos, x, y, z);
+  double l = fabs (vec3_len (secpos));
+  if (l < 1)
+    return 1.85; // the core
+  else if (l < 200
+           && ((abs (x) < 1 && abs (y) < 1)
+               || (abs (z) < 1 && abs (y) < 1)
+               || (abs (x) < 1 && abs (z) < 1)))
+    return 1.65; // the axis, going from center to the outer construct connection
+  else if (l < 30 // here we check the void: void is in the inner shell surface
+           || (l > 130 // and beyond the outer shell surface, but only if inside the
+                       // huge construct cube which spans 200 in each direction
+               && (abs (x) < 200 && abs (y) < 200 && abs (z) < 200)))
+    return 1.55; // the void
+  else // we are in the sphere shell around that
+    {
+      vox_region *r = reg;
+      int reg_size = r->hdr->size;
+
+      if (x < 0) x = -x;
+      if (y < 0) y = -y;
+      if (z < 0) z = -z;
+      x %= reg_size;
+      y %= reg_size;
+      z %= reg_size;
+
+      return r->hdr->min
+             + r->vals[x + y * reg_size + z * reg_size * reg_size] * r->hdr->scale;
+    }
+}
@@ -0,0 +1,61 @@
+#!perl
+
+use strict;
+use Test::More tests => 14;
+use File::Temp qw/tempdir/;
+use Compress::LZF qw/compress/;
+use JSON;
+
+BEGIN {
+	use_ok( 'Games::VoxEngine::Server::SectorFile' );
+}
+
+my $dir = tempdir (CLEANUP => 1);
+
+my $meta   = { pos => [1, -2, 3], entities => { "1x2x3" => { type => 35 } } };
+my @chunks = map { pack ("N", $_) x (12 * 12 * 12) } 0..124;
+$chunks[7] = "";
+
+my $data = sector_file_encode ($meta, \@chunks);
+ok (!sector_file_is_legacy ($data), "encoded data is in the indexed format");
+
+my ($m, $c) = sector_file_decode ($data);
+is_deeply ($m, $meta, "meta data round trip");
+is_deeply ($c, \@chunks, "chunk round trip");
+
+my $file = "$dir/1x-2x3.sec";
+is (sector_file_write ($file, $meta, \@chunks), length $data, "write returns the length");
+($m, $c) = sector_file_read ($file);
+is_deeply ($c, \@chunks, "read what was written");
+
+($m, $c) = sector_file_read_chunks ($file, 3, 124);
+is_deeply ($c, { 3 => $chunks[3], 124 => $chunks[124] }, "read single chunks");
+
+# replace two chunks and the meta data:
+my @upd = (undef) x 125;
+$upd[0]  = "x" x length $chunks[0];
+$upd[99] = "y" x 10;
+my $patched = sector_file_patch ($data, { new => 1 }, \@upd);
+my @want = @chunks;
+@want[0, 99] = @upd[0, 99];
+($m, $c) = sector_file_decode ($patched);
+is_deeply ($m, { new => 1 }, "patch replaces the meta data");
+is_deeply ($c, \@want, "patch replaces only the given chunks");
+
+eval { sector_file_patch ($data, $meta, [(undef) x 10]) };
+like ($@, qr/125 chunks/, "patch with the wrong number of chunks dies");
+
+# the format from before the indexed one:
+my @lens   = map { length } @chunks;
+my $legacy = compress (
+   JSON->new->utf8->encode ($meta)
+   . "\n\nMAPDATA " . length (join "", @chunks) . " @lens\n\n"
+   . join "", @chunks);
+ok (sector_file_is_legacy ($legacy), "old format is recognized");
+($m, $c) = sector_file_decode ($legacy);
+is_deeply ($c, \@chunks, "old format is decoded");
+($m, $c) = sector_file_decode (sector_file_patch ($legacy, $meta, \@upd));
+is_deeply ($c, \@want, "old format is converted by patch");
+
+eval { sector_file_decode (substr $data, 0, length ($data) - 100) };
+like ($@, qr/truncated/, "truncated file dies");
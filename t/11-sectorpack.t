@@ -0,0 +1,73 @@
+#!perl
+
+use strict;
+use Test::More tests => 20;
+use File::Temp qw/tempdir/;
+use Fcntl;
+
+BEGIN {
+	use_ok( 'Games::VoxEngine::Server::SectorPack' );
+}
+
+my $dir = tempdir (CLEANUP => 1);
+
+is (sector_pack_file ($dir, [-1, 0, 17]), "$dir/sectors_-1x0x2.pack",
+    "pack file of a sector");
+
+ok (!sector_pack_has ($dir, [1, 2, 3]), "nothing stored yet");
+is (sector_pack_get ($dir, [1, 2, 3]), undef, "get of a missing sector");
+
+is (sector_pack_put ($dir, [1, 2, 3], "first" x 100), 500, "put returns the length");
+ok (sector_pack_has ($dir, [1, 2, 3]), "sector is stored");
+is (sector_pack_get ($dir, [1, 2, 3]), "first" x 100, "get what was put");
+
+is (sector_pack_put ($dir, [1, 2, 3], "other", 1), 0, "new_only keeps a stored sector");
+is (sector_pack_get ($dir, [1, 2, 3]), "first" x 100, "and doesn't change it");
+
+sector_pack_put ($dir, [2, 2, 3], "neighbour" x 10);
+sector_pack_put ($dir, [1, 2, 3], "second" x 200);
+is (sector_pack_get ($dir, [1, 2, 3]), "second" x 200, "put replaces a sector");
+is (sector_pack_get ($dir, [2, 2, 3]), "neighbour" x 10, "other sectors are kept");
+
+# damage the newest index slot, as if its write was interrupted:
+my $file = sector_pack_file ($dir, [1, 2, 3]);
+sector_pack_put ($dir, [1, 2, 3], "third" x 50);
+{
+   sysopen my $fh, $file, O_RDWR or die "$file: $!";
+   my $slot_len = 20 + 8 * 8 ** 3;
+   my @gen = map {
+      sysseek $fh, 16 + $_ * $slot_len + 16, 0;
+      sysread $fh, my $g, 4;
+      unpack "N", $g
+   } 0, 1;
+   sysseek $fh, 16 + ($gen[0] > $gen[1] ? 0 : 1) * $slot_len + 30, 0;
+   syswrite $fh, "\xff\xff";
+}
+is (sector_pack_get ($dir, [1, 2, 3]), "second" x 200,
+    "a torn index slot falls back to the older one");
+
+my $size = -s $file;
+my ($old, $new, $cnt) = sector_pack_compact ($file);
+is ($old, $size, "compact returns the old size");
+ok ($new < $old && $new == -s $file, "compact removes the unused space");
+is ($cnt, 2, "compact keeps every sector");
+is_deeply ([map { sector_pack_get ($dir, $_) } [1, 2, 3], [2, 2, 3]],
+           ["second" x 200, "neighbour" x 10], "sectors are unchanged by compact");
+
+# a pack file cut off while it was being created:
+$file = sector_pack_file ($dir, [9, 0, 0]);
+{
+   open my $fh, ">", $file or die "$file: $!";
+   print $fh "VOXPAK\0\1";
+}
+ok (!sector_pack_has ($dir, [9, 0, 0]), "a short pack file stores nothing");
+is (sector_pack_put ($dir, [9, 0, 0], "fresh" x 20), 100, "and is created again by put");
+is (sector_pack_get ($dir, [9, 0, 0]), "fresh" x 20, "get from the recreated pack file");
+
+truncate $file, 16 + 2 * (20 + 8 * 8 ** 3) or die "$file: $!";
+{
+   open my $fh, "+<", $file or die "$file: $!";
+   print $fh "\0" x (16 + 2 * (20 + 8 * 8 ** 3));
+}
+ok (!sector_pack_has ($dir, [9, 0, 0]) && sector_pack_put ($dir, [9, 0, 0], "x"),
+    "a header that was never written is created again");
@@ -0,0 +1,58 @@
+#!perl
+
+use strict;
+use Test::More tests => 15;
+use File::Temp qw/tempdir/;
+
+BEGIN {
+	use_ok( 'Games::VoxEngine::Server::MutationLog' );
+}
+
+my $dir  = tempdir (CLEANUP => 1);
+my $file = "$dir/mutations.log";
+my $L    = "Games::VoxEngine::Server::MutationLog";
+
+my $log = $L->new (file => $file, sync => 'always');
+is ($log->seq, 0, "new log starts at 0");
+
+my $chunk = "c" x (12 * 12 * 12 * 4);
+is ($log->append ({ "0x0x0" => { chunks => [[1, 2, 3, $chunk]] } }), 1, "append returns the sequence number");
+$log->append ({ "0x0x0" => { ents => { "5x5x5" => { type => 35 } } },
+                "1x0x0" => { chunks => [[12, 0, 0, "d" x 10]] } });
+$log->append ({ "0x0x0" => { ents => { "5x5x5" => undef } } });
+
+is_deeply ([sort $log->sector_ids], ["0x0x0", "1x0x0"], "sectors with records");
+is_deeply ([$log->records ("0x0x0", 0)], [
+   { seq => 1, chunks => [[1, 2, 3, $chunk]], ents => {} },
+   { seq => 2, chunks => [], ents => { "5x5x5" => { type => 35 } } },
+   { seq => 3, chunks => [], ents => { "5x5x5" => undef } },
+], "records of a sector");
+is_deeply ([map { $_->{seq} } $log->records ("0x0x0", 2)], [3], "records after a sequence number");
+
+# everything is found again when the log is opened:
+undef $log;
+$log = $L->new (file => $file);
+is ($log->seq, 3, "sequence number after reopening");
+is (scalar (my @r = $log->records ("0x0x0", 0)), 3, "records after reopening");
+ok (!$log->dropped, "nothing dropped from a complete log");
+
+$log->forget ("0x0x0", 3);
+my $size = $log->size;
+my $freed = $log->compact;
+ok ($freed > 0 && $log->size == $size - $freed && -s $file == $log->size,
+    "compact drops the forgotten records");
+is_deeply ([$log->sector_ids], ["1x0x0"], "forgotten sector is gone");
+
+undef $log;
+$log = $L->new (file => $file);
+is ($log->seq, 3, "sequence number is kept by compact");
+
+# a record that was cut off while being written:
+$log->append ({ "2x0x0" => { chunks => [[24, 0, 0, $chunk]] } });
+$size = -s $file;
+truncate $file, $size - 100;
+undef $log;
+$log = $L->new (file => $file);
+ok ($log->dropped > 0 && -s $file == $log->size, "torn record is dropped on open");
+ok (!grep ({ $_ eq "2x0x0" } $log->sector_ids), "and its sector has no records");
+is ($log->append ({ "2x0x0" => { chunks => [] } }), 4, "appending works after dropping");
@@ -34,4 +34,60 @@
 #define vec3_norm(v)           vec3_s_div (v, vec3_len (v))
 #define vec3_floor(v)          v[0] = floor (v[0]); v[1] = floor (v[1]); v[2] = floor (v[2]);
 
+/* Iterates over the offsets on the surface of the cube with the
+ * (chebyshev) radius "rad", in the same order a x, y, z loop over the
+ * whole cube would visit them. If "fill" is set the inner cells of the
+ * cube are visited too. Iterating the shells of growing radius visits
+ * every cell once, in nearest first order:
+ *
+ *   vox_shell_iter it;
+ *   vox_shell_iter_init (&it, rad, 0);
+ *   while (vox_shell_iter_next (&it))
+ *     ... it.dx, it.dy, it.dz ...
+ */
+typedef struct _vox_shell_iter {
+    int rad;
+    int fill;
+    int dx, dy, dz;
+} vox_shell_iter;
+
+void vox_shell_iter_init (vox_shell_iter *it, int rad, int fill)
+{
+  it->rad  = rad;
+  it->fill = fill;
+  it->dx   = -rad;
+  it->dy   = -rad;
+  it->dz   = -rad - 1;
+}
+
+int vox_shell_iter_next (vox_shell_iter *it)
+{
+  int r = it->rad;
+
+  if (it->dz < r)
+    {
+      // rows inside the cube only touch the surface at both ends:
+      if (it->fill || it->dz < -r
+          || it->dx == -r || it->dx == r
+          || it->dy == -r || it->dy == r)
+        it->dz++;
+      else
+        it->dz = r;
+
+      return 1;
+    }
+
+  it->dy++;
+  if (it->dy > r)
+    {
+      it->dy = -r;
+      it->dx++;
+      if (it->dx > r)
+        return 0;
+    }
+  it->dz = -r;
+
+  return 1;
+}
+
 #endif
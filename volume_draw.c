@@ -24,14 +24,70 @@
  */
 
 #include <math.h>
+#include <pthread.h>
 #include "vectorlib.c"
+
+/* The buffers are doubles by default, VOL_DRAW_FLOAT=1 makes them
+ * floats, which halves the memory and bandwidth needed per sector, but
+ * rounds the drawn values, so the same seed might give slightly
+ * different sectors.
+ */
+#ifndef VOL_DRAW_FLOAT
+# define VOL_DRAW_FLOAT 0
+#endif
+
+#if VOL_DRAW_FLOAT
+typedef float  vol_draw_val_t;
+#else
+typedef double vol_draw_val_t;
+#endif
+
+/* VOL_DRAW_SIMD=1 samples the mandel box several cells at a time with
+ * SSE2, or AVX2 if the CPU has it. The lanes do the same operations in
+ * the same order as the scalar code, so the result doesn't change.
+ */
+#ifndef VOL_DRAW_SIMD
+# if defined(__GNUC__) && defined(__SSE2__)
+#  define VOL_DRAW_SIMD 1
+# else
+#  define VOL_DRAW_SIMD 0
+# endif
+#endif
+
+#if VOL_DRAW_SIMD
+# include <immintrin.h>
+#endif
+
 #include "noise_3d.c"
 
 typedef struct _vol_draw_ctx {
-  unsigned int size;
-  double      *buffers[4];
-  double      *src;  // "source" buffer for drawing operations.
-  double      *dst;  // destination buffer of drawing operations.
+  unsigned int    size;
+  vol_draw_val_t *buffers[4];
+  vol_draw_val_t *src;  // "source" buffer for drawing operations.
+  vol_draw_val_t *dst;  // destination buffer of drawing operations.
+
+  /* Memory that is kept between sectors, it only ever grows, so drawing
+   * sectors of the same size doesn't touch the allocator at all.
+   */
+  void        *buffers_mem;
+  unsigned int buffers_mem_size;
+  void        *noise_mem;
+  unsigned int noise_mem_size;
+  void        *noise_scratch;
+  unsigned int noise_scratch_size;
+
+  /* While a recursive shape is drawn: for every block of dst whether it
+   * has a cell inside dst_range, level 0 has blocks of
+   * VOL_DRAW_SKIP_BLOCK^3 cells, every further level 2^3 blocks of the
+   * level below. "skip_levels" is 0 otherwise. See vol_draw_skip_build ().
+   */
+#define VOL_DRAW_SKIP_BLOCK_SHIFT 2
+#define VOL_DRAW_SKIP_MAX_LEVELS  16
+  unsigned char *skip_mem;
+  unsigned int   skip_mem_size;
+  unsigned int   skip_levels;
+  unsigned int   skip_n[VOL_DRAW_SKIP_MAX_LEVELS];
+  unsigned char *skip[VOL_DRAW_SKIP_MAX_LEVELS];
 
   unsigned int draw_op;
 
@@ -72,6 +128,7 @@ void vol_draw_init ()
   DRAW_CTX.dst  = 0;
   DRAW_CTX.size = 0;
   DRAW_CTX.draw_op = 0;
+  DRAW_CTX.skip_levels = 0;
   DRAW_CTX.dst_range[0] = 0;
   DRAW_CTX.dst_range[1] = 1;
   DRAW_CTX.src_range[0] = 0;
@@ -79,6 +136,183 @@ void vol_draw_init ()
   DRAW_CTX.src_blend = 0;
 }
 
+// Returns "*mem" with at least "size" bytes, growing it if needed.
+static void *vol_draw_arena (void **mem, unsigned int *mem_size, unsigned int size)
+{
+  if (*mem_size < size)
+    {
+      if (*mem)
+        safefree (*mem);
+      *mem      = safemalloc (size);
+      *mem_size = size;
+    }
+
+  return *mem;
+}
+
+/* The ops that walk the whole volume can split it along z into slabs
+ * and draw them on a fixed pool of worker threads. Every cell is written
+ * by exactly one slab in the same order as before, so the result does not
+ * depend on the number of threads. The workers never call into perl.
+ */
+#define VOL_DRAW_MAX_THREADS 32
+
+// Ops on less cells than this aren't worth waking up the workers.
+#define VOL_DRAW_MIN_PARALLEL_CELLS 32768
+
+typedef void (*vol_draw_slab_cb) (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab);
+
+static struct {
+  unsigned int     threads; // workers + the calling thread
+  pthread_t        workers[VOL_DRAW_MAX_THREADS];
+  pthread_mutex_t  lock;
+  pthread_cond_t   work, done;
+  unsigned int     job;     // incremented for every new job
+  unsigned int     pending; // slabs of the current job still being drawn
+  int              quit;
+
+  vol_draw_slab_cb cb;
+  void            *arg;
+  unsigned int     z_beg, z_end;
+} VOL_DRAW_POOL = {
+  1, { }, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static void vol_draw_run_slab (unsigned int slab)
+{
+  unsigned int n   = VOL_DRAW_POOL.threads,
+               len = VOL_DRAW_POOL.z_end - VOL_DRAW_POOL.z_beg;
+
+  VOL_DRAW_POOL.cb (VOL_DRAW_POOL.arg,
+                    VOL_DRAW_POOL.z_beg + (len * slab) / n,
+                    VOL_DRAW_POOL.z_beg + (len * (slab + 1)) / n,
+                    slab);
+}
+
+static void *vol_draw_worker (void *arg)
+{
+  unsigned int slab = (uintptr_t) arg;
+  unsigned int job  = 0;
+
+  pthread_mutex_lock (&VOL_DRAW_POOL.lock);
+  while (1)
+    {
+      while (!VOL_DRAW_POOL.quit && VOL_DRAW_POOL.job == job)
+        pthread_cond_wait (&VOL_DRAW_POOL.work, &VOL_DRAW_POOL.lock);
+      if (VOL_DRAW_POOL.quit)
+        break;
+      job = VOL_DRAW_POOL.job;
+      pthread_mutex_unlock (&VOL_DRAW_POOL.lock);
+
+      vol_draw_run_slab (slab);
+
+      pthread_mutex_lock (&VOL_DRAW_POOL.lock);
+      if (--VOL_DRAW_POOL.pending == 0)
+        pthread_cond_signal (&VOL_DRAW_POOL.done);
+    }
+  pthread_mutex_unlock (&VOL_DRAW_POOL.lock);
+
+  return 0;
+}
+
+// A forked child only has the thread that called fork, so it draws
+// everything itself. The lock and conds might have been in use by the
+// workers of the parent, so they are set up again.
+static void vol_draw_atfork_child ()
+{
+  pthread_mutex_init (&VOL_DRAW_POOL.lock, 0);
+  pthread_cond_init (&VOL_DRAW_POOL.work, 0);
+  pthread_cond_init (&VOL_DRAW_POOL.done, 0);
+  VOL_DRAW_POOL.threads = 1;
+  VOL_DRAW_POOL.quit    = 0;
+  VOL_DRAW_POOL.job     = 0;
+  VOL_DRAW_POOL.pending = 0;
+}
+
+// Sets the number of threads used for drawing, 1 draws everything in
+// the calling thread. Forked processes start with 1 again.
+void vol_draw_set_threads (unsigned int n)
+{
+  static int atfork_done = 0;
+  unsigned int i;
+
+  if (n < 1)
+    n = 1;
+  if (n > VOL_DRAW_MAX_THREADS)
+    n = VOL_DRAW_MAX_THREADS;
+
+  if (!atfork_done)
+    {
+      pthread_atfork (0, 0, vol_draw_atfork_child);
+      atfork_done = 1;
+    }
+
+  if (VOL_DRAW_POOL.threads > 1)
+    {
+      pthread_mutex_lock (&VOL_DRAW_POOL.lock);
+      VOL_DRAW_POOL.quit = 1;
+      pthread_cond_broadcast (&VOL_DRAW_POOL.work);
+      pthread_mutex_unlock (&VOL_DRAW_POOL.lock);
+
+      for (i = 1; i < VOL_DRAW_POOL.threads; i++)
+        pthread_join (VOL_DRAW_POOL.workers[i], 0);
+    }
+
+  VOL_DRAW_POOL.quit    = 0;
+  VOL_DRAW_POOL.job     = 0;
+  VOL_DRAW_POOL.threads = 1;
+
+  for (i = 1; i < n; i++)
+    {
+      if (pthread_create (&VOL_DRAW_POOL.workers[i], 0,
+                          vol_draw_worker, (void *) (uintptr_t) i))
+        break;
+      VOL_DRAW_POOL.threads = i + 1;
+    }
+}
+
+unsigned int vol_draw_get_threads ()
+{
+  return VOL_DRAW_POOL.threads;
+}
+
+/* Calls "cb" for the slabs of [z_beg, z_end), one per thread. Small jobs
+ * are done by the calling thread as one slab (number 0).
+ */
+static void vol_draw_parallel (vol_draw_slab_cb cb, void *arg, unsigned int z_beg, unsigned int z_end, unsigned int cells)
+{
+  if (VOL_DRAW_POOL.threads <= 1 || cells < VOL_DRAW_MIN_PARALLEL_CELLS)
+    {
+      cb (arg, z_beg, z_end, 0);
+      return;
+    }
+
+  VOL_DRAW_POOL.cb    = cb;
+  VOL_DRAW_POOL.arg   = arg;
+  VOL_DRAW_POOL.z_beg = z_beg;
+  VOL_DRAW_POOL.z_end = z_end;
+
+  pthread_mutex_lock (&VOL_DRAW_POOL.lock);
+  VOL_DRAW_POOL.pending = VOL_DRAW_POOL.threads - 1;
+  VOL_DRAW_POOL.job++;
+  pthread_cond_broadcast (&VOL_DRAW_POOL.work);
+  pthread_mutex_unlock (&VOL_DRAW_POOL.lock);
+
+  vol_draw_run_slab (0);
+
+  pthread_mutex_lock (&VOL_DRAW_POOL.lock);
+  while (VOL_DRAW_POOL.pending > 0)
+    pthread_cond_wait (&VOL_DRAW_POOL.done, &VOL_DRAW_POOL.lock);
+  pthread_mutex_unlock (&VOL_DRAW_POOL.lock);
+}
+
+// Runs "cb" over the slabs of the whole volume.
+static void vol_draw_parallel_volume (vol_draw_slab_cb cb, void *arg)
+{
+  vol_draw_parallel (cb, arg, 0, DRAW_CTX.size,
+                     DRAW_CTX.size * DRAW_CTX.size * DRAW_CTX.size);
+}
+
 void vol_draw_set_dst_range (double a, double b)
 {
   DRAW_CTX.dst_range[0] = a;
@@ -119,18 +353,15 @@ void vol_draw_set_op (unsigned int op)
 
 void vol_draw_alloc (unsigned int size)
 {
-  int i;
-  if (DRAW_CTX.buffers[0])
-    {
-      for (i = 0; i < 4; i++)
-        safefree (DRAW_CTX.buffers[i]);
-    }
+  unsigned int cells = size * size * size;
+  vol_draw_val_t *mem =
+    vol_draw_arena (&DRAW_CTX.buffers_mem, &DRAW_CTX.buffers_mem_size,
+                    sizeof (vol_draw_val_t) * cells * 4);
+  memset (mem, 0, sizeof (vol_draw_val_t) * cells * 4);
 
+  int i;
   for (i = 0; i < 4; i++)
-    {
-      DRAW_CTX.buffers[i] = safemalloc (sizeof (double) * size * size * size);
-      memset (DRAW_CTX.buffers[i], 0, sizeof (double) * size * size * size);
-    }
+    DRAW_CTX.buffers[i] = mem + cells * i;
 
   DRAW_CTX.size = size;
 
@@ -150,69 +381,133 @@ double linerp (double a, double b, double x)
    return a * (1 - x) + b * x;
 }
 
-void vol_draw_op (unsigned int x, unsigned int y, unsigned int z, double val)
+// The drawing state an operation on a cell depends on.
+typedef struct _vol_draw_state {
+  vol_draw_val_t *dst, *src;
+  unsigned int    draw_op;
+  double          dst_range[2], src_range[2];
+  double          src_blend;
+} vol_draw_state;
+
+static void vol_draw_get_state (vol_draw_state *st)
 {
-  if (x >= DRAW_CTX.size
-      || y >= DRAW_CTX.size
-      || z >= DRAW_CTX.size)
-    return;
+  st->dst          = DRAW_CTX.dst;
+  st->src          = DRAW_CTX.src;
+  st->draw_op      = DRAW_CTX.draw_op;
+  st->dst_range[0] = DRAW_CTX.dst_range[0];
+  st->dst_range[1] = DRAW_CTX.dst_range[1];
+  st->src_range[0] = DRAW_CTX.src_range[0];
+  st->src_range[1] = DRAW_CTX.src_range[1];
+  st->src_blend    = DRAW_CTX.src_blend;
+}
 
+// Draws "val" to the cell with index "i" (which has to be valid).
+static inline void vol_draw_op_cell (vol_draw_state *st, unsigned int i, double val)
+{
+  vol_draw_val_t *dst = st->dst + i;
 
-  if (DRAW_DST(x,y,z) < DRAW_CTX.dst_range[0]
-      || DRAW_DST(x,y,z) > DRAW_CTX.dst_range[1])
+  if (*dst < st->dst_range[0]
+      || *dst > st->dst_range[1])
     return;
 
-  if (DRAW_SRC(x,y,z) < DRAW_CTX.src_range[0]
-      || DRAW_SRC(x,y,z) > DRAW_CTX.src_range[1])
+  if (st->src[i] < st->src_range[0]
+      || st->src[i] > st->src_range[1])
     return;
 
-  double src = DRAW_SRC(x, y, z);
-  if (DRAW_CTX.src_blend < 0)
+  double src = st->src[i];
+  if (st->src_blend < 0)
     {
       val = 1 - val;
-      val = linerp (val, src, -DRAW_CTX.src_blend);
+      val = linerp (val, src, -st->src_blend);
     }
   else
     {
-      val = linerp (val, src, DRAW_CTX.src_blend);
+      val = linerp (val, src, st->src_blend);
     }
 
-  switch (DRAW_CTX.draw_op)
+  switch (st->draw_op)
     {
       case VOL_DRAW_ADD:
-        DRAW_DST(x,y,z) += val;
+        *dst += val;
         break;
 
       case VOL_DRAW_SUB:
-        DRAW_DST(x,y,z) -= val;
-        if (DRAW_DST(x,y,z) < 0)
-          DRAW_DST(x,y,z) = 0;
+        *dst -= val;
+        if (*dst < 0)
+          *dst = 0;
         break;
 
-      case VOL_DRAW_MUL: DRAW_DST(x,y,z) *= val; break;
-      case VOL_DRAW_SET: DRAW_DST(x,y,z) = val; break;
+      case VOL_DRAW_MUL: *dst *= val; break;
+      case VOL_DRAW_SET: *dst = val; break;
     }
 }
 
+void vol_draw_op (unsigned int x, unsigned int y, unsigned int z, double val)
+{
+  if (x >= DRAW_CTX.size
+      || y >= DRAW_CTX.size
+      || z >= DRAW_CTX.size)
+    return;
+
+  vol_draw_state st;
+  vol_draw_get_state (&st);
+  vol_draw_op_cell (&st, x + y * DRAW_CTX.size + z * (DRAW_CTX.size * DRAW_CTX.size), val);
+}
+
+static void vol_draw_val_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  double val = *(double *) arg;
+  unsigned int plane = DRAW_CTX.size * DRAW_CTX.size, i;
+
+  vol_draw_state st;
+  vol_draw_get_state (&st);
+  for (i = z_beg * plane; i < z_end * plane; i++)
+    vol_draw_op_cell (&st, i, val);
+}
+
 void vol_draw_val (double val)
 {
-  int x, y, z;
-  for (z = 0; z < DRAW_CTX.size; z++)
-    for (y = 0; y < DRAW_CTX.size; y++)
-      for (x = 0; x < DRAW_CTX.size; x++)
-        vol_draw_op (x, y, z, val);
+  vol_draw_parallel_volume (vol_draw_val_slab, &val);
+}
+
+static void vol_draw_dst_self_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  unsigned int plane = DRAW_CTX.size * DRAW_CTX.size, i;
+
+  vol_draw_state st;
+  vol_draw_get_state (&st);
+  for (i = z_beg * plane; i < z_end * plane; i++)
+    vol_draw_op_cell (&st, i, st.dst[i]);
 }
 
 void vol_draw_dst_self ()
 {
+  vol_draw_parallel_volume (vol_draw_dst_self_slab, 0);
+}
+
+typedef struct _vol_draw_map_range_arg {
+  double a, b, range, j, k;
+} vol_draw_map_range_arg;
+
+static void vol_draw_map_range_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  vol_draw_map_range_arg *m = arg;
   int x, y, z;
-  for (z = 0; z < DRAW_CTX.size; z++)
+  for (z = z_beg; z < z_end; z++)
     for (y = 0; y < DRAW_CTX.size; y++)
       for (x = 0; x < DRAW_CTX.size; x++)
-        vol_draw_op (x, y, z, DRAW_DST (x, y, z));
+        {
+          double v = DRAW_DST(x, y, z);
+          if (v >= m->a && v <= m->b)
+            {
+              v -= m->a;
+              v /= m->range;
+              DRAW_DST(x, y, z) = linerp (m->j, m->k, v);
+            }
+        }
 }
 
-void vol_draw_map_range (float a, float b, float j, float k)
+static void vol_draw_map_range_prep (vol_draw_map_range_arg *m, float a, float b, float j, float k)
 {
   if (a > b)
     {
@@ -225,66 +520,95 @@ void vol_draw_map_range (float a, float b, float j, float k)
   if (range <= 0.00001)
     range = 1;
 
+  m->a     = a;
+  m->b     = b;
+  m->range = range;
+  m->j     = j;
+  m->k     = k;
+}
+
+void vol_draw_map_range (float a, float b, float j, float k)
+{
+  vol_draw_map_range_arg m;
+  vol_draw_map_range_prep (&m, a, b, j, k);
+  vol_draw_parallel_volume (vol_draw_map_range_slab, &m);
+}
+
+typedef struct _vol_draw_histogram_arg {
+  int     buckets;
+  double  a, b;
+  int    *eq;   // "buckets + 1" counters per slab
+  int    *lkup;
+  int     sum;
+} vol_draw_histogram_arg;
+
+static void vol_draw_histogram_count_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  vol_draw_histogram_arg *h = arg;
+  int *eq = h->eq + slab * (h->buckets + 1);
+
   int x, y, z;
-  for (z = 0; z < DRAW_CTX.size; z++)
+  for (z = z_beg; z < z_end; z++)
     for (y = 0; y < DRAW_CTX.size; y++)
       for (x = 0; x < DRAW_CTX.size; x++)
         {
-          double v = DRAW_DST(x, y, z);
-          if (v >= a && v <= b)
-            {
-              v -= a;
-              v /= range;
-              DRAW_DST(x, y, z) = linerp (j, k, v);
-            }
+          double v = DRAW_DST (x, y, z);
+
+          if (v < h->a || v > h->b)
+            continue;
+          v = linerp (0, 1, (v - h->a) / (h->b - h->a));
+
+          int bket = floor (v * (double) h->buckets);
+          eq[bket]++;
         }
 }
 
-void vol_draw_histogram_equalize (int buckets, double a, double b)
+static void vol_draw_histogram_map_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
 {
-  int eq[buckets];
-  int lkup[buckets];
-  memset (eq, 0, sizeof (int) * buckets);
-  memset (lkup, 0, sizeof (int) * buckets);
+  vol_draw_histogram_arg *h = arg;
 
   int x, y, z;
-  for (x = 0; x < DRAW_CTX.size; x++)
+  for (z = z_beg; z < z_end; z++)
     for (y = 0; y < DRAW_CTX.size; y++)
-      for (z = 0; z < DRAW_CTX.size; z++)
+      for (x = 0; x < DRAW_CTX.size; x++)
         {
           double v = DRAW_DST (x, y, z);
 
-          if (v < a || v > b)
+          if (v < h->a || v > h->b)
             continue;
-          v = linerp (0, 1, (v - a) / (b - a));
+          v = linerp (0, 1, (v - h->a) / (h->b - h->a));
 
-          int bket = floor (v * (double) buckets);
-          eq[bket]++;
+          int bket = floor (v * (double) h->buckets);
+          int lk = h->lkup[bket];
+          DRAW_DST (x, y, z) = (double) lk / (double) h->sum;
         }
+}
 
-  int i;
+void vol_draw_histogram_equalize (int buckets, double a, double b)
+{
+  // a value of exactly "b" lands in the extra bucket "buckets", it isn't
+  // counted, but maps to the full sum.
+  int eq[VOL_DRAW_POOL.threads * (buckets + 1)];
+  int lkup[buckets + 1];
+  memset (eq, 0, sizeof (int) * VOL_DRAW_POOL.threads * (buckets + 1));
+  memset (lkup, 0, sizeof (int) * (buckets + 1));
+
+  vol_draw_histogram_arg h = { buckets, a, b, eq, lkup, 0 };
+  vol_draw_parallel_volume (vol_draw_histogram_count_slab, &h);
+
+  int i, j;
   int sum = 0;
   for (i = 0; i < buckets; i++)
     {
-      sum += eq[i];
+      for (j = 0; j < VOL_DRAW_POOL.threads; j++)
+        sum += eq[j * (buckets + 1) + i];
       lkup[i] = sum;
       //d// printf ("XX %d, %d => %d [%d]\n", i, eq[i], lkup[i], sum);
     }
+  lkup[buckets] = sum;
+  h.sum = sum;
 
-  for (x = 0; x < DRAW_CTX.size; x++)
-    for (y = 0; y < DRAW_CTX.size; y++)
-      for (z = 0; z < DRAW_CTX.size; z++)
-        {
-          double v = DRAW_DST (x, y, z);
-
-          if (v < a || v > b)
-            continue;
-          v = linerp (0, 1, (v - a) / (b - a));
-
-          int bket = floor (v * (double) buckets);
-          int lk = lkup[bket];
-          DRAW_DST (x, y, z) = (double) lk / (double) sum;
-        }
+  vol_draw_parallel_volume (vol_draw_histogram_map_slab, &h);
 }
 
 static void draw_3d_line_bresenham (int x0, int y0, int z0, int x1, int y1, int z1)
@@ -343,17 +667,26 @@ static void draw_3d_line (int x0, int y0, int z0, int x1, int y1, int z1)
     draw_3d_line_bresenham (z0, x0, y0, z1, x1, y1);
 }
 
+// The value of a cube cell with the distance "m" from the center.
+static inline float vol_draw_cube_fill_value_m (float m, int center)
+{
+  return linerp (0.1, 0.9,
+                 center <= 0 ? 0 : (m / (float) center));
+}
+
+static inline int vol_draw_cube_dist (int x, int size, int center)
+{
+  if (x < center) return center - x;
+  else            return x - (center - (size % 2 == 0 ? 1 : 2));
+}
+
 float vol_draw_cube_fill_value (int x, int y, int z, int size)
 {
   int center = ceil ((float) size / 2.f);
 
-  int xm, ym, zm;
-  if (x < center) xm = center - x;
-  else            xm = x - (center - (size % 2 == 0 ? 1 : 2));
-  if (y < center) ym = center - y;
-  else            ym = y - (center - (size % 2 == 0 ? 1 : 2));
-  if (z < center) zm = center - z;
-  else            zm = z - (center - (size % 2 == 0 ? 1 : 2));
+  int xm = vol_draw_cube_dist (x, size, center),
+      ym = vol_draw_cube_dist (y, size, center),
+      zm = vol_draw_cube_dist (z, size, center);
 
   float m = 0;
   if (m < xm)           m = xm;
@@ -361,11 +694,210 @@ float vol_draw_cube_fill_value (int x, int y, int z, int size)
   if (z >= 0 && m < zm) m = zm;
   //d// printf ("X %d,%d,%d, %f, %d %d\n", x,y,z,m, center, size);
 
-  return linerp (0.1, 0.9,
-                 center <= 0 ? 0 : (m / (float) center));
+  return vol_draw_cube_fill_value_m (m, center);
+}
+
+/* Builds the block pyramid of DRAW_CTX.skip for the current dst and
+ * dst_range. Cells outside dst_range are never written by
+ * vol_draw_op_cell (), so they stay outside while the shape is drawn and
+ * a block that has none inside can be skipped until vol_draw_skip_drop ().
+ */
+static void vol_draw_skip_build ()
+{
+  if (!DRAW_CTX.dst || !DRAW_CTX.size)
+    return;
+
+  unsigned int n = ((DRAW_CTX.size - 1) >> VOL_DRAW_SKIP_BLOCK_SHIFT) + 1,
+               len = 0, l;
+  for (l = 0; l < VOL_DRAW_SKIP_MAX_LEVELS; l++)
+    {
+      DRAW_CTX.skip_n[l] = n;
+      len += n * n * n;
+      if (n == 1)
+        break;
+      n = (n + 1) / 2;
+    }
+  unsigned int levels = l + 1;
+
+  unsigned char *mem =
+    vol_draw_arena ((void **) &DRAW_CTX.skip_mem, &DRAW_CTX.skip_mem_size, len);
+  memset (mem, 0, len);
+  for (l = 0; l < levels; l++)
+    {
+      DRAW_CTX.skip[l] = mem;
+      mem += DRAW_CTX.skip_n[l] * DRAW_CTX.skip_n[l] * DRAW_CTX.skip_n[l];
+    }
+
+  double lo = DRAW_CTX.dst_range[0], hi = DRAW_CTX.dst_range[1];
+#if VOL_DRAW_SIMD && !VOL_DRAW_FLOAT
+  __m128d lov = _mm_set1_pd (lo), hiv = _mm_set1_pd (hi);
+#endif
+  vol_draw_val_t *dst = DRAW_CTX.dst;
+  unsigned char *blk = DRAW_CTX.skip[0];
+  n = DRAW_CTX.skip_n[0];
+
+  unsigned int x, y, z, b;
+  for (z = 0; z < DRAW_CTX.size; z++)
+    for (y = 0; y < DRAW_CTX.size; y++)
+      {
+        unsigned char *row =
+          blk + ((y >> VOL_DRAW_SKIP_BLOCK_SHIFT) + (z >> VOL_DRAW_SKIP_BLOCK_SHIFT) * n) * n;
+        for (x = 0, b = 0; b < n; b++)
+          {
+            unsigned int end = (b + 1) << VOL_DRAW_SKIP_BLOCK_SHIFT;
+            if (end > DRAW_CTX.size)
+              end = DRAW_CTX.size;
+
+            // a block is mostly found on its first row already:
+            if (row[b])
+              {
+                dst += end - x;
+                x    = end;
+                continue;
+              }
+
+            int in = 0;
+#if VOL_DRAW_SIMD && !VOL_DRAW_FLOAT
+            // not below and not above, like vol_draw_op_cell (), for NaN too:
+            for (; x + 2 <= end; x += 2, dst += 2)
+              {
+                __m128d v = _mm_loadu_pd (dst);
+                in |= _mm_movemask_pd (_mm_and_pd (_mm_cmpnlt_pd (v, lov), _mm_cmpngt_pd (v, hiv)));
+              }
+#endif
+            for (; x < end; x++, dst++)
+              in |= !(*dst < lo) & !(*dst > hi); // like vol_draw_op_cell ()
+            row[b] |= in != 0;
+          }
+      }
 
+  for (l = 1; l < levels; l++)
+    {
+      unsigned int cn = DRAW_CTX.skip_n[l - 1], pn = DRAW_CTX.skip_n[l];
+      unsigned char *c = DRAW_CTX.skip[l - 1], *p = DRAW_CTX.skip[l];
+      for (z = 0; z < cn; z++)
+        for (y = 0; y < cn; y++)
+          for (x = 0; x < cn; x++)
+            p[(x / 2) + ((y / 2) + (z / 2) * pn) * pn] |= c[x + (y + z * cn) * cn];
+    }
+
+  DRAW_CTX.skip_levels = levels;
+}
+
+static void vol_draw_skip_drop ()
+{
+  DRAW_CTX.skip_levels = 0;
 }
 
+/* Whether drawing anything inside the box at x, y, z with the edge length
+ * "size" (grown by "margin" on every side) can't change the volume: it's
+ * outside of it, the dst or src range is empty or, while a recursive
+ * shape is drawn, it has no cell inside dst_range. Used to skip whole
+ * subtrees of the recursive shapes.
+ */
+static int vol_draw_box_skip (float x, float y, float z, float size, float margin)
+{
+  if (DRAW_CTX.dst_range[0] > DRAW_CTX.dst_range[1]
+      || DRAW_CTX.src_range[0] > DRAW_CTX.src_range[1])
+    return 1;
+
+  float o[3] = { x, y, z };
+  unsigned int c0[3], c1[3];
+  int i;
+  for (i = 0; i < 3; i++)
+    {
+      float lo = size < 0 ? o[i] + size : o[i],
+            hi = size < 0 ? o[i] : o[i] + size;
+      if (hi + margin < -1 || lo - margin >= (float) DRAW_CTX.size)
+        return 1;
+
+      // the cells the box can touch:
+      double clo = floor ((double) lo - margin),
+             chi = ceil ((double) hi + margin);
+      c0[i] = clo < 0 ? 0 : clo;
+      c1[i] = chi < 0 ? 0 : chi > DRAW_CTX.size - 1 ? DRAW_CTX.size - 1 : chi;
+    }
+
+  // small boxes draw fewer cells than looking them up costs:
+  if (!DRAW_CTX.skip_levels || fabs (size) < (1 << VOL_DRAW_SKIP_BLOCK_SHIFT))
+    return 0;
+
+  // the lowest level on which the box spans at most 2 blocks per axis:
+  unsigned int l, shift = VOL_DRAW_SKIP_BLOCK_SHIFT;
+  for (l = 0; l < DRAW_CTX.skip_levels - 1; l++, shift++)
+    if ((c1[0] >> shift) - (c0[0] >> shift) <= 1
+        && (c1[1] >> shift) - (c0[1] >> shift) <= 1
+        && (c1[2] >> shift) - (c0[2] >> shift) <= 1)
+      break;
+
+  unsigned int n = DRAW_CTX.skip_n[l], bx, by, bz;
+  unsigned char *blk = DRAW_CTX.skip[l];
+  for (bz = c0[2] >> shift; bz <= c1[2] >> shift; bz++)
+    for (by = c0[1] >> shift; by <= c1[1] >> shift; by++)
+      for (bx = c0[0] >> shift; bx <= c1[0] >> shift; bx++)
+        if (blk[bx + (by + bz * n) * n])
+          return 0;
+
+  return 1;
+}
+
+/* The cells of a shape along one axis that are inside the volume: the
+ * index "idx" inside the shape and the cell coordinate "pos". At most the
+ * cell 0 is hit twice (by rounding from both sides of 0), "dup" tells.
+ */
+typedef struct _vol_draw_axis {
+  unsigned int  len, dup;
+  int          *idx;
+  unsigned int *pos;
+} vol_draw_axis;
+
+// Room for the cells of one axis of a vol_draw_axis.
+#define VOL_DRAW_AXIS_LEN (DRAW_CTX.size + 2)
+
+/* Clips the indices 0 <= j < n at the origin "o" to the volume. The cell
+ * coordinates are computed like the shapes did per cell: "int_pos"
+ * truncates to int first, otherwise the float is converted directly.
+ */
+static void vol_draw_clip_axis (vol_draw_axis *a, float o, float n, int int_pos)
+{
+  a->len = a->dup = 0;
+
+  // only indices near the volume can hit it:
+  double lo = floor (-(double) o) - 2,
+         hi = ceil ((double) DRAW_CTX.size - (double) o) + 2;
+  if (lo < 0) lo = 0;
+  if (hi > n) hi = ceil (n);
+  if (lo >= hi)
+    return;
+
+  int j;
+  for (j = lo; j < n && j < hi; j++)
+    {
+      unsigned int p;
+      if (int_pos)
+        {
+          int d = o + j;
+          p = d;
+        }
+      else
+        p = o + (float) j;
+
+      if (p >= DRAW_CTX.size)
+        continue;
+
+      if (a->len && a->pos[a->len - 1] == p)
+        a->dup = 1;
+      assert (a->len < VOL_DRAW_AXIS_LEN);
+      a->idx[a->len] = j;
+      a->pos[a->len] = p;
+      a->len++;
+    }
+}
+
+#define VOL_DRAW_AXIS_INIT(a) \
+  int a##_idx[VOL_DRAW_AXIS_LEN]; unsigned int a##_pos[VOL_DRAW_AXIS_LEN]; \
+  vol_draw_axis a = { 0, 0, a##_idx, a##_pos };
+
 void vol_draw_fill_pyramid (float x, float y, float z, float size)
 {
   x    = ceil (x);
@@ -373,16 +905,57 @@ void vol_draw_fill_pyramid (float x, float y, float z, float size)
   z    = ceil (z);
   size = ceil (size);
 
+  if (size <= 0 || vol_draw_box_skip (x, y, z, size, 2))
+    return;
+
+  vol_draw_state st;
+  vol_draw_get_state (&st);
+  VOL_DRAW_AXIS_INIT(ax);
+  VOL_DRAW_AXIS_INIT(az);
+
   int j, k, l;
   float pyr_size = size;
   for (k = 0; k < size; k++) // layer
     {
-      for (j = 0; j < ceil (pyr_size); j++)
-        for (l = 0; l < ceil (pyr_size); l++)
-          {
-            double val = vol_draw_cube_fill_value (j, l, -1, ceil (pyr_size));
-            vol_draw_op ((float) j + x, (float) k + y, (float) l + z, val);
-          }
+      unsigned int py = (float) k + y;
+      int n = ceil (pyr_size);
+      if (py < DRAW_CTX.size && n > 0)
+        {
+          vol_draw_clip_axis (&ax, x, n, 0);
+          vol_draw_clip_axis (&az, z, n, 0);
+
+          int center = ceil ((float) n / 2.f);
+          unsigned int layer = py * DRAW_CTX.size;
+
+          /* In x-spans, unless cells are hit twice along both axes, then
+           * the order of the old per cell loop (j outer) is kept.
+           */
+          if (ax.dup && az.dup)
+            for (j = 0; j < ax.len; j++)
+              for (l = 0; l < az.len; l++)
+                vol_draw_op_cell (&st, ax.pos[j] + layer + az.pos[l] * DRAW_CTX.size * DRAW_CTX.size,
+                                  vol_draw_cube_fill_value (ax.idx[j], az.idx[l], -1, n));
+          else
+            for (l = 0; l < az.len; l++)
+              {
+                unsigned int row = layer + az.pos[l] * DRAW_CTX.size * DRAW_CTX.size;
+                int zm = vol_draw_cube_dist (az.idx[l], n, center);
+                int last_m = -1;
+                double val = 0;
+                for (j = 0; j < ax.len; j++)
+                  {
+                    int m = vol_draw_cube_dist (ax.idx[j], n, center);
+                    if (m < zm) m = zm;
+                    if (m < 0)  m = 0;
+                    if (m != last_m)
+                      {
+                        val    = vol_draw_cube_fill_value_m (m, center);
+                        last_m = m;
+                      }
+                    vol_draw_op_cell (&st, row + ax.pos[j], val);
+                  }
+              }
+        }
 
       if (k % 2 == 1)
         pyr_size -= 2;
@@ -391,50 +964,174 @@ void vol_draw_fill_pyramid (float x, float y, float z, float size)
     }
 }
 
-void vol_draw_fill_box (float x, float y, float z, float size)
+typedef struct _vol_draw_fill_arg {
+  float x, y, z, size;
+  vol_draw_axis ax[3];
+} vol_draw_fill_arg;
+
+/* The box and sphere slabs are slabs of the volume, not of the shape:
+ * every slab draws the cells of the shape that fall into it. The shape is
+ * clipped to the volume once and drawn in x-spans. Cells hit twice by
+ * rounding are still drawn in the old order (x outer, then y and z),
+ * which the spans only differ from if that happens along two axes.
+ */
+static void vol_draw_fill_box_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
 {
+  vol_draw_fill_arg *f = arg;
+  vol_draw_axis *ax = &f->ax[0], *ay = &f->ax[1], *az = &f->ax[2];
+  unsigned int plane = DRAW_CTX.size * DRAW_CTX.size;
+
+  vol_draw_state st;
+  vol_draw_get_state (&st);
+
   int j, k, l;
-  size = ceil (size);
-  for (j = 0; j < size; j++)
-    for (k = 0; k < size; k++)
-      for (l = 0; l < size; l++)
+  if (ax->dup + ay->dup + az->dup > 1)
+    {
+      for (j = 0; j < ax->len; j++)
+        for (k = 0; k < ay->len; k++)
+          for (l = 0; l < az->len; l++)
+            if (az->pos[l] >= z_beg && az->pos[l] < z_end)
+              vol_draw_op_cell (&st, ax->pos[j] + ay->pos[k] * DRAW_CTX.size + az->pos[l] * plane,
+                                vol_draw_cube_fill_value (ax->idx[j], ay->idx[k], az->idx[l], f->size));
+      return;
+    }
+
+  int size = f->size;
+  int center = ceil ((float) size / 2.f);
+  for (l = 0; l < az->len; l++)
+    {
+      if (az->pos[l] < z_beg || az->pos[l] >= z_end)
+        continue;
+
+      int zm = vol_draw_cube_dist (az->idx[l], size, center);
+      for (k = 0; k < ay->len; k++)
         {
-          int dx = x + j,
-              dy = y + k,
-              dz = z + l;
-          double val = vol_draw_cube_fill_value (j, k, l, size);
+          unsigned int row = ay->pos[k] * DRAW_CTX.size + az->pos[l] * plane;
+          int yzm = vol_draw_cube_dist (ay->idx[k], size, center);
+          if (yzm < zm) yzm = zm;
 
-          vol_draw_op (dx, dy, dz, val);
+          int last_m = -1;
+          double val = 0;
+          for (j = 0; j < ax->len; j++)
+            {
+              int m = vol_draw_cube_dist (ax->idx[j], size, center);
+              if (m < yzm) m = yzm;
+              if (m < 0)   m = 0;
+              if (m != last_m)
+                {
+                  val    = vol_draw_cube_fill_value_m (m, center);
+                  last_m = m;
+                }
+              vol_draw_op_cell (&st, row + ax->pos[j], val);
+            }
         }
+    }
 }
 
-void vol_draw_fill_sphere (float x, float y, float z, float size)
+void vol_draw_fill_box (float x, float y, float z, float size)
 {
+  vol_draw_fill_arg f = { x, y, z, ceil (size) };
+  if (f.size <= 0 || vol_draw_box_skip (x, y, z, f.size, 2))
+    return;
+
+  VOL_DRAW_AXIS_INIT(ax);
+  VOL_DRAW_AXIS_INIT(ay);
+  VOL_DRAW_AXIS_INIT(az);
+  vol_draw_clip_axis (&ax, x, f.size, 1);
+  vol_draw_clip_axis (&ay, y, f.size, 1);
+  vol_draw_clip_axis (&az, z, f.size, 1);
+  f.ax[0] = ax;
+  f.ax[1] = ay;
+  f.ax[2] = az;
+
+  vol_draw_parallel (vol_draw_fill_box_slab, &f, 0, DRAW_CTX.size,
+                     ax.len * ay.len * az.len);
+}
+
+static void vol_draw_fill_sphere_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  vol_draw_fill_arg *f = arg;
+  vol_draw_axis *ax = &f->ax[0], *ay = &f->ax[1], *az = &f->ax[2];
+  float x = f->x, y = f->y, z = f->z, size = f->size;
   float cntr = size / 2;
+  float rad = cntr - (size / 10);
   vec3_init (center, x + cntr, y + cntr, z + cntr);
+  unsigned int plane = DRAW_CTX.size * DRAW_CTX.size;
 
-  float j, k, l;
-  for (j = 0; j < size; j++)
-    for (k = 0; k < size; k++)
-      for (l = 0; l < size; l++)
-        {
-          vec3_init (cur, x + j, y + k, z + l);
-          vec3_sub (cur, center);
-          float vlen = vec3_len (cur);
-          float diff = vlen - (cntr - (size / 10));
+  vol_draw_state st;
+  vol_draw_get_state (&st);
 
-          if (diff < 0)
-            {
-              double sphere_val = (-diff / cntr);
-              vol_draw_op (x + j, y + k, z + l, sphere_val);
-            }
-        }
+  // squared distances to the center along each axis:
+  double d2[3][VOL_DRAW_AXIS_LEN];
+  float o[3] = { x, y, z };
+  int i, j, k, l;
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < f->ax[i].len; j++)
+      {
+        double d = (double) (o[i] + (float) f->ax[i].idx[j]) - center[i];
+        d2[i][j] = d * d;
+      }
+
+#define VOL_DRAW_SPHERE_CELL(j,k,l) \
+  { \
+    float vlen = sqrt (d2[0][j] + d2[1][k] + d2[2][l]); \
+    float diff = vlen - rad; \
+    if (diff < 0) \
+      vol_draw_op_cell (&st, ax->pos[j] + ay->pos[k] * DRAW_CTX.size + az->pos[l] * plane, \
+                        (-diff / cntr)); \
+  }
+
+  if (ax->dup + ay->dup + az->dup > 1)
+    {
+      // the old order, see vol_draw_fill_box_slab:
+      for (j = 0; j < ax->len; j++)
+        for (k = 0; k < ay->len; k++)
+          for (l = 0; l < az->len; l++)
+            if (az->pos[l] >= z_beg && az->pos[l] < z_end)
+              VOL_DRAW_SPHERE_CELL(j, k, l)
+      return;
+    }
+
+  for (l = 0; l < az->len; l++)
+    {
+      if (az->pos[l] < z_beg || az->pos[l] >= z_end)
+        continue;
+
+      for (k = 0; k < ay->len; k++)
+        for (j = 0; j < ax->len; j++)
+          VOL_DRAW_SPHERE_CELL(j, k, l)
+    }
+#undef VOL_DRAW_SPHERE_CELL
 }
 
-void vol_draw_subdiv (int type, float x, float y, float z, float size, float shrink_fact, unsigned short lvl)
+void vol_draw_fill_sphere (float x, float y, float z, float size)
+{
+  vol_draw_fill_arg f = { x, y, z, size };
+  if (size <= 0 || vol_draw_box_skip (x, y, z, size, 2))
+    return;
+
+  VOL_DRAW_AXIS_INIT(ax);
+  VOL_DRAW_AXIS_INIT(ay);
+  VOL_DRAW_AXIS_INIT(az);
+  vol_draw_clip_axis (&ax, x, size, 0);
+  vol_draw_clip_axis (&ay, y, size, 0);
+  vol_draw_clip_axis (&az, z, size, 0);
+  f.ax[0] = ax;
+  f.ax[1] = ay;
+  f.ax[2] = az;
+
+  vol_draw_parallel (vol_draw_fill_sphere_slab, &f, 0, DRAW_CTX.size,
+                     ax.len * ay.len * az.len);
+}
+
+static void _vol_draw_subdiv (int type, float x, float y, float z, float size, float shrink_fact, unsigned short lvl)
 {
   float offs = size * 0.5f * shrink_fact;
 
+  // a negative shrink factor grows the shapes, all levels by less than 2 * offs:
+  if (vol_draw_box_skip (x, y, z, size, 2 + 2 * fabs (offs)))
+    return;
+
   if (type == 1)
     vol_draw_fill_sphere (x + offs, y + offs, z + offs, size - 2 * offs);
   else if (type == 2)
@@ -446,20 +1143,31 @@ void vol_draw_subdiv (int type, float x, float y, float z, float size, float shr
     {
       float cntr = size / 2;
 
-      vol_draw_subdiv (type, x,        y, z,               cntr, shrink_fact, lvl - 1);
-      vol_draw_subdiv (type, x,        y, z + cntr,        cntr, shrink_fact, lvl - 1);
-      vol_draw_subdiv (type, x + cntr, y, z,               cntr, shrink_fact, lvl - 1);
-      vol_draw_subdiv (type, x + cntr, y, z + cntr,        cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x,        y, z,               cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x,        y, z + cntr,        cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x + cntr, y, z,               cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x + cntr, y, z + cntr,        cntr, shrink_fact, lvl - 1);
 
-      vol_draw_subdiv (type, x,        y + cntr, z,        cntr, shrink_fact, lvl - 1);
-      vol_draw_subdiv (type, x,        y + cntr, z + cntr, cntr, shrink_fact, lvl - 1);
-      vol_draw_subdiv (type, x + cntr, y + cntr, z,        cntr, shrink_fact, lvl - 1);
-      vol_draw_subdiv (type, x + cntr, y + cntr, z + cntr, cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x,        y + cntr, z,        cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x,        y + cntr, z + cntr, cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x + cntr, y + cntr, z,        cntr, shrink_fact, lvl - 1);
+      _vol_draw_subdiv (type, x + cntr, y + cntr, z + cntr, cntr, shrink_fact, lvl - 1);
     }
 }
 
-void vol_draw_self_sim_cubes (float x, float y, float z, float size, unsigned int corners, unsigned int seed, unsigned short lvl)
+void vol_draw_subdiv (int type, float x, float y, float z, float size, float shrink_fact, unsigned short lvl)
+{
+  vol_draw_skip_build ();
+  _vol_draw_subdiv (type, x, y, z, size, shrink_fact, lvl);
+  vol_draw_skip_drop ();
+}
+
+static void _vol_draw_self_sim_cubes (float x, float y, float z, float size, unsigned int corners, unsigned int seed, unsigned short lvl)
 {
+  // the seeds of the siblings are computed by the caller, so this is fine:
+  if (vol_draw_box_skip (x, y, z, size, 2))
+    return;
+
   if (lvl >= 1)
     {
       if (corners > 7)
@@ -482,41 +1190,51 @@ void vol_draw_self_sim_cubes (float x, float y, float z, float size, unsigned in
       float cntr = size / 2;
 
       if (!(corner_mask & (1 << 0)))
-         vol_draw_self_sim_cubes (x, y, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+         _vol_draw_self_sim_cubes (x, y, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 1)))
-        vol_draw_self_sim_cubes (x, y, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x, y, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 2)))
-        vol_draw_self_sim_cubes (x + cntr, y, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x + cntr, y, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 3)))
-        vol_draw_self_sim_cubes (x + cntr, y, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x + cntr, y, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 4)))
-        vol_draw_self_sim_cubes (x, y + cntr, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x, y + cntr, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 5)))
-        vol_draw_self_sim_cubes (x, y + cntr, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x, y + cntr, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 6)))
-        vol_draw_self_sim_cubes (x + cntr, y + cntr, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x + cntr, y + cntr, z, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
 
       if (!(corner_mask & (1 << 7)))
-        vol_draw_self_sim_cubes (x + cntr, y + cntr, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
+        _vol_draw_self_sim_cubes (x + cntr, y + cntr, z + cntr, cntr, corners, rnd = rnd_xor (rnd), lvl - 1);
     }
   else
     vol_draw_fill_box (x, y, z, size);
 }
 
+void vol_draw_self_sim_cubes (float x, float y, float z, float size, unsigned int corners, unsigned int seed, unsigned short lvl)
+{
+  vol_draw_skip_build ();
+  _vol_draw_self_sim_cubes (x, y, z, size, corners, seed, lvl);
+  vol_draw_skip_drop ();
+}
+
 void vol_draw_self_sim_cubes_hash_seed (float x, float y, float z, float size, unsigned int corners, unsigned int seed, unsigned short lvl)
 {
   seed = hash32int (seed); // make it a bit more random :)
   vol_draw_self_sim_cubes (x, y, z, size, corners, seed, lvl);
 }
 
-void vol_draw_sierpinski_pyramid (float x, float y, float z, float size, unsigned short lvl)
+static void _vol_draw_sierpinski_pyramid (float x, float y, float z, float size, unsigned short lvl)
 {
+  if (vol_draw_box_skip (x, y, z, size, 2))
+    return;
+
   if (lvl == 0)
     {
       vol_draw_fill_pyramid (x, y, z, size);
@@ -524,49 +1242,74 @@ void vol_draw_sierpinski_pyramid (float x, float y, float z, float size, unsigne
     }
 
   float half = size / 2;
-  vol_draw_sierpinski_pyramid (x,        y, z,        half, lvl - 1);
-  vol_draw_sierpinski_pyramid (x + half, y, z,        half, lvl - 1);
-  vol_draw_sierpinski_pyramid (x,        y, z + half, half, lvl - 1);
-  vol_draw_sierpinski_pyramid (x + half, y, z + half, half, lvl - 1);
-  vol_draw_sierpinski_pyramid (x + (half / 2), y + half, z + (half / 2), half, lvl - 1);
+  _vol_draw_sierpinski_pyramid (x,        y, z,        half, lvl - 1);
+  _vol_draw_sierpinski_pyramid (x + half, y, z,        half, lvl - 1);
+  _vol_draw_sierpinski_pyramid (x,        y, z + half, half, lvl - 1);
+  _vol_draw_sierpinski_pyramid (x + half, y, z + half, half, lvl - 1);
+  _vol_draw_sierpinski_pyramid (x + (half / 2), y + half, z + (half / 2), half, lvl - 1);
 }
 
-void vol_draw_fill_simple_noise_octaves (unsigned int seed, unsigned int octaves, double factor, double persistence)
+void vol_draw_sierpinski_pyramid (float x, float y, float z, float size, unsigned short lvl)
 {
-  double amp_correction = 0;
+  vol_draw_skip_build ();
+  _vol_draw_sierpinski_pyramid (x, y, z, size, lvl);
+  vol_draw_skip_drop ();
+}
 
-  void *noise = mk_3d_noise (DRAW_CTX.size, seed);
+typedef struct _vol_draw_noise_arg {
+  void         *noise;
+  char         *scratch; // NOISE_OCTAVE_SCRATCH(size) per slab
+  unsigned int  octaves;
+  unsigned int *scales;
+  double       *amps;
+  double        amp_correction;
+} vol_draw_noise_arg;
+
+static void vol_draw_noise_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  vol_draw_noise_arg *n = arg;
+  void *scratch = n->scratch + slab * NOISE_OCTAVE_SCRATCH(DRAW_CTX.size);
 
   int x, y, z;
-  for (z = 0; z < DRAW_CTX.size; z++)
+  for (z = z_beg; z < z_end; z++)
     for (y = 0; y < DRAW_CTX.size; y++)
       for (x = 0; x < DRAW_CTX.size; x++)
         DRAW_DST(x,y,z) = 0;
 
+  int i;
+  for (i = 0; i <= n->octaves; i++)
+    add_3d_noise_octave (n->noise, DRAW_CTX.dst, DRAW_CTX.size, z_beg, z_end,
+                         n->scales[i], n->amps[i], scratch);
+
+  for (z = z_beg; z < z_end; z++)
+    for (y = 0; y < DRAW_CTX.size; y++)
+      for (x = 0; x < DRAW_CTX.size; x++)
+        DRAW_DST(x,y,z) /= n->amp_correction;
+}
+
+void vol_draw_fill_simple_noise_octaves (unsigned int seed, unsigned int octaves, double factor, double persistence)
+{
+  unsigned int scales[octaves + 1];
+  double       amps[octaves + 1];
+  vol_draw_noise_arg n = { 0, 0, octaves, scales, amps, 0 };
+
+  n.noise =
+    vol_draw_arena (&DRAW_CTX.noise_mem, &DRAW_CTX.noise_mem_size,
+                    sizeof (unsigned int) * NOISE_ARR_LEN(DRAW_CTX.size));
+  fill_3d_noise (n.noise, DRAW_CTX.size, seed);
+  n.scratch =
+    vol_draw_arena (&DRAW_CTX.noise_scratch, &DRAW_CTX.noise_scratch_size,
+                    NOISE_OCTAVE_SCRATCH(DRAW_CTX.size) * VOL_DRAW_POOL.threads);
 
   int i;
   for (i = 0; i <= octaves; i++)
     {
-      double scale = pow (factor, octaves - i);
-      double amp   = pow (persistence , i);
-      amp_correction += amp;
-
-      for (z = 0; z < DRAW_CTX.size; z++)
-        for (y = 0; y < DRAW_CTX.size; y++)
-          for (x = 0; x < DRAW_CTX.size; x++)
-            {
-              unsigned int s = sample_3d_noise_at (noise, x, y, z, scale);
-              double val = (double) s / (double) 0xFFFFFFFF;
-              DRAW_DST(x,y,z) += val * amp;
-            }
+      scales[i] = pow (factor, octaves - i);
+      amps[i]   = pow (persistence , i);
+      n.amp_correction += amps[i];
     }
 
-  free_3d_noise (noise);
-
-  for (z = 0; z < DRAW_CTX.size; z++)
-    for (y = 0; y < DRAW_CTX.size; y++)
-      for (x = 0; x < DRAW_CTX.size; x++)
-        DRAW_DST(x,y,z) /= amp_correction;
+  vol_draw_parallel_volume (vol_draw_noise_slab, &n);
 }
 
 // Utility function for vol_draw_mandel_box ().
@@ -595,50 +1338,187 @@ double _vol_draw_mandel_box_equation (double *v, double s, double r, double f, d
 /* This function implements the mandel box fractal.
  * It's quite expensive and not used anywhere yet.
  */
-void vol_draw_mandel_box (double xc, double yc, double zc, double xsc, double ysc, double zsc, double s, double r, double f, int it, double cfact)
+typedef struct _vol_draw_mandel_box_arg {
+  double xc, yc, zc, xsc, ysc, zsc, s, r, f;
+  int    it;
+  double cfact;
+  int    avx2;
+} vol_draw_mandel_box_arg;
+
+#if VOL_DRAW_SIMD
+/* Samples "n" cells of a row, starting at x, 2 (SSE2) or 4 (AVX2) at a
+ * time. Each lane stops when it escapes, the whole vector once all of
+ * them did. Sets esc[i] for the escaped cells.
+ */
+# define VOL_DRAW_MANDEL_BOX_ROW(name, attr, lanes, vd, set1, setx, add, sub, mul, div, sqrt, gt, lt, and, andnot, or, mask, all) \
+  attr static void name (vol_draw_mandel_box_arg *m, double cy, double cz, int x, int n, unsigned char *esc) \
+  { \
+    double size = (double) DRAW_CTX.size; \
+    vd one = set1 (1), mone = set1 (-1), two = set1 (2), mtwo = set1 (-2), \
+       four = set1 (4), bail = set1 (1024), \
+       s = set1 (m->s), r = set1 (m->r), f = set1 (m->f), \
+       cyv = set1 (cy), czv = set1 (cz); \
+    int j; \
+    for (; n > 0; x += lanes, n -= lanes, esc += lanes) \
+      { \
+        vd cx = setx (x); \
+        cx = div (cx, set1 (size)); \
+        cx = add (cx, set1 (m->xsc)); \
+        cx = mul (cx, set1 (m->cfact)); \
+        cx = add (cx, set1 (-m->xsc * m->cfact)); \
+        cx = add (cx, set1 (m->xc)); \
+        \
+        vd vx = set1 (0), vy = set1 (0), vz = set1 (0), escaped = set1 (0); \
+        int i; \
+        for (i = 0; i < m->it; i++) \
+          { \
+            vd fx = VOL_DRAW_MANDEL_FOLD (vx, or, and, andnot, gt, lt, sub), \
+               fy = VOL_DRAW_MANDEL_FOLD (vy, or, and, andnot, gt, lt, sub), \
+               fz = VOL_DRAW_MANDEL_FOLD (vz, or, and, andnot, gt, lt, sub); \
+            fx = mul (fx, f); fy = mul (fy, f); fz = mul (fz, f); \
+            vd ml = sqrt (add (add (mul (fx, fx), mul (fy, fy)), mul (fz, fz))); \
+            vd in_r = lt (ml, r), in_1 = andnot (in_r, lt (ml, one)); \
+            vd mm = mul (ml, ml); \
+            fx = or (or (and (in_r, mul (fx, four)), and (in_1, div (fx, mm))), andnot (or (in_r, in_1), fx)); \
+            fy = or (or (and (in_r, mul (fy, four)), and (in_1, div (fy, mm))), andnot (or (in_r, in_1), fy)); \
+            fz = or (or (and (in_r, mul (fz, four)), and (in_1, div (fz, mm))), andnot (or (in_r, in_1), fz)); \
+            vx = add (mul (fx, s), cx); \
+            vy = add (mul (fy, s), cyv); \
+            vz = add (mul (fz, s), czv); \
+            vd d = sqrt (add (add (mul (vx, vx), mul (vy, vy)), mul (vz, vz))); \
+            escaped = or (escaped, gt (d, bail)); \
+            if (mask (escaped) == all) \
+              break; \
+          } \
+        \
+        int em = mask (escaped); \
+        for (j = 0; j < lanes && j < n; j++) \
+          esc[j] = (em >> j) & 1; \
+      } \
+  }
+
+// fold[i] > 1 ? 2 - fold[i] : fold[i] < -1 ? -2 - fold[i] : fold[i]
+# define VOL_DRAW_MANDEL_FOLD(v, or, and, andnot, gt, lt, sub) \
+  or (or (and (gt (v, one), sub (two, v)), \
+          and (lt (v, mone), sub (mtwo, v))), \
+      andnot (or (gt (v, one), lt (v, mone)), v))
+
+# define VOL_DRAW_SSE2_SETX(x) _mm_set_pd ((x) + 1, (x))
+# define VOL_DRAW_SSE2_GT(a,b) _mm_cmpgt_pd (a, b)
+# define VOL_DRAW_SSE2_LT(a,b) _mm_cmplt_pd (a, b)
+
+VOL_DRAW_MANDEL_BOX_ROW(vol_draw_mandel_box_row_sse2, , 2, __m128d,
+  _mm_set1_pd, VOL_DRAW_SSE2_SETX, _mm_add_pd, _mm_sub_pd, _mm_mul_pd,
+  _mm_div_pd, _mm_sqrt_pd, VOL_DRAW_SSE2_GT, VOL_DRAW_SSE2_LT, _mm_and_pd,
+  _mm_andnot_pd, _mm_or_pd, _mm_movemask_pd, 0x3)
+
+# define VOL_DRAW_AVX_SETX(x)  _mm256_set_pd ((x) + 3, (x) + 2, (x) + 1, (x))
+# define VOL_DRAW_AVX_GT(a,b)  _mm256_cmp_pd (a, b, _CMP_GT_OQ)
+# define VOL_DRAW_AVX_LT(a,b)  _mm256_cmp_pd (a, b, _CMP_LT_OQ)
+
+// no FMA, it would round differently than the scalar code:
+VOL_DRAW_MANDEL_BOX_ROW(vol_draw_mandel_box_row_avx2, __attribute__ ((target ("avx2"))), 4, __m256d,
+  _mm256_set1_pd, VOL_DRAW_AVX_SETX, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd,
+  _mm256_div_pd, _mm256_sqrt_pd, VOL_DRAW_AVX_GT, VOL_DRAW_AVX_LT, _mm256_and_pd,
+  _mm256_andnot_pd, _mm256_or_pd, _mm256_movemask_pd, 0xF)
+#endif
+
+static void vol_draw_mandel_box_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
 {
+  vol_draw_mandel_box_arg *m = arg;
+  double yc = m->yc, zc = m->zc, ysc = m->ysc, zsc = m->zsc,
+         cfact = m->cfact;
+#if !VOL_DRAW_SIMD
+  double xc = m->xc, xsc = m->xsc, s = m->s, r = m->r, f = m->f;
+  int it = m->it;
+#endif
+
+  vol_draw_state st;
+  vol_draw_get_state (&st);
+
+#if VOL_DRAW_SIMD
+  unsigned char esc[DRAW_CTX.size + 4];
+#endif
 
   int x, y, z;
-  for (z = 0; z < DRAW_CTX.size; z++)
+  for (z = z_beg; z < z_end; z++)
     for (y = 0; y < DRAW_CTX.size; y++)
-      for (x = 0; x < DRAW_CTX.size; x++)
-        {
-          vec3_init (c, x, y, z);
-          vec3_s_div (c, DRAW_CTX.size);
-          c[0] += xsc;
-          c[1] += ysc;
-          c[2] += zsc;
-          vec3_s_mul (c, cfact);
-
-          c[0] += -xsc * cfact;
-          c[1] += -ysc * cfact;
-          c[2] += -zsc * cfact;
-          c[0] += xc;
-          c[1] += yc;
-          c[2] += zc;
-
-          int i;
-          int escape = 0;
-          vec3_init (v, 0, 0, 0);
-          for (i = 0; i < it; i++)
-            {
-              double d = _vol_draw_mandel_box_equation (v, s, r, f, c);
-              if (d > 1024)
-                {
-                  escape = 1;
-                  break;
-                }
-            }
+      {
+        unsigned int row = (y + z * DRAW_CTX.size) * DRAW_CTX.size;
+
+#if VOL_DRAW_SIMD
+        // y and z of c like the scalar code below:
+        vec3_init (c, 0, y, z);
+        vec3_s_div (c, DRAW_CTX.size);
+        c[1] += ysc;
+        c[2] += zsc;
+        vec3_s_mul (c, cfact);
+        c[1] += -ysc * cfact;
+        c[2] += -zsc * cfact;
+        c[1] += yc;
+        c[2] += zc;
+
+        if (m->avx2)
+          vol_draw_mandel_box_row_avx2 (m, c[1], c[2], 0, DRAW_CTX.size, esc);
+        else
+          vol_draw_mandel_box_row_sse2 (m, c[1], c[2], 0, DRAW_CTX.size, esc);
+
+        for (x = 0; x < DRAW_CTX.size; x++)
+          if (!esc[x])
+            vol_draw_op_cell (&st, row + x, 0.5);
+#else
+        for (x = 0; x < DRAW_CTX.size; x++)
+          {
+            vec3_init (c, x, y, z);
+            vec3_s_div (c, DRAW_CTX.size);
+            c[0] += xsc;
+            c[1] += ysc;
+            c[2] += zsc;
+            vec3_s_mul (c, cfact);
+
+            c[0] += -xsc * cfact;
+            c[1] += -ysc * cfact;
+            c[2] += -zsc * cfact;
+            c[0] += xc;
+            c[1] += yc;
+            c[2] += zc;
+
+            int i;
+            int escape = 0;
+            vec3_init (v, 0, 0, 0);
+            for (i = 0; i < it; i++)
+              {
+                double d = _vol_draw_mandel_box_equation (v, s, r, f, c);
+                if (d > 1024)
+                  {
+                    escape = 1;
+                    break;
+                  }
+              }
+
+            if (!escape)
+              vol_draw_op_cell (&st, row + x, 0.5);
+          }
+#endif
+      }
+}
 
-          if (!escape)
-            vol_draw_op (x, y, z, 0.5);
-        }
+void vol_draw_mandel_box (double xc, double yc, double zc, double xsc, double ysc, double zsc, double s, double r, double f, int it, double cfact)
+{
+  vol_draw_mandel_box_arg m = { xc, yc, zc, xsc, ysc, zsc, s, r, f, it, cfact };
+#if VOL_DRAW_SIMD
+  m.avx2 = __builtin_cpu_supports ("avx2");
+#endif
+  vol_draw_parallel_volume (vol_draw_mandel_box_slab, &m);
 }
 
 
 // This function draws a menger sponge like structure to the volume.
-void vol_draw_menger_sponge_box (float x, float y, float z, float size, unsigned short lvl)
+static void _vol_draw_menger_sponge_box (float x, float y, float z, float size, unsigned short lvl)
 {
+  if (vol_draw_box_skip (x, y, z, size, 2))
+    return;
+
   if (lvl == 0)
     {
       vol_draw_fill_box (x, y, z, size);
@@ -662,14 +1542,24 @@ void vol_draw_menger_sponge_box (float x, float y, float z, float size, unsigned
            if (cnt_max < 2)
              continue;
 
-           vol_draw_menger_sponge_box (
+           _vol_draw_menger_sponge_box (
              x + j * s3, y + k * s3, z + l * s3, s3, lvl - 1);
          }
 }
 
+void vol_draw_menger_sponge_box (float x, float y, float z, float size, unsigned short lvl)
+{
+  vol_draw_skip_build ();
+  _vol_draw_menger_sponge_box (x, y, z, size, lvl);
+  vol_draw_skip_drop ();
+}
+
 // This algorithm draws some cantor dust like boxes recursively to the volume.
-void vol_draw_cantor_dust_box (float x, float y, float z, float size, unsigned short lvl)
+static void _vol_draw_cantor_dust_box (float x, float y, float z, float size, unsigned short lvl)
 {
+  if (vol_draw_box_skip (x, y, z, size, 2))
+    return;
+
   if (lvl == 0)
     {
       vol_draw_fill_box (x, y, z, size);
@@ -684,15 +1574,22 @@ void vol_draw_cantor_dust_box (float x, float y, float z, float size, unsigned s
 
    float offs = size + 2 * rad;
 
-   vol_draw_cantor_dust_box (x,        y,        z,        size, lvl - 1);
-   vol_draw_cantor_dust_box (x + offs, y,        z,        size, lvl - 1);
-   vol_draw_cantor_dust_box (x       , y,        z + offs, size, lvl - 1);
-   vol_draw_cantor_dust_box (x + offs, y,        z + offs, size, lvl - 1);
+   _vol_draw_cantor_dust_box (x,        y,        z,        size, lvl - 1);
+   _vol_draw_cantor_dust_box (x + offs, y,        z,        size, lvl - 1);
+   _vol_draw_cantor_dust_box (x       , y,        z + offs, size, lvl - 1);
+   _vol_draw_cantor_dust_box (x + offs, y,        z + offs, size, lvl - 1);
 
-   vol_draw_cantor_dust_box (x,        y + offs, z,        size, lvl - 1);
-   vol_draw_cantor_dust_box (x + offs, y + offs, z,        size, lvl - 1);
-   vol_draw_cantor_dust_box (x       , y + offs, z + offs, size, lvl - 1);
-   vol_draw_cantor_dust_box (x + offs, y + offs, z + offs, size, lvl - 1);
+   _vol_draw_cantor_dust_box (x,        y + offs, z,        size, lvl - 1);
+   _vol_draw_cantor_dust_box (x + offs, y + offs, z,        size, lvl - 1);
+   _vol_draw_cantor_dust_box (x       , y + offs, z + offs, size, lvl - 1);
+   _vol_draw_cantor_dust_box (x + offs, y + offs, z + offs, size, lvl - 1);
+}
+
+void vol_draw_cantor_dust_box (float x, float y, float z, float size, unsigned short lvl)
+{
+  vol_draw_skip_build ();
+  _vol_draw_cantor_dust_box (x, y, z, size, lvl);
+  vol_draw_skip_drop ();
 }
 
 // Copy grey voxel values from the internal structures.
@@ -707,3 +1604,442 @@ void vol_draw_copy (void *dst_arr)
            = DRAW_DST(x,y,z);
 }
 
+
+/* Draw programs are draw command scripts compiled once by
+ * Games::VoxEngine::VolDraw::compile_commands (), so drawing a sector is a
+ * single call instead of parsing the script and calling into XS for every
+ * command. A program is an array of doubles, every command is its opcode,
+ * the number of arguments and for each argument a (kind, a, b) triple.
+ * The seed and the "P" parameter are only bound when the program is run.
+ */
+#define VOL_DRAW_CMD_MODE          1
+#define VOL_DRAW_CMD_SRC_DST       2
+#define VOL_DRAW_CMD_DST_RANGE     3
+#define VOL_DRAW_CMD_SRC_RANGE     4
+#define VOL_DRAW_CMD_SRC_BLEND     5
+#define VOL_DRAW_CMD_FILL          6
+#define VOL_DRAW_CMD_FILL_SELF     7
+#define VOL_DRAW_CMD_FILL_NOISE    8
+#define VOL_DRAW_CMD_SUBDIV        9
+#define VOL_DRAW_CMD_SELF_CUBES    10
+#define VOL_DRAW_CMD_MENGER_SPONGE 11
+#define VOL_DRAW_CMD_CANTOR_DUST   12
+#define VOL_DRAW_CMD_SIERPINSKI    13
+#define VOL_DRAW_CMD_MAP_RANGE     14
+#define VOL_DRAW_CMD_HIST_EQUALIZE 15
+#define VOL_DRAW_CMD_COORDS        16
+#define VOL_DRAW_CMD_MANDELBOX     17
+
+#define VOL_DRAW_ARG_CONST 0 // a
+#define VOL_DRAW_ARG_LERP  1 // "Pa,b": linerp (a, b, param)
+#define VOL_DRAW_ARG_PARAM 2 // "P": param
+
+#define VOL_DRAW_MAX_ARGS 8
+
+// Argument conversion like the XS typemap does it for unsigned ints.
+#define VOL_DRAW_UINT(d) ((d) < 0 ? (unsigned int) (IV) (d) : (unsigned int) (UV) (d))
+
+static double vol_draw_prog_arg (double *arg, double param)
+{
+  switch ((int) arg[0])
+    {
+      case VOL_DRAW_ARG_LERP:  return linerp (arg[1], arg[2], param);
+      case VOL_DRAW_ARG_PARAM: return param;
+      default:                 return arg[1];
+    }
+}
+
+// Decodes the command at "*pc", returns 0 at the end of the program.
+static int vol_draw_prog_next (double *prog, unsigned int len, unsigned int *pc, double param, unsigned int *op, double *a)
+{
+  unsigned int i;
+
+  if (*pc + 2 > len)
+    return 0;
+
+  unsigned int argc = prog[*pc + 1];
+  *op = prog[*pc];
+  if (*pc + 2 + argc * 3 > len)
+    return 0;
+
+  for (i = 0; i < VOL_DRAW_MAX_ARGS; i++)
+    a[i] = i < argc ? vol_draw_prog_arg (prog + *pc + 2 + i * 3, param) : 0;
+
+  *pc += 2 + argc * 3;
+  return 1;
+}
+
+static void vol_draw_run_cmd (unsigned int op, double *a, double *coords, unsigned int size, unsigned int seed)
+{
+  unsigned int i;
+
+  switch (op)
+    {
+      case VOL_DRAW_CMD_MODE:
+        vol_draw_set_op (VOL_DRAW_UINT(a[0]));
+        break;
+
+      case VOL_DRAW_CMD_SRC_DST:
+        vol_draw_set_src (VOL_DRAW_UINT(a[0]));
+        vol_draw_set_dst (VOL_DRAW_UINT(a[1]));
+        break;
+
+      case VOL_DRAW_CMD_DST_RANGE: vol_draw_set_dst_range (a[0], a[1]); break;
+      case VOL_DRAW_CMD_SRC_RANGE: vol_draw_set_src_range (a[0], a[1]); break;
+      case VOL_DRAW_CMD_SRC_BLEND: vol_draw_set_src_blend (a[0]);       break;
+      case VOL_DRAW_CMD_FILL:      vol_draw_val (a[0]);                 break;
+      case VOL_DRAW_CMD_FILL_SELF: vol_draw_dst_self ();                break;
+
+      case VOL_DRAW_CMD_FILL_NOISE:
+        vol_draw_fill_simple_noise_octaves (
+          seed + VOL_DRAW_UINT(a[3]), VOL_DRAW_UINT(a[0]), a[1], a[2]);
+        break;
+
+      case VOL_DRAW_CMD_SUBDIV:
+        vol_draw_subdiv ((int) a[0], 0, 0, 0, size, a[1], (int) a[2]);
+        break;
+
+      case VOL_DRAW_CMD_SELF_CUBES:
+        vol_draw_self_sim_cubes_hash_seed (
+          0, 0, 0, size, VOL_DRAW_UINT(a[0]), seed + VOL_DRAW_UINT(a[2]),
+          VOL_DRAW_UINT(a[1]));
+        break;
+
+      case VOL_DRAW_CMD_MENGER_SPONGE:
+        vol_draw_menger_sponge_box (0, 0, 0, size, VOL_DRAW_UINT(a[0]));
+        break;
+
+      case VOL_DRAW_CMD_CANTOR_DUST:
+        vol_draw_cantor_dust_box (0, 0, 0, size, VOL_DRAW_UINT(a[0]));
+        break;
+
+      case VOL_DRAW_CMD_SIERPINSKI:
+        vol_draw_sierpinski_pyramid (0, 0, 0, size, VOL_DRAW_UINT(a[0]));
+        break;
+
+      case VOL_DRAW_CMD_MAP_RANGE:
+        vol_draw_map_range (a[0], a[1], a[2], a[3]);
+        break;
+
+      case VOL_DRAW_CMD_HIST_EQUALIZE:
+        vol_draw_histogram_equalize (a[0] == 0 ? 1 : (int) a[0], a[1], a[2]);
+        break;
+
+      case VOL_DRAW_CMD_COORDS:
+        for (i = 0; i < 6; i++)
+          coords[i] = a[i];
+        break;
+
+      case VOL_DRAW_CMD_MANDELBOX:
+        vol_draw_mandel_box (coords[0], coords[1], coords[2],
+                             coords[3], coords[4], coords[5],
+                             a[0], a[1], a[2], (int) a[3], a[4]);
+        break;
+    }
+}
+
+/* Consecutive fill, fill self and map_range commands (and the state
+ * changes between them) only look at the cell they draw, so they are fused
+ * into one sweep over the volume: every row of cells gets all of them in
+ * order while it is in the cache. The state each of them draws with is
+ * taken when they are collected, and the bounds checks of vol_draw_op ()
+ * are not needed at all.
+ */
+#define VOL_DRAW_MAX_FUSED 32
+
+typedef struct _vol_draw_fused_step {
+  unsigned int           cmd;
+  vol_draw_state         st;
+  double                 val; // fill
+  vol_draw_map_range_arg map; // map_range
+} vol_draw_fused_step;
+
+typedef struct _vol_draw_fused {
+  vol_draw_fused_step steps[VOL_DRAW_MAX_FUSED];
+  unsigned int        len;
+} vol_draw_fused;
+
+static int vol_draw_cmd_is_pointwise (unsigned int op)
+{
+  return op == VOL_DRAW_CMD_FILL
+         || op == VOL_DRAW_CMD_FILL_SELF
+         || op == VOL_DRAW_CMD_MAP_RANGE;
+}
+
+static int vol_draw_cmd_is_state (unsigned int op)
+{
+  return op == VOL_DRAW_CMD_MODE
+         || op == VOL_DRAW_CMD_SRC_DST
+         || op == VOL_DRAW_CMD_DST_RANGE
+         || op == VOL_DRAW_CMD_SRC_RANGE
+         || op == VOL_DRAW_CMD_SRC_BLEND
+         || op == VOL_DRAW_CMD_COORDS;
+}
+
+static void vol_draw_fused_slab (void *arg, unsigned int z_beg, unsigned int z_end, unsigned int slab)
+{
+  vol_draw_fused *f = arg;
+  unsigned int size = DRAW_CTX.size, row, i, c;
+
+  for (row = z_beg * size; row < z_end * size; row++)
+    {
+      unsigned int beg = row * size, end = beg + size;
+
+      for (i = 0; i < f->len; i++)
+        {
+          vol_draw_fused_step *s = &f->steps[i];
+
+          switch (s->cmd)
+            {
+              case VOL_DRAW_CMD_FILL:
+                for (c = beg; c < end; c++)
+                  vol_draw_op_cell (&s->st, c, s->val);
+                break;
+
+              case VOL_DRAW_CMD_FILL_SELF:
+                for (c = beg; c < end; c++)
+                  vol_draw_op_cell (&s->st, c, s->st.dst[c]);
+                break;
+
+              case VOL_DRAW_CMD_MAP_RANGE:
+                for (c = beg; c < end; c++)
+                  {
+                    double v = s->st.dst[c];
+                    if (v >= s->map.a && v <= s->map.b)
+                      {
+                        v -= s->map.a;
+                        v /= s->map.range;
+                        s->st.dst[c] = linerp (s->map.j, s->map.k, v);
+                      }
+                  }
+                break;
+            }
+        }
+    }
+}
+
+void vol_draw_run_program (double *prog, unsigned int len, unsigned int size, unsigned int seed, double param)
+{
+  double coords[6] = { 0, 0, 0, 0, 0, 0 };
+  double a[VOL_DRAW_MAX_ARGS];
+  unsigned int pc = 0, op;
+  vol_draw_fused fused;
+
+  seed++; // like draw_commands (), so we get no 0
+
+  while (vol_draw_prog_next (prog, len, &pc, param, &op, a))
+    {
+      if (!vol_draw_cmd_is_pointwise (op))
+        {
+          vol_draw_run_cmd (op, a, coords, size, seed);
+          continue;
+        }
+
+      fused.len = 0;
+      while (1)
+        {
+          if (vol_draw_cmd_is_state (op))
+            vol_draw_run_cmd (op, a, coords, size, seed);
+          else
+            {
+              vol_draw_fused_step *s = &fused.steps[fused.len++];
+              s->cmd = op;
+              vol_draw_get_state (&s->st);
+              s->val = a[0];
+              if (op == VOL_DRAW_CMD_MAP_RANGE)
+                vol_draw_map_range_prep (&s->map, a[0], a[1], a[2], a[3]);
+            }
+
+          unsigned int next_pc = pc;
+          if (fused.len >= VOL_DRAW_MAX_FUSED
+              || !vol_draw_prog_next (prog, len, &next_pc, param, &op, a)
+              || !(vol_draw_cmd_is_pointwise (op) || vol_draw_cmd_is_state (op)))
+            break;
+          pc = next_pc;
+        }
+
+      vol_draw_parallel_volume (vol_draw_fused_slab, &fused);
+    }
+}
+
+/* The range map of vol_draw_dst_to_world () (triples of "a b type", the
+ * cells with a value in [a, b) get the type) compiled into a table: all
+ * range borders sorted, and for every interval between two neighbouring
+ * borders the ranges that contain it, in the order of the map. A value
+ * then only needs a binary search instead of a walk over all ranges.
+ */
+typedef struct _vol_draw_range_table {
+  double         *bounds;  // sorted and unique
+  unsigned int    nbounds;
+  unsigned int   *first;   // types of interval i: types[first[i]] .. types[first[i + 1] - 1]
+  unsigned short *types;
+  unsigned char  *active;  // whether types[i] is an active type
+} vol_draw_range_table;
+
+static void vol_draw_range_table_init (vol_draw_range_table *t, double *ranges, unsigned int nranges)
+{
+  unsigned int i, j, n = 0;
+
+  t->bounds = safemalloc (sizeof (double) * (nranges * 2 + 1));
+  for (i = 0; i < nranges; i++)
+    {
+      double *r = &ranges[i * 3];
+      if (r[0] != r[0] || r[1] != r[1]) // NaN borders never match
+        continue;
+
+      for (j = 0; j < 2; j++)
+        {
+          // insertion sort, there are only a few ranges:
+          unsigned int k = n;
+          while (k > 0 && t->bounds[k - 1] > r[j])
+            {
+              t->bounds[k] = t->bounds[k - 1];
+              k--;
+            }
+
+          if (k > 0 && t->bounds[k - 1] == r[j])
+            memmove (&t->bounds[k], &t->bounds[k + 1], sizeof (double) * (n - k));
+          else
+            {
+              t->bounds[k] = r[j];
+              n++;
+            }
+        }
+    }
+  t->nbounds = n;
+
+  t->first  = safemalloc (sizeof (unsigned int) * (n + 1));
+  t->types  = safemalloc (sizeof (unsigned short) * (n * nranges + 1));
+  t->active = safemalloc (n * nranges + 1);
+
+  unsigned int ntypes = 0;
+  for (i = 0; i < n; i++)
+    {
+      t->first[i] = ntypes;
+      if (i + 1 >= n)
+        continue;
+
+      for (j = 0; j < nranges; j++)
+        {
+          double *r = &ranges[j * 3];
+          if (r[0] <= t->bounds[i] && t->bounds[i + 1] <= r[1])
+            {
+              t->types[ntypes]  = r[2];
+              t->active[ntypes] = vox_world_is_active (t->types[ntypes]);
+              ntypes++;
+            }
+        }
+    }
+  t->first[n] = ntypes;
+}
+
+static void vol_draw_range_table_free (vol_draw_range_table *t)
+{
+  safefree (t->bounds);
+  safefree (t->first);
+  safefree (t->types);
+  safefree (t->active);
+}
+
+// Returns the interval of the table "v" is in, or -1 if no range has it.
+static inline int vol_draw_range_table_find (vol_draw_range_table *t, double v)
+{
+  if (t->nbounds < 2 || !(v >= t->bounds[0] && v < t->bounds[t->nbounds - 1]))
+    return -1;
+
+  unsigned int lo = 0, hi = t->nbounds - 1;
+  while (hi - lo > 1)
+    {
+      unsigned int m = (lo + hi) / 2;
+      if (t->bounds[m] <= v)
+        lo = m;
+      else
+        hi = m;
+    }
+
+  return lo;
+}
+
+/* Sets the types of the cells of the sector from the destination buffer
+ * and the range map. The chunks of the sector are written directly in the
+ * order of their cells. Like before cells with a value of 0 are left alone
+ * and every range containing the value is applied in turn, so the last
+ * one wins.
+ */
+void vol_draw_dst_to_world (vox_world_query *q, int sector_x, int sector_y, int sector_z, double *ranges, unsigned int nranges)
+{
+  int cx = sector_x * CHUNKS_P_SECTOR,
+      cy = sector_y * CHUNKS_P_SECTOR,
+      cz = sector_z * CHUNKS_P_SECTOR;
+
+  vox_world_query_setup (q,
+    cx, cy, cz,
+    cx + (CHUNKS_P_SECTOR - 1),
+    cy + (CHUNKS_P_SECTOR - 1),
+    cz + (CHUNKS_P_SECTOR - 1)
+  );
+
+  vox_world_query_load_chunks (q, 1);
+
+  vol_draw_range_table t;
+  vol_draw_range_table_init (&t, ranges, nranges);
+
+  int size = DRAW_CTX.size;
+  if (size > CHUNKS_P_SECTOR * CHUNK_SIZE)
+    size = CHUNKS_P_SECTOR * CHUNK_SIZE;
+
+  int chx, chy, chz;
+  for (chz = 0; chz * CHUNK_SIZE < size; chz++)
+    for (chy = 0; chy * CHUNK_SIZE < size; chy++)
+      for (chx = 0; chx * CHUNK_SIZE < size; chx++)
+        {
+          vox_chunk *chnk = vox_world_query_chunk (q, chx, chy, chz);
+          assert (chnk);
+          chnk->dirty = 1;
+          int changed = 0;
+
+          int ox = chx * CHUNK_SIZE,
+              oy = chy * CHUNK_SIZE,
+              oz = chz * CHUNK_SIZE;
+          int w = size - ox < CHUNK_SIZE ? size - ox : CHUNK_SIZE,
+              h = size - oy < CHUNK_SIZE ? size - oy : CHUNK_SIZE,
+              d = size - oz < CHUNK_SIZE ? size - oz : CHUNK_SIZE;
+
+          int x, y, z;
+          for (z = 0; z < d; z++)
+            for (y = 0; y < h; y++)
+              {
+                vol_draw_val_t *row = &DRAW_DST(ox, oy + y, oz + z);
+                vox_cell *cells = &(chnk->cells[REL_POS2OFFS(0, y, z)]);
+
+                for (x = 0; x < w; x++)
+                  {
+                    double v = row[x];
+                    if (v == 0)
+                      continue;
+
+                    int iv = vol_draw_range_table_find (&t, v);
+                    if (iv < 0)
+                      continue;
+
+                    unsigned int i;
+                    for (i = t.first[iv]; i < t.first[iv + 1]; i++)
+                      {
+                        changed |= cells[x].type != t.types[i];
+                        cells[x].type = t.types[i];
+                        if (t.active[i])
+                          {
+                            int ax = ox + x, ay = oy + y, az = oz + z;
+                            vox_world_query_rel2abs (q, &ax, &ay, &az);
+                            vox_world_query_emit_active_cell_change (q, ax, ay, az, &cells[x], 0);
+                          }
+                      }
+                  }
+              }
+
+          if (changed)
+            chnk->gen++;
+        }
+
+  vol_draw_range_table_free (&t);
+}
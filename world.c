@@ -68,6 +68,11 @@ typedef struct _vox_cell {
    unsigned char  pad     : 7; // some padding
 } vox_cell;
 
+// Whether the stored data of a cell changed. The light doesn't count, it
+// is calculated again when a sector is loaded.
+#define VOX_CELL_DATA_CHANGED(a,b) \
+  ((a).type != (b).type || (a).meta != (b).meta || (a).add != (b).add)
+
 // Some (unfinished) try to implement storing changes:
 #if 0
 #define MAX_CHUNK_CHANGES 200
@@ -80,6 +85,7 @@ typedef struct _vox_chunk {
     int x, y, z;
     vox_cell cells[CHUNK_ALEN];
     int dirty;
+    unsigned int gen; // incremented when the data of a cell changes, see get_chunk_gens_packed
 #if 0
     vox_chunk_changed_cell changed_cells[MAX_CHUNK_CHANGES];
     int changes;
@@ -90,22 +96,18 @@ typedef struct _vox_world {
     vox_axis_array *y;
     SV *chunk_change_cb;        // callback for changed chunks.
     SV *active_cell_change_cb;  // callback for changed "active" cells.
+
+    /* If set, query contexts collect their chunk and active cell changes
+     * and pass them in one call to these instead of the callbacks above.
+     */
+    SV *chunk_change_batch_cb;
+    SV *active_cell_change_batch_cb;
 } vox_world;
 
 static vox_obj_attr OBJ_ATTR_MAP[POSSIBLE_OBJECTS];
 static vox_world WORLD;
 static vox_cell neighbour_cell;
 
-typedef struct _vox_light_item {
-    int x, y, z;
-    unsigned char lv;
-} vox_light_item;
-
-// We use a set of two queues, so we can quickly switch back and forth.
-static vox_queue *light_upd_queue   = 0;
-static vox_queue *light_upd_queue_1 = 0;
-static vox_queue *light_upd_queue_2 = 0;
-
 void vox_world_init ()
 {
   int i;
@@ -116,76 +118,6 @@ void vox_world_init ()
   neighbour_cell.add     = 0;
   neighbour_cell.meta    = 0;
   neighbour_cell.visible = 1;
-  light_upd_queue_1 =
-     vox_queue_new (sizeof (vox_light_item),
-                    CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE * 9 * 2);
-  light_upd_queue_2 =
-     vox_queue_new (sizeof (vox_light_item),
-                    CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE * 9 * 2);
-}
-
-// Clears light queues for light computation.
-void vox_world_light_upd_start ()
-{
-  light_upd_queue = light_upd_queue_1;
-  vox_queue_clear (light_upd_queue_1);
-  vox_queue_clear (light_upd_queue_2);
-}
-
-// Select light queue used.
-void vox_world_light_select_queue (int i)
-{
-  light_upd_queue = i > 0 ? light_upd_queue_2 : light_upd_queue_1;
-}
-
-// Store item in the queue.
-void vox_world_light_enqueue (int x, int y, int z, unsigned char light)
-{
-  vox_light_item it;
-  it.x = x;
-  it.y = y;
-  it.z = z;
-  it.lv = light;
-  vox_queue_enqueue (light_upd_queue, &it);
-  //d// printf ("light upd enqueue %d,%d,%d: %d\n", x, y, z, light);
-}
-
-// Freeze current queue state.
-void vox_world_light_freeze_queue ()
-{
-  vox_queue_freeze (light_upd_queue);
-}
-
-// Thaw current queue state.
-void vox_world_light_thaw_queue ()
-{
-  vox_queue_thaw (light_upd_queue);
-}
-
-// Enqueue neighbor cells.
-void vox_world_light_enqueue_neighbours (int x, int y, int z, unsigned char light)
-{
-  vox_world_light_enqueue (x + 1, y, z, light);
-  vox_world_light_enqueue (x - 1, y, z, light);
-  vox_world_light_enqueue (x, y + 1, z, light);
-  vox_world_light_enqueue (x, y - 1, z, light);
-  vox_world_light_enqueue (x, y, z + 1, light);
-  vox_world_light_enqueue (x, y, z - 1, light);
-}
-
-int vox_world_light_dequeue (int *x, int *y, int *z, unsigned char *light)
-{
-  vox_light_item *it = vox_queue_dequeue (light_upd_queue);
-  if (it)
-    {
-      *x = it->x;
-      *y = it->y;
-      *z = it->z;
-      *light = it->lv;
-      //d// printf ("light upd dequeue %d,%d,%d: %d\n", *x, *y, *z, *light);
-    }
-
-  return it != 0;
 }
 
 void vox_world_emit_chunk_change (int x, int y, int z)
@@ -229,6 +161,51 @@ void vox_world_emit_active_cell_change (int x, int y, int z, vox_cell *c, SV *sv
     }
 }
 
+/* Calls the batch callback with the changed chunk coordinates
+ * packed as native 32 bit integers (x, y, z, x, y, z, ...).
+ */
+void vox_world_emit_chunk_changes (int *coords, unsigned int len)
+{
+  if (WORLD.chunk_change_batch_cb && len > 0)
+    {
+      dSP;
+      ENTER;
+      SAVETMPS;
+      PUSHMARK(SP);
+      XPUSHs(sv_2mortal(newSVpvn ((char *) coords, sizeof (int) * len)));
+      PUTBACK;
+      call_sv (WORLD.chunk_change_batch_cb, G_DISCARD | G_VOID);
+      SPAGAIN;
+      FREETMPS;
+      LEAVE;
+    }
+}
+
+/* Calls the batch callback with the changed active cells packed as
+ * native 32 bit integers (x, y, z, type, ...) and an array reference
+ * with the entity for each cell (or undef).
+ * Takes over the reference to "ents".
+ */
+void vox_world_emit_active_cell_changes (int *cells, unsigned int len, AV *ents)
+{
+  if (WORLD.active_cell_change_batch_cb && len > 0)
+    {
+      dSP;
+      ENTER;
+      SAVETMPS;
+      PUSHMARK(SP);
+      XPUSHs(sv_2mortal(newSVpvn ((char *) cells, sizeof (int) * len)));
+      XPUSHs(sv_2mortal(newRV_noinc ((SV *) ents)));
+      PUTBACK;
+      call_sv (WORLD.active_cell_change_batch_cb, G_DISCARD | G_VOID);
+      SPAGAIN;
+      FREETMPS;
+      LEAVE;
+    }
+  else if (ents)
+    SvREFCNT_dec ((SV *) ents);
+}
+
 vox_obj_attr *vox_world_get_attr (unsigned int type)
 {
   return &(OBJ_ATTR_MAP[type]);
@@ -279,7 +256,9 @@ void vox_world_set_object_model (unsigned int type, unsigned int dim, AV *blocks
     }
 }
 
-int vox_set_cell_from_data (vox_cell *c, unsigned char *ptr)
+// Returns whether the type or light changed, *data_chg is set if the
+// stored data changed.
+int vox_set_cell_from_data (vox_cell *c, unsigned char *ptr, int *data_chg)
 {
  //d//printf ("CELL dATA %p: %02x %02x %02x %02x\n", c, *ptr, *(ptr + 1), *(ptr + 2), *(ptr + 3));
   unsigned short *sptr = (short *) ptr;
@@ -295,6 +274,8 @@ int vox_set_cell_from_data (vox_cell *c, unsigned char *ptr)
   int chg = 0;
   if (c->type != type)   chg = 1;
   if (c->light != light) chg = 1;
+  if (c->type != type || c->meta != meta || c->add != add)
+    *data_chg = 1;
 
   c->type  = type;
   c->light = light;
@@ -462,7 +443,7 @@ void vox_world_chunk_calc_visibility (vox_chunk *chnk)
 int vox_world_set_chunk_from_data (vox_chunk *chnk, unsigned char *data, unsigned int len)
 {
   unsigned int x, y, z;
-  int neigh_chunks = 0;
+  int neigh_chunks = 0, data_chg = 0;
 
   for (z = 0; z < CHUNK_SIZE; z++)
     for (y = 0; y < CHUNK_SIZE; y++)
@@ -470,7 +451,7 @@ int vox_world_set_chunk_from_data (vox_chunk *chnk, unsigned char *data, unsigne
         {
           unsigned int offs = REL_POS2OFFS (x, y, z);
           assert (len > (offs * 4) + 3);
-          int chg = vox_set_cell_from_data (&(chnk->cells[offs]), data + (offs * 4));
+          int chg = vox_set_cell_from_data (&(chnk->cells[offs]), data + (offs * 4), &data_chg);
           if (chg)
             {
               if (x == 0)
@@ -488,6 +469,9 @@ int vox_world_set_chunk_from_data (vox_chunk *chnk, unsigned char *data, unsigne
             }
         }
 
+  if (data_chg)
+    chnk->gen++;
+
   return neigh_chunks;
 }
 
@@ -574,6 +558,315 @@ void vox_world_purge_chunk (int x, int y, int z)
     }
 }
 
+/* Walks the cells along a ray through the chunk store (the voxel
+ * traversal of Amanatides & Woo) and stops at the first blocking cell.
+ * Unloaded chunks count as blocking, like in vox_world_is_solid_at.
+ * The cell the ray starts in is not tested.
+ *
+ * Returns 1 on a hit within max_dist, with the cell in "cell", the normal
+ * of the face the ray entered the cell through in "face" and the
+ * distance from "pos" in "dist".
+ */
+int vox_world_raycast (double *pos, double *dir, double max_dist, int *cell, int *face, double *dist)
+{
+  vec3_clone (d, dir);
+  double len = vec3_len (d);
+  if (len <= 0)
+    return 0;
+  vec3_s_div (d, len);
+
+  int c[3], step[3], i;
+  double t_max[3], t_delta[3];
+  for (i = 0; i < 3; i++)
+    {
+      c[i] = floor (pos[i]);
+
+      if (d[i] > 0)
+        {
+          step[i]    = 1;
+          t_delta[i] = 1. / d[i];
+          t_max[i]   = ((c[i] + 1) - pos[i]) * t_delta[i];
+        }
+      else if (d[i] < 0)
+        {
+          step[i]    = -1;
+          t_delta[i] = -1. / d[i];
+          t_max[i]   = (pos[i] - c[i]) * t_delta[i];
+        }
+      else
+        {
+          step[i]    = 0;
+          t_delta[i] = max_dist + 1;
+          t_max[i]   = max_dist + 1;
+        }
+    }
+
+  vox_chunk *chnk = 0;
+  int chnk_pos[3] = { 0, 0, 0 };
+  int has_chnk = 0;
+
+  while (1)
+    {
+      // step along the axis with the nearest cell border:
+      int axis = 0;
+      if (t_max[1] < t_max[axis]) axis = 1;
+      if (t_max[2] < t_max[axis]) axis = 2;
+
+      double t = t_max[axis];
+      if (t > max_dist)
+        return 0;
+
+      c[axis]     += step[axis];
+      t_max[axis] += t_delta[axis];
+
+      int cp[3], rp[3];
+      for (i = 0; i < 3; i++)
+        {
+          cp[i] = c[i] >= 0 ? c[i] / CHUNK_SIZE : -((-c[i] - 1) / CHUNK_SIZE) - 1;
+          rp[i] = c[i] - cp[i] * CHUNK_SIZE;
+        }
+
+      if (!has_chnk
+          || cp[0] != chnk_pos[0] || cp[1] != chnk_pos[1] || cp[2] != chnk_pos[2])
+        {
+          chnk = vox_world_chunk (cp[0], cp[1], cp[2], 0);
+          chnk_pos[0] = cp[0];
+          chnk_pos[1] = cp[1];
+          chnk_pos[2] = cp[2];
+          has_chnk = 1;
+        }
+
+      if (!chnk
+          || vox_world_get_attr (
+               chnk->cells[REL_POS2OFFS(rp[0], rp[1], rp[2])].type)->blocking)
+        {
+          for (i = 0; i < 3; i++)
+            {
+              cell[i] = c[i];
+              face[i] = 0;
+            }
+          face[axis] = -step[axis];
+          *dist = t;
+          return 1;
+        }
+    }
+}
+
+// Returns whether the cell at x,y,z is blocking, unloaded chunks are.
+int vox_world_is_blocking_at (int x, int y, int z)
+{
+  int cx = x >= 0 ? x / CHUNK_SIZE : -((-x - 1) / CHUNK_SIZE) - 1,
+      cy = y >= 0 ? y / CHUNK_SIZE : -((-y - 1) / CHUNK_SIZE) - 1,
+      cz = z >= 0 ? z / CHUNK_SIZE : -((-z - 1) / CHUNK_SIZE) - 1;
+
+  vox_chunk *chnk = vox_world_chunk (cx, cy, cz, 0);
+  if (!chnk)
+    return 1;
+
+  vox_cell *c =
+    &(chnk->cells[REL_POS2OFFS(x - cx * CHUNK_SIZE,
+                               y - cy * CHUNK_SIZE,
+                               z - cz * CHUNK_SIZE)]);
+  return vox_world_get_attr (c->type)->blocking;
+}
+
+/* Collides a sphere with the unit box at "box". Returns 1 if they
+ * intersect, with the collision direction in "dir" and the offset that
+ * moves the sphere out of the box in "adj".
+ */
+int vox_collide_sphere_box (double *spos, double rad, double *box, double *dir, double *adj)
+{
+  double dv[3];
+  int i;
+  for (i = 0; i < 3; i++)
+    {
+      double p = spos[i];
+      if (p < box[i])     p = box[i];
+      if (p > box[i] + 1) p = box[i] + 1;
+      dv[i] = spos[i] - p;
+    }
+
+  double dvlen = vec3_len (dv);
+
+  if (dvlen == 0) // ouch, directly in the side?
+    {
+      // find the direction away from the center
+      for (i = 0; i < 3; i++)
+        dir[i] = spos[i] - (box[i] + 0.5);
+
+      double l = vec3_len (dir);
+      if (l > 0.0001)
+        {
+          vec3_s_div (dir, l);
+        }
+      else // he IS in the center
+        {
+          dir[0] = 0; dir[1] = 1; dir[2] = 0; // move up :)
+        }
+
+      // and move out one radius!
+      vec3_assign (adj, dir);
+      vec3_s_mul (adj, rad);
+      return 1;
+    }
+
+  if (dvlen < rad)
+    {
+      double back_dist = (rad - dvlen) + 0.00001;
+      vec3_assign (dir, dv);
+      vec3_assign (adj, dv);
+      vec3_s_mul (adj, back_dist / dvlen);
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Collides the player, a sphere at "pos" and one at "pos" + plh above
+ * it, with the world and moves "pos" out of any blocking cells. The
+ * collision directions are summed up in "normal".
+ * Returns 0 if nothing was hit, 1 if "pos" was moved and 2 if the
+ * player was stuck in too many cells to be moved out.
+ */
+int vox_world_collide (double *pos, double rad, double plh, double *normal)
+{
+  static double wall_offs[4][2] = {
+    { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 }
+  };
+  double dir[3], adj[3], box[3];
+  int rec = 0, collided = 0, i, j;
+
+  normal[0] = normal[1] = normal[2] = 0;
+
+ recollide:
+  rec++;
+  // we collide too much:
+  if (rec > 8)
+    return 2;
+
+  // the walls beside the cylinder of the player, at foot and head height:
+  double walls[8][3];
+  int nwalls = 0;
+  for (i = 0; i < 4; i++)
+    {
+      double w[3] = {
+        floor (pos[0] + wall_offs[i][0] * rad),
+        floor (pos[1]),
+        floor (pos[2] + wall_offs[i][1] * rad)
+      };
+
+      for (j = 0; j < nwalls; j += 2)
+        if (walls[j][0] == w[0] && walls[j][2] == w[2])
+          break;
+      if (j < nwalls)
+        continue;
+
+      vec3_assign (walls[nwalls], w);
+      nwalls++;
+      vec3_assign (walls[nwalls], w);
+      walls[nwalls][1] = floor (w[1] + plh);
+      nwalls++;
+    }
+
+  for (i = 0; i < nwalls; i++)
+    {
+      if (!vox_world_is_blocking_at (walls[i][0], walls[i][1], walls[i][2]))
+        continue;
+
+      double spos[3] = { pos[0], 0, pos[2] };
+      vec3_assign (box, walls[i]);
+      box[1] = 0;
+
+      if (vox_collide_sphere_box (spos, rad, box, dir, adj))
+        {
+          vec3_add (normal, dir);
+          vec3_add (pos, adj);
+          collided = 1;
+          goto recollide;
+        }
+    }
+
+  double sphere_y[2] = { 0, plh };
+  for (j = 0; j < 2; j++)
+    {
+      vec3_init (spos, pos[0], pos[1] + sphere_y[j], pos[2]);
+      vec3_clone (my_box, spos);
+      vec3_floor (my_box);
+
+      // the current box and the neighbours on the nearer side per axis:
+      int rng[3][2];
+      for (i = 0; i < 3; i++)
+        {
+          rng[i][0] = 0;
+          rng[i][1] = fabs (spos[i] - (int) spos[i]) > 0.5 ? 1 : -1;
+          if (spos[i] < 0)
+            rng[i][1] *= -1;
+        }
+
+      int x, y, z;
+      for (x = 0; x < 2; x++)
+        for (y = 0; y < 2; y++)
+          for (z = 0; z < 2; z++)
+            {
+              box[0] = my_box[0] + rng[0][x];
+              box[1] = my_box[1] + rng[1][y];
+              box[2] = my_box[2] + rng[2][z];
+              if (!vox_world_is_blocking_at (box[0], box[1], box[2]))
+                continue;
+
+              if (vox_collide_sphere_box (spos, rad, box, dir, adj))
+                {
+                  vec3_add (normal, dir);
+                  vec3_add (pos, adj);
+                  collided = 1;
+                  goto recollide;
+                }
+            }
+    }
+
+  return collided;
+}
+
+/* Like vox_world_collide, but moves the player from "from" to "pos" in
+ * steps of at most half the radius, so fast movements can't tunnel
+ * through thin walls. The player slides along what it hits.
+ * "normal" is the one of the deepest contact of all steps.
+ */
+int vox_world_collide_swept (double *from, double *pos, double rad, double plh, double *normal)
+{
+  vec3_clone (delta, pos);
+  vec3_sub (delta, from);
+
+  int steps = ceil (vec3_len (delta) / (rad * 0.5)), i;
+  if (steps <= 1)
+    return vox_world_collide (pos, rad, plh, normal);
+
+  vec3_s_div (delta, steps);
+  vec3_assign (pos, from);
+
+  double n[3];
+  int collided = 0;
+  normal[0] = normal[1] = normal[2] = 0;
+
+  for (i = 0; i < steps; i++)
+    {
+      vec3_add (pos, delta);
+      int c = vox_world_collide (pos, rad, plh, n);
+      if (c == 2)
+        return 2;
+
+      // keep the deepest contact, summing over the steps would make
+      // the normal grow with the number of steps:
+      if (c && (!collided || vec3_len (n) > vec3_len (normal)))
+        {
+          vec3_assign (normal, n);
+        }
+      collided |= c;
+    }
+
+  return collided;
+}
+
 // Haven't tested this function in a long time now. Not sure if it still works :)
 void vox_world_dump ()
 {
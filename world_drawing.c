@@ -20,7 +20,48 @@
  * world. The main purpose is to make sure chunks can be quickly accessed
  * for the mutation operations or the light algorithm.
  */
-#define DRAW_CONTEXT_MAX_SIZE (20 * 20 * 20)
+/* Contexts up to this many chunks store a pointer for every chunk
+ * of their box, bigger ones only store the chunks that are present.
+ */
+#define QUERY_DENSE_MAX_CHUNKS (20 * 20 * 20)
+
+// Growable buffer of integers, used to collect change notifications.
+typedef struct _vox_int_buf {
+    int *data;
+    unsigned int len;
+    unsigned int alloc;
+} vox_int_buf;
+
+void vox_int_buf_push (vox_int_buf *b, int v)
+{
+  if (b->len >= b->alloc)
+    {
+      b->alloc = b->alloc ? b->alloc * 2 : 256;
+      int *nd = safemalloc (sizeof (int) * b->alloc);
+      if (b->data)
+        {
+          memcpy (nd, b->data, sizeof (int) * b->len);
+          safefree (b->data);
+        }
+      b->data = nd;
+    }
+
+  b->data[b->len++] = v;
+}
+
+void vox_int_buf_free (vox_int_buf *b)
+{
+  if (b->data)
+    safefree (b->data);
+  b->data  = 0;
+  b->len   = 0;
+  b->alloc = 0;
+}
+
+typedef struct _vox_query_sparse_chunk {
+    int x, y, z; // context relative chunk coordinates
+    vox_chunk *chunk;
+} vox_query_sparse_chunk;
 
 typedef struct _vox_world_query {
     // Chunk coordinates.
@@ -30,16 +71,202 @@ typedef struct _vox_world_query {
     // Size of context in chunks.
     int x_w, y_w, z_w;
 
-    // The "loaded" chunks.
-    vox_chunk *chunks[DRAW_CONTEXT_MAX_SIZE];
+    // Index distance in "chunks" between neighbouring chunks along x, y and z.
+    int chnk_stride[3];
+
+    /* The "loaded" chunks. Either "chunks" holds all chunks of the box
+     * or, if the box is too big, "sparse" is a hash table of only
+     * the present chunks. Both buffers only grow and are reused between
+     * setups of the same context.
+     */
+    int is_sparse;
+    vox_chunk **chunks;
+    unsigned int chunks_alloc;
+    vox_query_sparse_chunk *sparse;
+    unsigned int sparse_alloc; // always a power of 2
+    unsigned int sparse_len;
 
     // Flag that we tried to fetch chunks from the global data structure.
     int loaded;
+
+    /* The queues of the light algorithm (see light.c). They are
+     * allocated on first use, so contexts that never compute light
+     * stay small.
+     */
+    vox_queue *light_upd_queue;
+    vox_queue *light_upd_queue_1;
+    vox_queue *light_upd_queue_2;
+
+    /* Change notifications collected for the batch callbacks, they
+     * are passed on by vox_world_query_desetup ().
+     */
+    vox_int_buf chunk_events;
+    vox_int_buf cell_events;
+    AV         *cell_event_ents;
 } vox_world_query;
 
-#define QUERY_CHUNK(x,y,z) QUERY_CONTEXT.chunks[x + y * (QUERY_CONTEXT.x_w) + z * (QUERY_CONTEXT.x_w * QUERY_CONTEXT.y_w)]
+#define QUERY_CHUNK(q,x,y,z) (q)->chunks[(x) + (y) * ((q)->x_w) + (z) * ((q)->x_w * (q)->y_w)]
+
+#define QUERY_SPARSE_HASH(x,y,z) \
+  (((unsigned int) (x) * 73856093u) ^ ((unsigned int) (y) * 19349663u) ^ ((unsigned int) (z) * 83492791u))
+
+/* Query contexts are independent of each other, so nested or concurrent
+ * queries (e.g. a mutation that loads a sector) don't clobber each other.
+ */
+vox_world_query *vox_world_query_new ()
+{
+  vox_world_query *q = safemalloc (sizeof (vox_world_query));
+  memset (q, 0, sizeof (vox_world_query));
+  return q;
+}
+
+void vox_world_query_free (vox_world_query *q)
+{
+  if (q->chunks)
+    safefree (q->chunks);
+  if (q->sparse)
+    safefree (q->sparse);
+  if (q->light_upd_queue_1)
+    vox_queue_free (q->light_upd_queue_1);
+  if (q->light_upd_queue_2)
+    vox_queue_free (q->light_upd_queue_2);
+  // notifications not passed on by a desetup are dropped:
+  if (q->cell_event_ents)
+    SvREFCNT_dec ((SV *) q->cell_event_ents);
+  vox_int_buf_free (&(q->chunk_events));
+  vox_int_buf_free (&(q->cell_events));
+  safefree (q);
+}
+
+void vox_world_query_emit_chunk_change (vox_world_query *q, int x, int y, int z)
+{
+  if (!WORLD.chunk_change_batch_cb)
+    {
+      vox_world_emit_chunk_change (x, y, z);
+      return;
+    }
+
+  vox_int_buf_push (&(q->chunk_events), x);
+  vox_int_buf_push (&(q->chunk_events), y);
+  vox_int_buf_push (&(q->chunk_events), z);
+}
+
+// x, y and z are absolute world coordinates.
+void vox_world_query_emit_active_cell_change (vox_world_query *q, int x, int y, int z, vox_cell *c, SV *sv)
+{
+  if (!WORLD.active_cell_change_batch_cb)
+    {
+      vox_world_emit_active_cell_change (x, y, z, c, sv);
+      return;
+    }
+
+  vox_int_buf_push (&(q->cell_events), x);
+  vox_int_buf_push (&(q->cell_events), y);
+  vox_int_buf_push (&(q->cell_events), z);
+  vox_int_buf_push (&(q->cell_events), c->type);
+
+  if (!q->cell_event_ents)
+    q->cell_event_ents = newAV ();
+  av_push (q->cell_event_ents, sv ? newSVsv (sv) : newSV (0));
+}
 
-static vox_world_query QUERY_CONTEXT;
+// Passes the collected notifications to the batch callbacks.
+void vox_world_query_flush_events (vox_world_query *q)
+{
+  if (q->cell_events.len)
+    {
+      AV *ents = q->cell_event_ents;
+      q->cell_event_ents = 0;
+      vox_world_emit_active_cell_changes (
+        q->cell_events.data, q->cell_events.len, ents);
+      q->cell_events.len = 0;
+    }
+
+  if (q->chunk_events.len)
+    {
+      vox_world_emit_chunk_changes (q->chunk_events.data, q->chunk_events.len);
+      q->chunk_events.len = 0;
+    }
+}
+
+vox_query_sparse_chunk *vox_world_query_sparse_slot (vox_world_query *q, int x, int y, int z)
+{
+  unsigned int mask = q->sparse_alloc - 1;
+  unsigned int i = QUERY_SPARSE_HASH(x, y, z) & mask;
+
+  while (q->sparse[i].chunk)
+    {
+      vox_query_sparse_chunk *sc = &(q->sparse[i]);
+      if (sc->x == x && sc->y == y && sc->z == z)
+        break;
+      i = (i + 1) & mask;
+    }
+
+  return &(q->sparse[i]);
+}
+
+void vox_world_query_sparse_clear (vox_world_query *q, unsigned int min_alloc)
+{
+  if (!q->sparse || q->sparse_alloc < min_alloc)
+    {
+      if (q->sparse)
+        safefree (q->sparse);
+
+      if (q->sparse_alloc == 0)
+        q->sparse_alloc = 1024;
+      while (q->sparse_alloc < min_alloc)
+        q->sparse_alloc *= 2;
+
+      q->sparse = safemalloc (sizeof (vox_query_sparse_chunk) * q->sparse_alloc);
+    }
+
+  memset (q->sparse, 0, sizeof (vox_query_sparse_chunk) * q->sparse_alloc);
+  q->sparse_len = 0;
+}
+
+void vox_world_query_sparse_add (vox_world_query *q, int x, int y, int z, vox_chunk *c)
+{
+  if ((q->sparse_len + 1) * 2 > q->sparse_alloc)
+    {
+      vox_query_sparse_chunk *old     = q->sparse;
+      unsigned int            old_len = q->sparse_alloc;
+      unsigned int i;
+
+      q->sparse = 0;
+      q->sparse_alloc = 0;
+      vox_world_query_sparse_clear (q, old_len * 2);
+
+      for (i = 0; i < old_len; i++)
+        if (old[i].chunk)
+          {
+            *vox_world_query_sparse_slot (q, old[i].x, old[i].y, old[i].z) = old[i];
+            q->sparse_len++;
+          }
+
+      safefree (old);
+    }
+
+  vox_query_sparse_chunk *sc = vox_world_query_sparse_slot (q, x, y, z);
+  if (!sc->chunk)
+    q->sparse_len++;
+  sc->x = x;
+  sc->y = y;
+  sc->z = z;
+  sc->chunk = c;
+}
+
+// Returns the chunk at the context relative chunk coordinates.
+vox_chunk *vox_world_query_chunk (vox_world_query *q, int x, int y, int z)
+{
+  if (x < 0 || y < 0 || z < 0
+      || x >= q->x_w || y >= q->y_w || z >= q->z_w)
+    return 0;
+
+  if (q->is_sparse)
+    return vox_world_query_sparse_slot (q, x, y, z)->chunk;
+
+  return QUERY_CHUNK(q, x, y, z);
+}
 
 /* Cleans up the query context after usage and
  * calls change callbacks if needed.
@@ -48,24 +275,52 @@ static vox_world_query QUERY_CONTEXT;
  * no_update == 1 - Don't call any callbacks.
  * no_update == 2 - Call callbacks for every chunk in the context.
  */
-int vox_world_query_desetup (int no_update) // no_update == 2 means: force update
+int vox_world_query_desetup (vox_world_query *q, int no_update) // no_update == 2 means: force update
 {
   int cnt = 0;
   int x, y, z;
-  for (z = 0; z < QUERY_CONTEXT.z_w; z++)
-    for (y = 0; y < QUERY_CONTEXT.y_w; y++)
-      for (x = 0; x < QUERY_CONTEXT.x_w; x++)
+
+  if (q->is_sparse)
+    {
+      unsigned int i;
+      for (i = 0; i < q->sparse_alloc; i++)
+        {
+          vox_chunk *chnk = q->sparse[i].chunk;
+          if (!chnk)
+            continue;
+
+          if (no_update != 2)
+            {
+              if (!chnk->dirty)
+                continue;
+
+              chnk->dirty = 0;
+              cnt++;
+            }
+
+          if (no_update != 1)
+            vox_world_query_emit_chunk_change (q, chnk->x, chnk->y, chnk->z);
+        }
+
+      q->loaded = 0;
+      vox_world_query_flush_events (q);
+      return cnt;
+    }
+
+  for (z = 0; z < q->z_w; z++)
+    for (y = 0; y < q->y_w; y++)
+      for (x = 0; x < q->x_w; x++)
         {
-          vox_chunk *chnk = QUERY_CHUNK(x, y, z);
+          vox_chunk *chnk = QUERY_CHUNK(q, x, y, z);
           if (!chnk)
             continue;
 
           if (no_update == 2)
             {
-              vox_world_emit_chunk_change (
-                x + QUERY_CONTEXT.chnk_x,
-                y + QUERY_CONTEXT.chnk_y,
-                z + QUERY_CONTEXT.chnk_z);
+              vox_world_query_emit_chunk_change (q,
+                x + q->chnk_x,
+                y + q->chnk_y,
+                z + q->chnk_z);
               continue;
             }
 
@@ -76,65 +331,145 @@ int vox_world_query_desetup (int no_update) // no_update == 2 means: force updat
           cnt++;
 
           if (no_update == 0)
-            vox_world_emit_chunk_change (
-              x + QUERY_CONTEXT.chnk_x,
-              y + QUERY_CONTEXT.chnk_y,
-              z + QUERY_CONTEXT.chnk_z);
+            vox_world_query_emit_chunk_change (q,
+              x + q->chnk_x,
+              y + q->chnk_y,
+              z + q->chnk_z);
         }
 
-  QUERY_CONTEXT.loaded = 0;
+  q->loaded = 0;
+  vox_world_query_flush_events (q);
   return cnt;
 }
 
-void vox_world_query_setup (int x, int y, int z, int ex, int ey, int ez)
+void vox_world_query_setup (vox_world_query *q, int x, int y, int z, int ex, int ey, int ez)
 {
   if (x > ex) SWAP(int,x,ex);
   if (y > ey) SWAP(int,y,ey);
   if (z > ez) SWAP(int,z,ez);
 
-  QUERY_CONTEXT.chnk_x = x;
-  QUERY_CONTEXT.chnk_y = y;
-  QUERY_CONTEXT.chnk_z = z;
-  QUERY_CONTEXT.end_chnk_x = ex;
-  QUERY_CONTEXT.end_chnk_y = ey;
-  QUERY_CONTEXT.end_chnk_z = ez;
+  q->chnk_x = x;
+  q->chnk_y = y;
+  q->chnk_z = z;
+  q->end_chnk_x = ex;
+  q->end_chnk_y = ey;
+  q->end_chnk_z = ez;
+
+
+  q->x_w = (ex - x) + 1;
+  q->y_w = (ey - y) + 1;
+  q->z_w = (ez - z) + 1;
+
+  double size = (double) q->x_w * (double) q->y_w * (double) q->z_w;
+  q->is_sparse = size > QUERY_DENSE_MAX_CHUNKS;
+
+  if (q->is_sparse)
+    {
+      q->chnk_stride[0] = 0;
+      q->chnk_stride[1] = 0;
+      q->chnk_stride[2] = 0;
+    }
+  else
+    {
+      if (q->chunks_alloc < (unsigned int) size)
+        {
+          if (q->chunks)
+            safefree (q->chunks);
+          q->chunks_alloc = size;
+          q->chunks = safemalloc (sizeof (vox_chunk *) * q->chunks_alloc);
+        }
+
+      q->chnk_stride[0] = 1;
+      q->chnk_stride[1] = q->x_w;
+      q->chnk_stride[2] = q->x_w * q->y_w;
+    }
+
+  q->loaded = 0;
+}
+
+/* Collects the present chunks of a sparse context by walking the
+ * (sorted) axis arrays of the world, so the cost depends on the number
+ * of loaded chunks and not on the size of the box.
+ */
+void vox_world_query_load_sparse (vox_world_query *q)
+{
+  vox_axis_node *node;
+  unsigned int yi, xi, zi;
+
+  yi = vox_axis_array_find (WORLD.y, q->chnk_y, &node);
+  for (; yi < WORLD.y->len && WORLD.y->nodes[yi].coord <= q->end_chnk_y; yi++)
+    {
+      vox_axis_array *xa = WORLD.y->nodes[yi].ptr;
 
+      xi = vox_axis_array_find (xa, q->chnk_x, &node);
+      for (; xi < xa->len && xa->nodes[xi].coord <= q->end_chnk_x; xi++)
+        {
+          vox_axis_array *za = xa->nodes[xi].ptr;
 
-  QUERY_CONTEXT.x_w = (ex - x) + 1;
-  QUERY_CONTEXT.y_w = (ey - y) + 1;
-  QUERY_CONTEXT.z_w = (ez - z) + 1;
+          zi = vox_axis_array_find (za, q->chnk_z, &node);
+          for (; zi < za->len && za->nodes[zi].coord <= q->end_chnk_z; zi++)
+            {
+              vox_chunk *c = za->nodes[zi].ptr;
+              if (!c)
+                continue;
 
-  QUERY_CONTEXT.loaded = 0;
+              vox_chunk_clear_changes (c);
+              vox_world_query_sparse_add (q,
+                c->x - q->chnk_x, c->y - q->chnk_y, c->z - q->chnk_z, c);
+            }
+        }
+    }
 }
 
 // Loads chunks from the global data structure (if available).
-void vox_world_query_load_chunks (int alloc)
+void vox_world_query_load_chunks (vox_world_query *q, int alloc)
 {
   int x, y, z;
-  for (z = QUERY_CONTEXT.chnk_z; z <= QUERY_CONTEXT.end_chnk_z; z++)
-    for (y = QUERY_CONTEXT.chnk_y; y <= QUERY_CONTEXT.end_chnk_y; y++)
-      for (x = QUERY_CONTEXT.chnk_x; x <= QUERY_CONTEXT.end_chnk_x; x++)
+
+  if (q->is_sparse)
+    {
+      vox_world_query_sparse_clear (q, 0);
+
+      if (!alloc)
+        {
+          vox_world_query_load_sparse (q);
+          q->loaded = 1;
+          return;
+        }
+    }
+
+  for (z = q->chnk_z; z <= q->end_chnk_z; z++)
+    for (y = q->chnk_y; y <= q->end_chnk_y; y++)
+      for (x = q->chnk_x; x <= q->end_chnk_x; x++)
         {
-          int ox = x - QUERY_CONTEXT.chnk_x;
-          int oy = y - QUERY_CONTEXT.chnk_y;
-          int oz = z - QUERY_CONTEXT.chnk_z;
-          vox_chunk *c = QUERY_CHUNK(ox, oy, oz) = vox_world_chunk (x, y, z, alloc);
+          int ox = x - q->chnk_x;
+          int oy = y - q->chnk_y;
+          int oz = z - q->chnk_z;
+          vox_chunk *c = vox_world_chunk (x, y, z, alloc);
+          if (q->is_sparse)
+            {
+              if (c)
+                vox_world_query_sparse_add (q, ox, oy, oz, c);
+            }
+          else
+            QUERY_CHUNK(q, ox, oy, oz) = c;
+
           if (c)
             vox_chunk_clear_changes (c);
         }
-  QUERY_CONTEXT.loaded = 1;
+  q->loaded = 1;
 }
 
 // Compute absolute world coordinates from context relative coordinates.
-void vox_world_query_rel2abs (int *rel_x, int *rel_y, int *rel_z)
+void vox_world_query_rel2abs (vox_world_query *q, int *rel_x, int *rel_y, int *rel_z)
 {
-  *rel_x = QUERY_CONTEXT.chnk_x * CHUNK_SIZE + *rel_x;
-  *rel_y = QUERY_CONTEXT.chnk_y * CHUNK_SIZE + *rel_y;
-  *rel_z = QUERY_CONTEXT.chnk_z * CHUNK_SIZE + *rel_z;
+  *rel_x = q->chnk_x * CHUNK_SIZE + *rel_x;
+  *rel_y = q->chnk_y * CHUNK_SIZE + *rel_y;
+  *rel_z = q->chnk_z * CHUNK_SIZE + *rel_z;
 }
 
 // Compute the context relative coordinates from absolute ones.
-void vox_world_query_abs2rel (int *x, int *y, int *z)
+void vox_world_query_abs2rel (vox_world_query *q, int *x, int *y, int *z)
 {
   vec3_init (pos, *x, *y, *z);
   vec3_s_div (pos, CHUNK_SIZE);
@@ -147,9 +482,9 @@ void vox_world_query_abs2rel (int *x, int *y, int *z)
   *y -= chnk_y * CHUNK_SIZE;
   *z -= chnk_z * CHUNK_SIZE;
 
-  chnk_x -= QUERY_CONTEXT.chnk_x;
-  chnk_y -= QUERY_CONTEXT.chnk_y;
-  chnk_z -= QUERY_CONTEXT.chnk_z;
+  chnk_x -= q->chnk_x;
+  chnk_y -= q->chnk_y;
+  chnk_z -= q->chnk_z;
   assert (chnk_x >= 0);
   assert (chnk_y >= 0);
   assert (chnk_z >= 0);
@@ -159,7 +494,7 @@ void vox_world_query_abs2rel (int *x, int *y, int *z)
   *z += chnk_z * CHUNK_SIZE;
 }
 
-vox_cell *vox_world_query_cell_at (unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, int modify)
+vox_cell *vox_world_query_cell_at (vox_world_query *q, unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, int modify)
 {
   if (rel_x < 0) return 0;
   if (rel_y < 0) return 0;
@@ -172,13 +507,9 @@ vox_cell *vox_world_query_cell_at (unsigned int rel_x, unsigned int rel_y, unsig
       chnk_rel_y = rel_y - chnk_y * CHUNK_SIZE,
       chnk_rel_z = rel_z - chnk_z * CHUNK_SIZE;
 
-  assert (QUERY_CONTEXT.loaded);
+  assert (q->loaded);
 
-  if (chnk_x >= QUERY_CONTEXT.x_w) return 0;
-  if (chnk_y >= QUERY_CONTEXT.y_w) return 0;
-  if (chnk_z >= QUERY_CONTEXT.z_w) return 0;
-
-  vox_chunk *chnk = QUERY_CHUNK(chnk_x, chnk_y, chnk_z);
+  vox_chunk *chnk = vox_world_query_chunk (q, chnk_x, chnk_y, chnk_z);
   if (!chnk)
     return 0;
 
@@ -192,12 +523,22 @@ vox_cell *vox_world_query_cell_at (unsigned int rel_x, unsigned int rel_y, unsig
   return c;
 }
 
-void vox_world_query_set_at_pl (unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, AV *cell)
+// Counts a change of the stored data of the cell, see VOX_CELL_DATA_CHANGED.
+void vox_world_query_cell_changed (vox_world_query *q, unsigned int rel_x, unsigned int rel_y, unsigned int rel_z)
 {
-  vox_cell *c = vox_world_query_cell_at (rel_x, rel_y, rel_z, 1);
+  vox_chunk *chnk =
+    vox_world_query_chunk (q, rel_x / CHUNK_SIZE, rel_y / CHUNK_SIZE, rel_z / CHUNK_SIZE);
+  if (chnk)
+    chnk->gen++;
+}
+
+void vox_world_query_set_at_pl (vox_world_query *q, unsigned int rel_x, unsigned int rel_y, unsigned int rel_z, AV *cell)
+{
+  vox_cell *c = vox_world_query_cell_at (q, rel_x, rel_y, rel_z, 1);
   if (!c)
     return;
 
+  vox_cell old = *c;
   int otype = c->type;
 
   SV **t = av_fetch (cell, 0, 0);
@@ -215,10 +556,119 @@ void vox_world_query_set_at_pl (unsigned int rel_x, unsigned int rel_y, unsigned
   t = av_fetch (cell, 4, 0);
   if (t) c->visible = SvIV (*t);
 
+  if (VOX_CELL_DATA_CHANGED (old, *c))
+    vox_world_query_cell_changed (q, rel_x, rel_y, rel_z);
+
   if (vox_world_is_active (otype) || vox_world_is_active (c->type))
     {
       t = av_fetch (cell, 5, 0);
-      vox_world_query_rel2abs (&rel_x, &rel_y, &rel_z);
-      vox_world_emit_active_cell_change (rel_x, rel_y, rel_z, c, t ? *t : 0);
+      vox_world_query_rel2abs (q, &rel_x, &rel_y, &rel_z);
+      vox_world_query_emit_active_cell_change (q, rel_x, rel_y, rel_z, c, t ? *t : 0);
+    }
+}
+
+/* A cursor points at a cell inside a query context. It caches the chunk
+ * and the offset of the cell inside that chunk, so stepping to the
+ * neighbouring cells only needs an addition and a compare. Only when a
+ * chunk border is crossed the next chunk is looked up using the chunk
+ * strides of the context.
+ */
+typedef struct _vox_query_cursor {
+    vox_world_query *q;
+
+    int pos[3];       // position inside the current chunk
+    int chnk[3];      // context relative chunk coordinates
+    int chnk_idx;     // index of the current chunk in q->chunks
+    int offs;         // offset of the cell in the cells of the chunk
+
+    vox_chunk *chunk; // 0 if outside of the context or chunk not loaded
+} vox_query_cursor;
+
+#define QUERY_CURSOR_X 0
+#define QUERY_CURSOR_Y 1
+#define QUERY_CURSOR_Z 2
+
+static const int QUERY_CURSOR_OFFS_STRIDE[3] = {
+  1, CHUNK_SIZE, CHUNK_SIZE * CHUNK_SIZE
+};
+
+static inline void vox_query_cursor_load_chunk (vox_query_cursor *c)
+{
+  vox_world_query *q = c->q;
+  if (c->chnk[0] < 0 || c->chnk[1] < 0 || c->chnk[2] < 0
+      || c->chnk[0] >= q->x_w
+      || c->chnk[1] >= q->y_w
+      || c->chnk[2] >= q->z_w)
+    c->chunk = 0;
+  else if (q->is_sparse)
+    c->chunk = vox_world_query_sparse_slot (q, c->chnk[0], c->chnk[1], c->chnk[2])->chunk;
+  else
+    c->chunk = q->chunks[c->chnk_idx];
+}
+
+// Positions the cursor at the context relative coordinates.
+void vox_query_cursor_set (vox_query_cursor *c, vox_world_query *q, int rel_x, int rel_y, int rel_z)
+{
+  assert (q->loaded);
+
+  int rel[3] = { rel_x, rel_y, rel_z };
+  int i;
+
+  c->q = q;
+  c->chnk_idx = 0;
+  c->offs = 0;
+  for (i = 0; i < 3; i++)
+    {
+      c->chnk[i] =
+        rel[i] >= 0 ? rel[i] / CHUNK_SIZE
+                    : -((-rel[i] - 1) / CHUNK_SIZE) - 1;
+      c->pos[i] = rel[i] - c->chnk[i] * CHUNK_SIZE;
+      c->chnk_idx += c->chnk[i] * q->chnk_stride[i];
+      c->offs     += c->pos[i] * QUERY_CURSOR_OFFS_STRIDE[i];
     }
+
+  vox_query_cursor_load_chunk (c);
+}
+
+static inline vox_cell *vox_query_cursor_cell (vox_query_cursor *c, int modify)
+{
+  if (!c->chunk)
+    return 0;
+
+  if (modify)
+    c->chunk->dirty = 1;
+
+  return &(c->chunk->cells[c->offs]);
+}
+
+// Moves the cursor by d (+1 or -1) along the axis.
+static inline void vox_query_cursor_step (vox_query_cursor *c, int axis, int d)
+{
+  c->pos[axis] += d;
+  c->offs      += d * QUERY_CURSOR_OFFS_STRIDE[axis];
+
+  if (c->pos[axis] < 0 || c->pos[axis] >= CHUNK_SIZE)
+    {
+      c->pos[axis] -= d * CHUNK_SIZE;
+      c->offs      -= d * CHUNK_SIZE * QUERY_CURSOR_OFFS_STRIDE[axis];
+      c->chnk[axis] += d;
+      c->chnk_idx   += d * c->q->chnk_stride[axis];
+      vox_query_cursor_load_chunk (c);
+    }
+}
+
+// Returns the cell next to the cursor along the axis without moving it.
+static inline vox_cell *vox_query_cursor_neighbour (vox_query_cursor *c, int axis, int d)
+{
+  int p = c->pos[axis] + d;
+  if (p >= 0 && p < CHUNK_SIZE)
+    {
+      if (!c->chunk)
+        return 0;
+      return &(c->chunk->cells[c->offs + d * QUERY_CURSOR_OFFS_STRIDE[axis]]);
+    }
+
+  vox_query_cursor n = *c;
+  vox_query_cursor_step (&n, axis, d);
+  return vox_query_cursor_cell (&n, 0);
 }